@@ -29,6 +29,8 @@ struct resp_type_strings resp_type_str_arr[] = {
 	{RESP_LIST_CHANNELS_IN_PROGRESS,	"RESP_LIST_CHANNELS_IN_PROGRESS"},
 	{RESP_CANNOT_FIND_CHANNEL,		"RESP_CANNOT_FIND_CHANNEL"},
 	{RESP_CANNOT_LIST_CHANNELS,		"RESP_CANNOT_LIST_CHANNELS"},
+	{RESP_USER_NOT_ONLINE,			"RESP_USER_NOT_ONLINE"},
+	{RESP_NO_HISTORY,			"RESP_NO_HISTORY"},
 	/* Last entry requires NULL string for looping purposes */
 	{0 , NULL},
 };
@@ -60,6 +62,9 @@ static struct msg_type_strings msg_type_str_arr[] = {
 	{CHAT,			"MSG_TYPE_CHAT"},
 	{LIST_CHANNELS,		"MSG_TYPE_LIST_CHANNELS"},
 	{LIST_USERS,		"MSG_TYPE_LIST_USERS"},
+	{HELLO,			"MSG_TYPE_HELLO"},
+	{DIRECT,		"MSG_TYPE_DIRECT"},
+	{HISTORY,		"MSG_TYPE_HISTORY"},
 	/* Last entry requires NULL string for looping purposes */
 	{0 , NULL},
 };
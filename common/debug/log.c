@@ -0,0 +1,450 @@
+/**
+ * log.c - Asynchronous logger for hot paths
+ * Author: Brett Creeley
+ *
+ * Note: The ring is a bounded multi producer queue where every slot carries
+ *	 a sequence number. A producer claims a slot by advancing enqueue_pos
+ *	 with a compare and swap and publishes it by bumping the slot's
+ *	 sequence, so producers never wait on each other or on the flusher.
+ *	 Only one consumer drains the ring at a time, which is the flusher
+ *	 thread unless log_flush() is called directly, e.g. at exit().
+ */
+
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#define LOG_RING_SIZE		4096	/* must be a power of 2 */
+#define LOG_FLUSH_INTERVAL_US	1000
+#define LOG_LEVEL_ENV		"PDX_IRC_LOG_LEVEL"
+
+/* Argument value standing for the string copied by LOG_STR() */
+#define LOG_STR_ARG		UINT64_MAX
+
+/**
+ * struct log_record - one log call, formatted by the flusher
+ * @ts_ns: CLOCK_REALTIME of the call
+ * @func: function that logged
+ * @fmt: printf() like format string
+ * @line: line that logged
+ * @level: enum log_level
+ * @nargs: number of valid args
+ * @has_str: str holds the string of a LOG_STR() argument
+ * @err: errno at the time of the call, printed by "%m"
+ * @args: arguments of fmt
+ * @str: copy of the LOG_STR() argument, NUL terminated
+ */
+struct log_record {
+	uint64_t ts_ns;
+	const char *func;
+	const char *fmt;
+	uint32_t line;
+	uint8_t level;
+	uint8_t nargs;
+	bool has_str;
+	int err;
+	uint64_t args[LOG_MAX_ARGS];
+	char str[LOG_STR_LEN];
+};
+
+/**
+ * struct log_slot - a slot of the ring
+ * @seq: equals the enqueue position the slot is free for, one more than that
+ *	 once the record was published
+ * @rec: the record
+ */
+struct log_slot {
+	atomic_uint_fast64_t seq;
+	struct log_record rec;
+};
+
+enum log_level log_level = LOG_LEVEL_INFO;
+
+static struct log_slot *ring;
+static atomic_uint_fast64_t enqueue_pos;
+static atomic_uint_fast64_t num_dropped;
+
+/* Consumer side, protected by consumer_lock */
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t dequeue_pos;
+static uint64_t reported_dropped;
+
+/* String of the next record written by this thread, set by LOG_STR() */
+static __thread char str_stash[LOG_STR_LEN];
+static __thread bool str_stashed;
+
+static const char *level_names[] = {
+	[LOG_LEVEL_ERR] = "ERR",
+	[LOG_LEVEL_WARN] = "WARN",
+	[LOG_LEVEL_INFO] = "INFO",
+	[LOG_LEVEL_DEBUG] = "DEBUG",
+};
+
+/**
+ * log_str - copy a string for the record being logged by this thread
+ * @str: string that may not outlive the call
+ *
+ * Returns the argument value that makes "%s" print the copy
+ */
+uint64_t log_str(const char *str)
+{
+	strncpy(str_stash, str ? str : "(null)", LOG_STR_LEN - 1);
+	str_stash[LOG_STR_LEN - 1] = '\0';
+	str_stashed = true;
+
+	return LOG_STR_ARG;
+}
+
+/* Print one integer conversion, spec has no length modifier yet */
+static void print_int(FILE *f, char *spec, size_t len, const char *lmod,
+		      char conv, uint64_t val)
+{
+	bool is_signed = conv == 'd' || conv == 'i';
+	long long sval = (long long)val;
+	unsigned long long uval = val;
+
+	/* Narrow to the argument's original type, then print it as long long */
+	if (!strcmp(lmod, "hh")) {
+		sval = (signed char)val;
+		uval = (unsigned char)val;
+	} else if (!strcmp(lmod, "h")) {
+		sval = (short)val;
+		uval = (unsigned short)val;
+	} else if (!strcmp(lmod, "l")) {
+		sval = (long)val;
+		uval = (unsigned long)val;
+	} else if (!strcmp(lmod, "z")) {
+		sval = (ssize_t)val;
+		uval = (size_t)val;
+	} else if (!lmod[0]) {
+		sval = (int)val;
+		uval = (unsigned int)val;
+	}
+
+	spec[len] = 'l';
+	spec[len + 1] = 'l';
+	spec[len + 2] = conv;
+	spec[len + 3] = '\0';
+
+	if (is_signed)
+		fprintf(f, spec, sval);
+	else
+		fprintf(f, spec, uval);
+}
+
+/**
+ * log_print_record - format a record the way printf() would have
+ * @f: where to print to
+ * @r: the record
+ *
+ * Only integer, character, pointer and string conversions are supported.
+ */
+static void log_print_record(FILE *f, const struct log_record *r)
+{
+	time_t secs = r->ts_ns / 1000000000ULL;
+	const char *p = r->fmt;
+	uint32_t arg = 0;
+	struct tm tm;
+
+	localtime_r(&secs, &tm);
+	fprintf(f, "[%02d:%02d:%02d.%06u] %s [%s:%u] ", tm.tm_hour, tm.tm_min,
+		tm.tm_sec, (uint32_t)(r->ts_ns % 1000000000ULL / 1000),
+		level_names[r->level], r->func, r->line);
+
+	while (*p) {
+		const char *start = p;
+		char spec[32], lmod[3];
+		size_t len, lmod_len;
+		uint64_t val;
+		char conv;
+
+		p = strchrnul(start, '%');
+		fwrite(start, 1, p - start, f);
+		if (!*p)
+			break;
+
+		start = p++;
+		if (*p == '%' || *p == 'm') {
+			if (*p == '%')
+				fputc('%', f);
+			else
+				fputs(strerror(r->err), f);
+			++p;
+			continue;
+		}
+
+		p += strspn(p, "-+ #0");
+		p += strspn(p, "0123456789");
+		if (*p == '.') {
+			++p;
+			p += strspn(p, "0123456789");
+		}
+
+		/* Flags, width and precision are kept, the length is redone */
+		len = p - start;
+		lmod_len = strspn(p, "hljzt");
+		if (lmod_len > 2 || len + 4 > sizeof(spec)) {
+			fputs("(bad format)", f);
+			return;
+		}
+		memcpy(spec, start, len);
+		memcpy(lmod, p, lmod_len);
+		lmod[lmod_len] = '\0';
+		p += lmod_len;
+		conv = *p++;
+
+		val = arg < r->nargs ? r->args[arg++] : 0;
+		switch (conv) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			print_int(f, spec, len, lmod, conv, val);
+			break;
+		case 'c':
+			spec[len] = conv;
+			spec[len + 1] = '\0';
+			fprintf(f, spec, (int)val);
+			break;
+		case 'p':
+			spec[len] = conv;
+			spec[len + 1] = '\0';
+			fprintf(f, spec, (void *)(uintptr_t)val);
+			break;
+		case 's': {
+			const char *str = (const char *)(uintptr_t)val;
+
+			if (val == LOG_STR_ARG && r->has_str)
+				str = r->str;
+			spec[len] = conv;
+			spec[len + 1] = '\0';
+			fprintf(f, spec, str ? str : "(null)");
+			break;
+		}
+		default:
+			fputs("(bad format)", f);
+			return;
+		}
+	}
+}
+
+/**
+ * log_drain - format and print every published record
+ *
+ * Returns the number of lines printed
+ */
+static uint32_t log_drain(void)
+{
+	uint64_t dropped;
+	uint32_t n = 0;
+
+	pthread_mutex_lock(&consumer_lock);
+	while (1) {
+		struct log_slot *slot = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+		uint64_t seq;
+
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq != dequeue_pos + 1)
+			break;
+
+		log_print_record(stdout, &slot->rec);
+		/* Free the slot for the producer one lap ahead */
+		atomic_store_explicit(&slot->seq, dequeue_pos + LOG_RING_SIZE,
+				      memory_order_release);
+		++dequeue_pos;
+		++n;
+	}
+
+	dropped = atomic_load_explicit(&num_dropped, memory_order_relaxed);
+	if (dropped != reported_dropped) {
+		printf("[log] ring full, dropped %" PRIu64 " records\n",
+		       dropped - reported_dropped);
+		reported_dropped = dropped;
+		++n;
+	}
+
+	if (n)
+		fflush(stdout);
+	pthread_mutex_unlock(&consumer_lock);
+
+	return n;
+}
+
+/**
+ * log_flush - print everything logged so far on the calling thread
+ *
+ * Registered with atexit() so records logged right before a fatal exit() are
+ * not lost.
+ */
+void log_flush(void)
+{
+	if (ring)
+		log_drain();
+}
+
+static void *log_flusher(void *arg)
+{
+	while (1) {
+		if (!log_drain())
+			usleep(LOG_FLUSH_INTERVAL_US);
+	}
+
+	return NULL;
+}
+
+/**
+ * log_write - add a record to the ring, see the log_*() macros
+ * @level: enum log_level of the record
+ * @func: function that logged
+ * @line: line that logged
+ * @fmt: format string, must be a string literal
+ * @nargs: number of arguments, at most LOG_MAX_ARGS
+ * @args: arguments of fmt
+ *
+ * Never blocks, the record is dropped if the ring is full. Before log_init()
+ * the record is printed right away instead.
+ */
+void log_write(enum log_level level, const char *func, uint32_t line,
+	       const char *fmt, uint32_t nargs, const uint64_t *args)
+{
+	struct log_record *r, direct;
+	struct log_slot *slot = NULL;
+	int err = errno;
+	struct timespec ts;
+	uint64_t pos;
+
+	if (ring) {
+		pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+		while (1) {
+			int64_t diff;
+
+			slot = &ring[pos & (LOG_RING_SIZE - 1)];
+			diff = (int64_t)(atomic_load_explicit(&slot->seq,
+						memory_order_acquire) - pos);
+			if (!diff) {
+				if (atomic_compare_exchange_weak_explicit(
+						&enqueue_pos, &pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				/* The flusher is a whole lap behind */
+				atomic_fetch_add_explicit(&num_dropped, 1,
+							  memory_order_relaxed);
+				str_stashed = false;
+				return;
+			} else {
+				pos = atomic_load_explicit(&enqueue_pos,
+							   memory_order_relaxed);
+			}
+		}
+		r = &slot->rec;
+	} else {
+		r = &direct;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->func = func;
+	r->fmt = fmt;
+	r->line = line;
+	r->level = level;
+	r->nargs = nargs < LOG_MAX_ARGS ? nargs : LOG_MAX_ARGS;
+	r->err = err;
+	memcpy(r->args, args, r->nargs * sizeof(*args));
+	r->has_str = str_stashed;
+	if (str_stashed) {
+		memcpy(r->str, str_stash, LOG_STR_LEN);
+		str_stashed = false;
+	}
+
+	if (slot) {
+		atomic_store_explicit(&slot->seq, pos + 1,
+				      memory_order_release);
+		return;
+	}
+
+	pthread_mutex_lock(&consumer_lock);
+	log_print_record(stdout, r);
+	fflush(stdout);
+	pthread_mutex_unlock(&consumer_lock);
+}
+
+static void log_level_from_env(void)
+{
+	const char *env = getenv(LOG_LEVEL_ENV);
+	int i;
+
+	if (!env)
+		return;
+
+	for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); ++i) {
+		if (!strcasecmp(env, level_names[i])) {
+			log_level = i;
+			return;
+		}
+	}
+
+	printf("Unknown %s=%s, logging at %s\n", LOG_LEVEL_ENV, env,
+	       level_names[log_level]);
+}
+
+/**
+ * log_init - allocate the ring and start the flusher thread
+ *
+ * The level is taken from the PDX_IRC_LOG_LEVEL environment variable, one of
+ * err, warn, info (default) or debug. Call this before any other thread is
+ * started.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int log_init(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+	uint64_t i;
+	int ret;
+
+	log_level_from_env();
+
+	ring = calloc(LOG_RING_SIZE, sizeof(*ring));
+	if (!ring) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (i = 0; i < LOG_RING_SIZE; ++i)
+		atomic_init(&ring[i].seq, i);
+
+	/* Signals are for the threads that asked for them, not the flusher */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, log_flusher, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		free(ring);
+		ring = NULL;
+		return -1;
+	}
+	pthread_detach(thread);
+
+	atexit(log_flush);
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * log.h - Asynchronous logger for hot paths
+ * Author: Brett Creeley
+ *
+ * Note: Logging only writes a fixed size record into a lock-free ring, the
+ *	 format string and its arguments are formatted and written out later
+ *	 by a background flusher thread. A slow stdout therefore never stalls
+ *	 the thread that logged, once the ring is full records are dropped
+ *	 and counted instead.
+ *
+ *	 Arguments are stored as 64 bit integers, so the format string must
+ *	 be a string literal and every argument an integer, a "%s" argument
+ *	 must be a string that is never freed (a literal, __func__) wrapped
+ *	 in LOG_STATIC_STR(). Wrap any other string in LOG_STR(), which
+ *	 copies up to LOG_STR_LEN bytes of it into the record, at most once
+ *	 per record. "%m" prints the errno at the time of the call like
+ *	 glibc's printf().
+ */
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdint.h>
+
+#define LOG_MAX_ARGS	10
+#define LOG_STR_LEN	48
+
+enum log_level {
+	LOG_LEVEL_ERR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+};
+
+/* Records above this level are skipped before any argument is evaluated */
+extern enum log_level log_level;
+
+int log_init(void);
+void log_flush(void);
+uint64_t log_str(const char *str);
+void log_write(enum log_level level, const char *func, uint32_t line,
+	       const char *fmt, uint32_t nargs, const uint64_t *args);
+
+#define LOG_STR(str)		log_str(str)
+#define LOG_STATIC_STR(str)	((uintptr_t)(const char *)(str))
+
+#define log_printf(level, fmt, ...)						\
+	do {									\
+		if ((level) <= log_level) {					\
+			const uint64_t __args[] = { __VA_ARGS__ };		\
+										\
+			_Static_assert(sizeof(__args) / sizeof(uint64_t) <=	\
+				       LOG_MAX_ARGS, "too many log arguments");	\
+			log_write(level, __func__, __LINE__, fmt,		\
+				  sizeof(__args) / sizeof(uint64_t), __args);	\
+		}								\
+	} while (0)
+
+#define log_err(fmt, ...)	log_printf(LOG_LEVEL_ERR, fmt, ##__VA_ARGS__)
+#define log_warn(fmt, ...)	log_printf(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define log_info(fmt, ...)	log_printf(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define log_debug(fmt, ...)	log_printf(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+#endif /* _LOG_H */
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "epoll_helpers.h"
+#include "../debug/log.h"
 
 int add_epoll_member(int epollfd, int memberfd, uint32_t subscribe_events)
 {
@@ -31,6 +32,29 @@ int rm_epoll_member(int epollfd, int memberfd)
 	return 0;
 }
 
+/**
+ * mod_epoll_member - change the events an existing member is subscribed to
+ * @epollfd: epoll instance memberfd was added to
+ * @memberfd: fd to modify
+ * @subscribe_events: new set of events, replaces the old set
+ *
+ * This is safe to call from a thread other than the one in epoll_wait().
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int mod_epoll_member(int epollfd, int memberfd, uint32_t subscribe_events)
+{
+	struct epoll_event epoll_ev;
+
+	epoll_ev.events = subscribe_events;
+	epoll_ev.data.fd = memberfd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, memberfd, &epoll_ev) == -1) {
+		perror("epoll_ctl: modfd");
+		return -1;
+	}
+
+	return 0;
+}
 
 int create_epoll_manager(int *epollfd)
 {
@@ -46,33 +70,52 @@ int create_epoll_manager(int *epollfd)
 	return 0;
 }
 
-int accept_new_epoll_member(int epollfd, int listenfd)
+/**
+ * accept_new_epoll_member - accept a client and add it to the epoll instance
+ * @epollfd: epoll instance to add the new client to
+ * @listenfd: listening socket with a pending connection
+ * @flags: extra epoll flags for the client on top of SOCKET_EPOLL_NEW_MEMBER,
+ *	   i.e. EPOLLET or 0
+ *
+ * The accepted socket is non-blocking so a slow or misbehaving peer can never
+ * stall the caller's event loop.
+ *
+ * Returns the new client's fd on success, otherwise -1
+ */
+int accept_new_epoll_member(int epollfd, int listenfd, uint32_t flags)
 {
 	int clientfd;
 
-	clientfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
+	clientfd = accept4(listenfd, (struct sockaddr *)NULL, NULL,
+			   SOCK_NONBLOCK);
 	if (clientfd == -1) {
 		perror("accept");
 		return -1;
 	}
 
-	if (add_epoll_member(epollfd, clientfd, SOCKET_EPOLL_NEW_MEMBER))
+	if (add_epoll_member(epollfd, clientfd,
+			     SOCKET_EPOLL_NEW_MEMBER | flags)) {
+		close(clientfd);
 		return -1;
+	}
 
-	return 0;
+	return clientfd;
 }
 
+/* Logged at debug level, every name is a literal so it's only formatted later */
 void debug_print_epoll_event(int eventfd, uint32_t event_mask)
 {
-	printf("fd=%d; events:%s%s%s%s%s%s%s%s\n",
-	       eventfd,
-	       (event_mask & EPOLLIN)      ? " EPOLLIN"      : "",
-	       (event_mask & EPOLLPRI)     ? " EPOLLPRI"     : "",
-	       (event_mask & EPOLLRDHUP)   ? " EPOLLRDHUP"   : "",
-	       (event_mask & EPOLLOUT)     ? " EPOLLOUT"     : "",
-	       (event_mask & EPOLLET)      ? " EPOLLET"      : "",
-	       (event_mask & EPOLLONESHOT) ? " EPOLLONESHOT" : "",
-	       (event_mask & EPOLLERR)     ? " EPOLLERR"     : "",
-	       (event_mask & EPOLLHUP)     ? " EPOLLHUP"     : "");
+#define EV_NAME(ev)	LOG_STATIC_STR((event_mask & (ev)) ? " " #ev : "")
+	log_debug("fd=%d; events:%s%s%s%s%s%s%s%s\n",
+		  eventfd,
+		  EV_NAME(EPOLLIN),
+		  EV_NAME(EPOLLPRI),
+		  EV_NAME(EPOLLRDHUP),
+		  EV_NAME(EPOLLOUT),
+		  EV_NAME(EPOLLET),
+		  EV_NAME(EPOLLONESHOT),
+		  EV_NAME(EPOLLERR),
+		  EV_NAME(EPOLLHUP));
+#undef EV_NAME
 }
 
@@ -5,6 +5,8 @@
 
 #define SOCKET_EPOLL_DISCONNECT (EPOLLIN | EPOLLRDHUP)
 #define SOCKET_EPOLL_NEW_MEMBER (EPOLLIN | EPOLLRDHUP)
+/* Same as a new member, but also wait for room in the socket's send buffer */
+#define SOCKET_EPOLL_WANT_OUT (SOCKET_EPOLL_NEW_MEMBER | EPOLLOUT)
 
 #define for_each_epoll_event(i, nfds) \
 	for (i = 0; i < nfds; ++i)
@@ -12,7 +14,8 @@
 int create_epoll_manager(int *epollfd);
 int add_epoll_member(int epollfd, int memberfd, uint32_t subscribe_events);
 int rm_epoll_member(int epollfd, int memberfd);
-int accept_new_epoll_member(int epollfd, int listenfd);
+int mod_epoll_member(int epollfd, int memberfd, uint32_t subscribe_events);
+int accept_new_epoll_member(int epollfd, int listenfd, uint32_t flags);
 void debug_print_epoll_event(int eventfd, uint32_t event_mask);
 
 #endif /* _EPOLL_HELPERS_H */
@@ -0,0 +1,340 @@
+/**
+ * hash_table.c - Open addressing hash table with incremental resizing
+ * Author: Brett Creeley
+ */
+
+#include "hash_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_MIN_SIZE		16
+/* Buckets migrated from the old array on every insert/remove */
+#define HASH_MIGRATE_STEP	8
+
+/* Marks a bucket whose item was removed so probing continues past it */
+static char tombstone;
+#define HASH_TOMBSTONE ((void *)&tombstone)
+
+static inline const void *item_key(struct hash_table *ht, void *item)
+{
+	return (const char *)item + ht->key_offset;
+}
+
+static uint32_t hash_key(const void *key, size_t len)
+{
+	const uint8_t *p = key;
+	uint64_t h = 0xcbf29ce484222325ULL ^ len;
+
+	/* Mix a word at a time, channel/user names are exactly 2 words */
+	while (len >= sizeof(uint64_t)) {
+		uint64_t w;
+
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+		p += sizeof(w);
+		len -= sizeof(w);
+	}
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	h ^= h >> 29;
+
+	return (uint32_t)h;
+}
+
+static int hash_array_alloc(struct hash_array *arr, uint32_t size)
+{
+	arr->items = calloc(size, sizeof(*arr->items));
+	if (!arr->items) {
+		perror("calloc");
+		return -1;
+	}
+
+	arr->hashes = calloc(size, sizeof(*arr->hashes));
+	if (!arr->hashes) {
+		perror("calloc");
+		free(arr->items);
+		arr->items = NULL;
+		return -1;
+	}
+
+	arr->size = size;
+	arr->used = 0;
+
+	return 0;
+}
+
+static void hash_array_free(struct hash_array *arr)
+{
+	free(arr->items);
+	free(arr->hashes);
+	memset(arr, 0, sizeof(*arr));
+}
+
+/**
+ * hash_array_find - find the bucket holding key
+ * @ht: table the array belongs to
+ * @arr: array to search
+ * @key: key to look for
+ * @hash: hash of key
+ *
+ * Returns the bucket index or -1 if key is not in arr
+ */
+static int64_t hash_array_find(struct hash_table *ht, struct hash_array *arr,
+			       const void *key, uint32_t hash)
+{
+	uint32_t mask = arr->size - 1;
+	uint32_t i;
+
+	if (!arr->items)
+		return -1;
+
+	for (i = hash & mask; arr->items[i] != NULL; i = (i + 1) & mask) {
+		void *item = arr->items[i];
+
+		if (item == HASH_TOMBSTONE || arr->hashes[i] != hash)
+			continue;
+
+		if (memcmp(item_key(ht, item), key, ht->key_len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Caller guarantees the item isn't already in arr and arr has a free bucket */
+static void hash_array_add(struct hash_array *arr, void *item, uint32_t hash)
+{
+	uint32_t mask = arr->size - 1;
+	uint32_t i;
+
+	for (i = hash & mask; arr->items[i] != NULL; i = (i + 1) & mask)
+		if (arr->items[i] == HASH_TOMBSTONE)
+			break;
+
+	if (arr->items[i] == NULL)
+		++arr->used;
+	arr->items[i] = item;
+	arr->hashes[i] = hash;
+}
+
+/* Move up to step buckets from the old array into the current one */
+static void hash_table_migrate(struct hash_table *ht, uint32_t step)
+{
+	struct hash_array *old = &ht->old;
+
+	if (!old->items)
+		return;
+
+	while (step-- && ht->migrate_idx < old->size) {
+		uint32_t i = ht->migrate_idx++;
+		void *item = old->items[i];
+
+		if (!item || item == HASH_TOMBSTONE)
+			continue;
+
+		hash_array_add(&ht->cur, item, old->hashes[i]);
+		/* Leave a tombstone so probe chains through i stay intact */
+		old->items[i] = HASH_TOMBSTONE;
+	}
+
+	if (ht->migrate_idx == old->size) {
+		hash_array_free(old);
+		ht->migrate_idx = 0;
+	}
+}
+
+/* Make sure the current array has room for one more item */
+static int hash_table_reserve(struct hash_table *ht)
+{
+	struct hash_array *cur = &ht->cur;
+	uint64_t needed;
+	uint32_t size = HASH_MIN_SIZE;
+
+	/* Keep the load factor, tombstones included, under 3/4 */
+	if ((uint64_t)(cur->used + 1) * 4 <= (uint64_t)cur->size * 3)
+		return 0;
+
+	/* The new array is sized so this is always done already */
+	hash_table_migrate(ht, UINT32_MAX);
+
+	/* Leave room for every live item plus whatever inserts and removes can
+	 * happen before the migration of the current array finishes.
+	 */
+	needed = ht->count + 1 + 2 * (cur->size / HASH_MIGRATE_STEP);
+	while ((uint64_t)size * 3 < needed * 8)
+		size <<= 1;
+
+	ht->old = *cur;
+	if (hash_array_alloc(cur, size)) {
+		*cur = ht->old;
+		memset(&ht->old, 0, sizeof(ht->old));
+		return -1;
+	}
+	ht->migrate_idx = 0;
+
+	return 0;
+}
+
+/**
+ * hash_table_init - initialize an empty table
+ * @ht: table to initialize
+ * @key_offset: offset of the key within each item, i.e. offsetof()
+ * @key_len: size of the key in bytes
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int hash_table_init(struct hash_table *ht, size_t key_offset, size_t key_len)
+{
+	if (!ht || !key_len)
+		return -1;
+
+	memset(ht, 0, sizeof(*ht));
+	ht->key_offset = key_offset;
+	ht->key_len = key_len;
+
+	return hash_array_alloc(&ht->cur, HASH_MIN_SIZE);
+}
+
+/**
+ * hash_table_destroy - free the table's buckets
+ * @ht: table to destroy
+ *
+ * Note: The items themselves are owned by the caller and are not freed.
+ */
+void hash_table_destroy(struct hash_table *ht)
+{
+	if (!ht)
+		return;
+
+	hash_array_free(&ht->cur);
+	hash_array_free(&ht->old);
+	ht->count = 0;
+}
+
+/**
+ * hash_table_lookup - find the item with a matching key
+ * @ht: table to search
+ * @key: key_len bytes to look for
+ *
+ * Returns the matching item or NULL if there is none
+ */
+void *hash_table_lookup(struct hash_table *ht, const void *key)
+{
+	uint32_t hash;
+	int64_t i;
+
+	if (!ht || !key)
+		return NULL;
+
+	hash = hash_key(key, ht->key_len);
+
+	i = hash_array_find(ht, &ht->cur, key, hash);
+	if (i >= 0)
+		return ht->cur.items[i];
+
+	i = hash_array_find(ht, &ht->old, key, hash);
+	if (i >= 0)
+		return ht->old.items[i];
+
+	return NULL;
+}
+
+/**
+ * hash_table_insert - add an item to the table
+ * @ht: table to add to
+ * @item: item to add, its key is read at key_offset
+ *
+ * Returns 0 on success, otherwise -1 if an item with the same key is already
+ * in the table or memory could not be allocated
+ */
+int hash_table_insert(struct hash_table *ht, void *item)
+{
+	const void *key;
+	uint32_t hash;
+
+	if (!ht || !item)
+		return -1;
+
+	key = item_key(ht, item);
+	if (hash_table_lookup(ht, key))
+		return -1;
+
+	if (hash_table_reserve(ht))
+		return -1;
+
+	hash = hash_key(key, ht->key_len);
+	hash_array_add(&ht->cur, item, hash);
+	++ht->count;
+
+	hash_table_migrate(ht, HASH_MIGRATE_STEP);
+
+	return 0;
+}
+
+/**
+ * hash_table_remove - remove the item with a matching key
+ * @ht: table to remove from
+ * @key: key_len bytes to look for
+ *
+ * Returns the removed item or NULL if there is none
+ */
+void *hash_table_remove(struct hash_table *ht, const void *key)
+{
+	struct hash_array *arr = &ht->cur;
+	void *item = NULL;
+	uint32_t hash;
+	int64_t i;
+
+	if (!ht || !key)
+		return NULL;
+
+	hash = hash_key(key, ht->key_len);
+
+	i = hash_array_find(ht, arr, key, hash);
+	if (i < 0) {
+		arr = &ht->old;
+		i = hash_array_find(ht, arr, key, hash);
+	}
+
+	if (i >= 0) {
+		item = arr->items[i];
+		arr->items[i] = HASH_TOMBSTONE;
+		--ht->count;
+	}
+
+	hash_table_migrate(ht, HASH_MIGRATE_STEP);
+
+	return item;
+}
+
+/**
+ * hash_table_next - iterate over every item in the table
+ * @ht: table to iterate over
+ * @iter: iteration cursor, must be 0 for the first call
+ *
+ * Returns the next item or NULL once every item has been visited
+ */
+void *hash_table_next(struct hash_table *ht, uint32_t *iter)
+{
+	struct hash_array *old = &ht->old;
+	struct hash_array *cur = &ht->cur;
+
+	while (*iter < old->size + cur->size) {
+		uint32_t i = (*iter)++;
+		void *item;
+
+		if (i < old->size)
+			item = old->items[i];
+		else
+			item = cur->items[i - old->size];
+
+		if (item && item != HASH_TOMBSTONE)
+			return item;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,71 @@
+/**
+ * hash_table.h - Open addressing hash table with incremental resizing
+ * Author: Brett Creeley
+ *
+ * Note: The table stores pointers to items and reads each item's key straight
+ *	 out of the item at key_offset, so no separate node is allocated per
+ *	 item. Keys are fixed length and compared with memcmp(), so string keys
+ *	 (i.e. channel names) must be zero padded out to key_len.
+ *
+ *	 Lookups never modify the table, so any number of readers can share it
+ *	 as long as inserts and removes are serialized against them.
+ */
+#ifndef _HASH_TABLE_H
+#define _HASH_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * struct hash_array - one generation of buckets
+ * @items: bucket array, each entry is NULL, a tombstone or an item
+ * @hashes: cached hash of each bucket's item to skip most key compares
+ * @size: number of buckets, always a power of 2
+ * @used: number of buckets that are not NULL (items and tombstones)
+ */
+struct hash_array {
+	void **items;
+	uint32_t *hashes;
+	uint32_t size;
+	uint32_t used;
+};
+
+/**
+ * struct hash_table - hash table handle
+ * @cur: buckets all new items are inserted into
+ * @old: buckets being migrated into cur, items is NULL when not resizing
+ * @migrate_idx: next bucket of old to migrate
+ * @count: number of items in the table
+ * @key_offset: offset of the key within each item
+ * @key_len: length of the key in bytes
+ *
+ * Growing the table doesn't rehash every item at once. Instead each insert and
+ * remove migrates a few buckets from old into cur, so no single operation has
+ * to pay for rehashing the whole table.
+ */
+struct hash_table {
+	struct hash_array cur;
+	struct hash_array old;
+	uint32_t migrate_idx;
+	uint32_t count;
+	size_t key_offset;
+	size_t key_len;
+};
+
+int hash_table_init(struct hash_table *ht, size_t key_offset, size_t key_len);
+void hash_table_destroy(struct hash_table *ht);
+void *hash_table_lookup(struct hash_table *ht, const void *key);
+int hash_table_insert(struct hash_table *ht, void *item);
+void *hash_table_remove(struct hash_table *ht, const void *key);
+void *hash_table_next(struct hash_table *ht, uint32_t *iter);
+
+static inline uint32_t hash_table_count(struct hash_table *ht)
+{
+	return ht->count;
+}
+
+/* Visit every item, the table must not be modified while iterating */
+#define hash_table_for_each(ht, iter, item) \
+	for (iter = 0; (item = hash_table_next(ht, &iter)) != NULL;)
+
+#endif /* _HASH_TABLE_H */
@@ -1,103 +1,91 @@
 #include "list.h"
+#include "../pool/pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-int add_channel(struct list_node **head, char *channel_name)
-{
-		struct list_node *add_node;
-		struct channel *c;
-
-		if (!channel_name)
-			return -1;
-
-		c = calloc(1, sizeof(*c));
-		if (!c) {
-			perror("calloc");
-			return -1;
-		}
-
-		add_node = calloc(1, sizeof(*add_node));
-		if (!add_node) {
-			perror("malloc");
-			free(c);
-			return -1;
-		}
-
-		strncpy(c->name, channel_name, CHANNEL_NAME_MAX_LEN);
-		add_node->data = c;
-		if (add_list_node(head, add_node)) {
-			printf("Failed to add channel node\n");
-			free(c);
-			free(add_node);
-			return -1;
-		}
+#define LIST_OBJS_PER_SLAB	256
 
-	return 0;
+static struct pool channel_pool;
+static struct pool user_pool;
+static pthread_once_t list_pools_once = PTHREAD_ONCE_INIT;
+
+static void list_pools_init(void)
+{
+	if (pool_init(&channel_pool, "channel", sizeof(struct channel),
+		      LIST_OBJS_PER_SLAB, true) ||
+	    pool_init(&user_pool, "user", sizeof(struct user),
+		      LIST_OBJS_PER_SLAB, true)) {
+		printf("Failed to initialize list pools\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
-bool is_equal_channels(void *c1, void *c2)
+struct channel *alloc_channel(void)
 {
-	char *c1_name, *c2_name;
+	pthread_once(&list_pools_once, list_pools_init);
 
-	if (!c1 || !c2)
-		return false;
+	return pool_zalloc(&channel_pool);
+}
 
-	c1_name = ((struct channel *)c1)->name;
-	c2_name = ((struct channel *)c2)->name;
-	if (strcmp(c1_name, c2_name) == 0)
-		return true;
+void free_channel(struct channel *c)
+{
+	pool_free(&channel_pool, c);
+}
 
-	return false;
+struct user *alloc_user(void)
+{
+	pthread_once(&list_pools_once, list_pools_init);
+
+	return pool_zalloc(&user_pool);
 }
 
-int add_user(struct list_node **head, char *username)
+void free_user(struct user *u)
 {
-	struct list_node *add_node;
-	struct user *u;
+	pool_free(&user_pool, u);
+}
 
-	if (!username)
-		return -1;
+int add_channel(struct list_node **head, char *channel_name)
+{
+	struct channel *c;
 
-	u = calloc(1, sizeof(*u));
-	if (!u) {
-		perror("calloc");
+	if (!channel_name)
 		return -1;
-	}
 
-	add_node = calloc(1, sizeof(*add_node));
-	if (!add_node) {
-		perror("malloc");
-		free(u);
+	c = alloc_channel();
+	if (!c)
 		return -1;
-	}
 
-	strncpy(u->name, username, USER_NAME_MAX_LEN);
-	add_node->data = u;
-	if (add_list_node(head, add_node)) {
+	strncpy(c->name, channel_name, CHANNEL_NAME_MAX_LEN);
+	if (add_list_node(head, &c->node)) {
 		printf("Failed to add channel node\n");
-		free(u);
-		free(add_node);
+		free_channel(c);
 		return -1;
 	}
 
 	return 0;
 }
 
-bool is_equal_users(void *u1, void *u2)
+int add_user(struct list_node **head, char *username)
 {
-	struct user *user1, *user2;
+	struct user *u;
 
-	if (!u1 || !u2)
-		return false;
+	if (!username)
+		return -1;
 
-	user1 = u1;
-	user2 = u2;
+	u = alloc_user();
+	if (!u)
+		return -1;
 
-	if (user1->fd == user2->fd)/* && strcmp(user1->name, user2->name) == 0)*/
-		return true;
+	strncpy(u->name, username, USER_NAME_MAX_LEN);
+	if (add_list_node(head, &u->node)) {
+		printf("Failed to add user node\n");
+		free_user(u);
+		return -1;
+	}
 
-	return false;
+	return 0;
 }
 
 /**
@@ -126,61 +114,16 @@ int add_list_node(struct list_node **head, struct list_node *add)
 	return 0;
 }
 
-/**
- * rm_list_node - removes a list_node from the list and returns it
- *
- * @head - pointer to the head of the list so it can be updated if needed
- * @data - data to find in a list_node of the list pointed to by *head
- * @is_equal - function used for comparing data sent in with list_node data
- *
- * Returns the list_node with data matching the passed in data on success,
- * otherwise returns NULL when a list_node with matching data cannot be found.
- * Note: This function does not free the list_node but returns it after
- * reconnecting the nodes around the found list_node.
- */
-struct list_node *rm_list_node(struct list_node **head, void *data,
-			       bool (*is_equal)(void *d1, void *d2))
-{
-	struct list_node *tmp = *head;
-
-	if (!tmp || !data)
-		return NULL;
-
-	/* If the head of the list matches the data sent in */
-	if (is_equal(tmp->data, data)) {
-	       *head = (*head)->next;
-		return tmp;
-	}
-
-	while (tmp->next != NULL) {
-		struct list_node *prev = tmp;
-
-		tmp = tmp->next;
-		if (is_equal(tmp->data, data)) {
-			/* Found the node, remove and return it */
-			prev->next = tmp->next;
-			tmp->next = NULL;
-			return tmp;
-		}
-	}
-
-	/* Could not find data in the list */
-	return NULL;
-}
-
 void del_list(struct list_node **head, void (*del_data)(void **d))
 {
-	struct list_node *tmp = *head;
+	struct list_node *tmp;
 
-	while (tmp != NULL) {
-		tmp = tmp->next;
+	while ((tmp = *head) != NULL) {
+		void *data = tmp;
 
-		del_data(&(*head)->data);
-		free(*head);
-		*head = tmp;
+		*head = tmp->next;
+		del_data(&data);
 	}
-
-	*head = NULL;
 }
 
 void del_user_data(void **d)
@@ -190,8 +133,8 @@ void del_user_data(void **d)
 	if (!u)
 		return;
 
-	free(u);
-	u = NULL;
+	free_user(u);
+	*d = NULL;
 }
 
 void del_user_list(struct list_node **head)
@@ -206,7 +149,8 @@ void del_channel_data(void **d)
 	if (!c)
 		return;
 
-	del_user_list(&c->user_list_head);
+	free_channel(c);
+	*d = NULL;
 }
 
 void del_channel_list(struct list_node **head)
@@ -219,7 +163,7 @@ void print_list(struct list_node *head, void (*print_data)(void *d))
 	struct list_node *tmp;
 
 	for (tmp = head; tmp != NULL; tmp = tmp->next)
-		print_data(tmp->data);
+		print_data(tmp);
 }
 
 void print_channel(void *d)
@@ -254,56 +198,6 @@ void print_user_list(struct list_node *head, char *channel_name)
 	print_list(head, print_user);
 }
 
-/**
- * list_contains - checks if the list has the data sent in as an argument
- *
- * @head: head of the list used to iterate through the list
- * @data: data to look for in the list
- * @is_equal: function used for comparing data sent in with list_node data
- *
- * Returns true if the data is found in the list, otherwise returns false
- */
-bool list_contains(struct list_node *head, void *data,
-		   bool (*is_equal)(void *d1, void *d2))
-{
-	struct list_node *tmp;
-
-	if (!data)
-		return false;
-
-	for (tmp = head; tmp != NULL; tmp = tmp->next)
-		if (is_equal(tmp->data, data))
-			return true;
-
-	return false;
-}
-
-
-/**
- * get_list_node_data - find the data passed in within the list
- *
- * @head: head of the list used to iterate through the list
- * @data: data to look for in the list
- * @is_equal: function used for comparing data sent in with list_node data
- *
- * Returns a pointer to the found data on success, otherwise NULL on failure
- */
-void *get_list_node_data(struct list_node *head, void *data,
-			 bool (*is_equal)(void *d1, void *d2))
-{
-	struct list_node *tmp;
-	if (!data) {
-		printf("list node data is null!\n");
-		return NULL;
-	}
-
-	for (tmp = head; tmp != NULL; tmp = tmp->next)
-		if (is_equal(tmp->data, data))
-			return tmp->data;
-
-	return NULL;
-}
-
 #if 0
 int main(int argc, char *argv[])
 {
@@ -317,18 +211,14 @@ int main(int argc, char *argv[])
 	strncpy(c2.name, "WindowsFTL!", sizeof("WindowsFTL"));
 	strncpy(c3.name, "GraduationFTW!", sizeof("GraduationFTW!"));
 
-	tmp = calloc(1, sizeof(struct list_node));
-	tmp->data = (void *)&c1;
-	if (add_list_node(&head, tmp))
+	if (add_list_node(&head, &c1.node))
 		printf("Failed to add c1 list_node\n");
 
-	tmp = calloc(1, sizeof(struct list_node));
-	tmp->data = (void *)&c2;
-	if (add_list_node(&head, tmp))
+	if (add_list_node(&head, &c2.node))
 		printf("Failed to add c2 list_node\n");
 
 
-	channel = get_channel(head, c3.name);
+	channel = get_list_node_data(head, &c3, is_equal_channels);
 	if (!channel)
 		printf("Could not find list_node with c3\n");
 	else
@@ -336,7 +226,7 @@ int main(int argc, char *argv[])
 
 
 	for (tmp = head; tmp != NULL; tmp = tmp->next) {
-		printf("tmp->data = %s\n", ((struct channel *)(tmp->data))->name);
+		printf("tmp->data = %s\n", ((struct channel *)tmp)->name);
 	}
 
 	if (!list_contains(head, (void *)&c3, is_equal_channels))
@@ -344,8 +234,7 @@ int main(int argc, char *argv[])
 
 	tmp = rm_list_node(&head, (void *)&c1, is_equal_channels);
 	if (tmp != NULL) {
-		printf("removed channel c1 %s\n", ((struct channel *)(tmp->data))->name);
-		free(tmp);
+		printf("removed channel c1 %s\n", ((struct channel *)tmp)->name);
 	}
 
 	tmp = rm_list_node(&head, (void *)&c1, is_equal_channels);
@@ -354,8 +243,7 @@ int main(int argc, char *argv[])
 
 	tmp = rm_list_node(&head, (void *)&c2, is_equal_channels);
 	if (tmp != NULL) {
-		printf("removed channel c2 %s\n", ((struct channel *)(tmp->data))->name);
-		free(tmp);
+		printf("removed channel c2 %s\n", ((struct channel *)tmp)->name);
 	}
 
 	tmp = rm_list_node(&head, (void *)&c2, is_equal_channels);
@@ -5,17 +5,51 @@
 #include <stdbool.h>
 #include <string.h>
 
+/**
+ * struct list_node - link embedded in every element that can be on a list
+ * @next: next element's link
+ *
+ * Note: struct list_node must be the first member of any structure put on a
+ *	 list (i.e. struct channel and struct user). That makes a pointer to
+ *	 the node a pointer to the element itself, so adding an element to a
+ *	 list doesn't allocate a separate node and walking a list doesn't chase
+ *	 an extra pointer to get to each element.
+ */
+struct list_node {
+	struct list_node *next;
+};
+
+/**
+ * struct channel - a channel
+ * @node: list linkage, must be first
+ * @name: zero padded channel name
+ *
+ * A program that keeps more per channel embeds this as the first member of
+ * its own struct, like the server does.
+ */
 struct channel {
+	struct list_node node;
 	char name[CHANNEL_NAME_MAX_LEN];
-	int num_users;
-	struct list_node *user_list_head;
 };
 
+/**
+ * struct user - a user
+ * @node: list linkage, must be first
+ * @name: user name
+ * @fd: socket of the user's connection
+ */
 struct user {
+	struct list_node node;
 	char name[USER_NAME_MAX_LEN];
 	int fd;
 };
 
+/* Channels and users come from slab pools, never malloc()/free() them */
+struct channel *alloc_channel(void);
+void free_channel(struct channel *c);
+struct user *alloc_user(void);
+void free_user(struct user *u);
+
 void print_channel(void *d);
 void print_channel_list(struct list_node *head);
 
@@ -28,28 +62,107 @@ void print_list(struct list_node *head, void (*print_data)(void *d));
 void del_list(struct list_node  **head, void (*del_data)(void **d));
 
 int add_channel(struct list_node **head, char *channel_name);
-bool is_equal_channels(void *c1, void *c2);
 
 void print_user(void *d);
 void print_user_list(struct list_node *head, char *channel_name);
 int add_user(struct list_node **head, char *username);
-bool is_equal_users(void *u1, void *u2);
-
-struct list_node {
-	struct list_node *next;
-	void *data;
-};
 
 int add_list_node(struct list_node **head, struct list_node *add);
 
-struct list_node *
+/*
+ * The lookup helpers below are inline so the is_equal callback, usually one
+ * of the inline comparisons right here, gets inlined into the list walk
+ * instead of being an indirect call per element.
+ */
+static inline bool is_equal_channels(void *c1, void *c2)
+{
+	if (!c1 || !c2)
+		return false;
+
+	return strncmp(((struct channel *)c1)->name,
+		       ((struct channel *)c2)->name, CHANNEL_NAME_MAX_LEN) == 0;
+}
+
+static inline bool is_equal_users(void *u1, void *u2)
+{
+	if (!u1 || !u2)
+		return false;
+
+	return ((struct user *)u1)->fd == ((struct user *)u2)->fd;
+}
+
+/**
+ * rm_list_node - removes a list_node from the list and returns it
+ *
+ * @head - pointer to the head of the list so it can be updated if needed
+ * @data - data to find in a list_node of the list pointed to by *head
+ * @is_equal - function used for comparing data sent in with list_node data
+ *
+ * Returns the list_node with data matching the passed in data on success,
+ * otherwise returns NULL when a list_node with matching data cannot be found.
+ * Note: This function does not free the element but returns it after
+ * reconnecting the nodes around it.
+ */
+static inline struct list_node *
 rm_list_node(struct list_node **head, void *data,
-	     bool (*is_equal)(void *d1, void *d2));
+	     bool (*is_equal)(void *d1, void *d2))
+{
+	struct list_node **link;
+
+	if (!data)
+		return NULL;
+
+	for (link = head; *link != NULL; link = &(*link)->next) {
+		struct list_node *tmp = *link;
+
+		if (is_equal(tmp, data)) {
+			*link = tmp->next;
+			tmp->next = NULL;
+			return tmp;
+		}
+	}
+
+	/* Could not find data in the list */
+	return NULL;
+}
+
+/**
+ * get_list_node_data - find the data passed in within the list
+ *
+ * @head: head of the list used to iterate through the list
+ * @data: data to look for in the list
+ * @is_equal: function used for comparing data sent in with list_node data
+ *
+ * Returns a pointer to the found element on success, otherwise NULL
+ */
+static inline void *get_list_node_data(struct list_node *head, void *data,
+				       bool (*is_equal)(void *d1, void *d2))
+{
+	struct list_node *tmp;
+
+	if (!data)
+		return NULL;
+
+	for (tmp = head; tmp != NULL; tmp = tmp->next)
+		if (is_equal(tmp, data))
+			return tmp;
 
-bool list_contains(struct list_node *head, void *data,
-		   bool (*is_equal)(void *d1, void *d2));
+	return NULL;
+}
 
-void *get_list_node_data(struct list_node *head, void *data,
-			 bool (*is_equal)(void *d1, void *d2));
+/**
+ * list_contains - checks if the list has the data sent in as an argument
+ *
+ * @head: head of the list used to iterate through the list
+ * @data: data to look for in the list
+ * @is_equal: function used for comparing data sent in with list_node data
+ *
+ * Returns true if the data is found in the list, otherwise returns false
+ */
+static inline bool list_contains(struct list_node *head, void *data,
+				 bool (*is_equal)(void *d1, void *d2))
+{
+	return get_list_node_data(head, data, is_equal) != NULL;
+}
 
 #endif /* _LIST_H */
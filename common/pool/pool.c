@@ -0,0 +1,305 @@
+/**
+ * pool.c - Fixed size object pool backed by slabs
+ * Author: Brett Creeley
+ */
+
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define POOL_ALIGN	16
+
+/**
+ * struct pool_cache - free objects of a thread safe pool kept by one thread
+ * @free_list: singly linked list of the cached objects
+ * @count: number of objects on free_list
+ * @allocs: objects handed out since the counts were added to the pool's stats
+ * @frees: objects given back since then
+ */
+struct pool_cache {
+	void *free_list;
+	uint32_t count;
+	uint32_t allocs;
+	uint32_t frees;
+};
+
+/* Indexed by cache_id, ids are never reused so a destroyed pool's cache is
+ * never looked at again.
+ */
+static __thread struct pool_cache pool_caches[POOL_MAX_CACHED];
+static int num_cached_pools;
+
+static inline void pool_lock(struct pool *p)
+{
+	if (p->thread_safe)
+		pthread_mutex_lock(&p->lock);
+}
+
+static inline void pool_unlock(struct pool *p)
+{
+	if (p->thread_safe)
+		pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * pool_init - initialize an empty pool
+ * @p: pool to initialize
+ * @name: name used when printing stats
+ * @obj_size: size of the objects handed out by this pool
+ * @objs_per_slab: how many objects to allocate at a time
+ * @thread_safe: set if the pool is shared between threads
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int pool_init(struct pool *p, const char *name, size_t obj_size,
+	      uint32_t objs_per_slab, bool thread_safe)
+{
+	if (!p || !obj_size || !objs_per_slab)
+		return -1;
+
+	memset(p, 0, sizeof(*p));
+	p->name = name;
+	/* Free objects hold the free list pointer, keep every object aligned */
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	p->obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	p->objs_per_slab = objs_per_slab;
+	p->thread_safe = thread_safe;
+	p->cache_id = -1;
+	if (!thread_safe)
+		return 0;
+
+	if (pthread_mutex_init(&p->lock, NULL))
+		return -1;
+
+	p->cache_id = __atomic_fetch_add(&num_cached_pools, 1, __ATOMIC_RELAXED);
+	if (p->cache_id >= POOL_MAX_CACHED)
+		p->cache_id = -1;
+
+	return 0;
+}
+
+/**
+ * pool_destroy - free every slab of the pool
+ * @p: pool to destroy
+ *
+ * Note: Any object still handed out is freed along with its slab, and so is
+ * every object cached by a thread. Only the calling thread may still be using
+ * a thread safe pool.
+ */
+void pool_destroy(struct pool *p)
+{
+	struct pool_slab *slab;
+
+	if (!p)
+		return;
+
+	while ((slab = p->slabs) != NULL) {
+		p->slabs = slab->next;
+		free(slab);
+	}
+
+	p->free_list = NULL;
+	if (p->cache_id >= 0)
+		memset(&pool_caches[p->cache_id], 0, sizeof(struct pool_cache));
+	if (p->thread_safe)
+		pthread_mutex_destroy(&p->lock);
+}
+
+/* Called with the pool lock held */
+static int pool_grow(struct pool *p)
+{
+	size_t hdr = (sizeof(struct pool_slab) + POOL_ALIGN - 1) &
+		     ~(size_t)(POOL_ALIGN - 1);
+	struct pool_slab *slab;
+	uint8_t *obj;
+	uint32_t i;
+
+	slab = malloc(hdr + p->obj_size * p->objs_per_slab);
+	if (!slab) {
+		perror("malloc");
+		return -1;
+	}
+
+	slab->next = p->slabs;
+	p->slabs = slab;
+
+	obj = (uint8_t *)slab + hdr;
+	for (i = 0; i < p->objs_per_slab; ++i, obj += p->obj_size) {
+		*(void **)obj = p->free_list;
+		p->free_list = obj;
+	}
+
+	++p->stats.slab_allocs;
+	p->stats.capacity += p->objs_per_slab;
+
+	return 0;
+}
+
+/* The calling thread's cache of a thread safe pool, NULL if it has none */
+static inline struct pool_cache *pool_cache(struct pool *p)
+{
+	return p->cache_id >= 0 ? &pool_caches[p->cache_id] : NULL;
+}
+
+/* Called with the pool lock held */
+static void pool_cache_fold_stats(struct pool *p, struct pool_cache *c)
+{
+	p->stats.allocs += c->allocs;
+	p->stats.frees += c->frees;
+	c->allocs = 0;
+	c->frees = 0;
+}
+
+/* Move a batch of objects from the pool to an empty cache */
+static int pool_cache_refill(struct pool *p, struct pool_cache *c)
+{
+	uint32_t n;
+
+	pthread_mutex_lock(&p->lock);
+	for (n = 0; n < POOL_CACHE_BATCH; ++n) {
+		void *obj;
+
+		/* Only grow for an object that's needed right away */
+		if (!p->free_list && (n || pool_grow(p)))
+			break;
+
+		obj = p->free_list;
+		p->free_list = *(void **)obj;
+		*(void **)obj = c->free_list;
+		c->free_list = obj;
+	}
+	c->count += n;
+	p->stats.in_use += n;
+	pool_cache_fold_stats(p, c);
+	pthread_mutex_unlock(&p->lock);
+
+	return n ? 0 : -1;
+}
+
+/* Give a batch of objects from a full cache back to the pool */
+static void pool_cache_spill(struct pool *p, struct pool_cache *c)
+{
+	uint32_t n;
+
+	pthread_mutex_lock(&p->lock);
+	for (n = 0; n < POOL_CACHE_BATCH; ++n) {
+		void *obj = c->free_list;
+
+		c->free_list = *(void **)obj;
+		*(void **)obj = p->free_list;
+		p->free_list = obj;
+	}
+	c->count -= n;
+	p->stats.in_use -= n;
+	pool_cache_fold_stats(p, c);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * pool_alloc - get an object from the pool
+ * @p: pool to allocate from
+ *
+ * The object's contents are undefined, use pool_zalloc() for a zeroed object.
+ * A thread safe pool hands out objects from the calling thread's cache, the
+ * lock is only taken once the cache ran empty.
+ *
+ * Returns the object or NULL on failure
+ */
+void *pool_alloc(struct pool *p)
+{
+	struct pool_cache *c = pool_cache(p);
+	void *obj = NULL;
+
+	if (c) {
+		if (!c->count && pool_cache_refill(p, c))
+			return NULL;
+
+		obj = c->free_list;
+		c->free_list = *(void **)obj;
+		--c->count;
+		++c->allocs;
+
+		return obj;
+	}
+
+	pool_lock(p);
+	if (!p->free_list && pool_grow(p))
+		goto unlock;
+
+	obj = p->free_list;
+	p->free_list = *(void **)obj;
+	++p->stats.allocs;
+	++p->stats.in_use;
+
+unlock:
+	pool_unlock(p);
+
+	return obj;
+}
+
+void *pool_zalloc(struct pool *p)
+{
+	void *obj = pool_alloc(p);
+
+	if (obj)
+		memset(obj, 0, p->obj_size);
+
+	return obj;
+}
+
+/**
+ * pool_free - give an object back to the pool it came from
+ * @p: pool obj was allocated from
+ * @obj: object to free, NULL is ignored
+ */
+void pool_free(struct pool *p, void *obj)
+{
+	struct pool_cache *c = pool_cache(p);
+
+	if (!obj)
+		return;
+
+	if (c) {
+		*(void **)obj = c->free_list;
+		c->free_list = obj;
+		++c->count;
+		++c->frees;
+		if (c->count > POOL_CACHE_MAX)
+			pool_cache_spill(p, c);
+		return;
+	}
+
+	pool_lock(p);
+	*(void **)obj = p->free_list;
+	p->free_list = obj;
+	++p->stats.frees;
+	--p->stats.in_use;
+	pool_unlock(p);
+}
+
+/* Other threads' caches may not have added their latest counts yet */
+void pool_get_stats(struct pool *p, struct pool_stats *stats)
+{
+	struct pool_cache *c = pool_cache(p);
+
+	pool_lock(p);
+	if (c)
+		pool_cache_fold_stats(p, c);
+	*stats = p->stats;
+	pool_unlock(p);
+}
+
+void pool_print_stats(struct pool *p)
+{
+	struct pool_stats stats;
+
+	pool_get_stats(p, &stats);
+	printf("pool %-10s obj_size %-6zu allocs %-10" PRIu64 " frees %-10"
+	       PRIu64 " in_use %-8" PRIu64 " capacity %-8" PRIu64
+	       " slab_allocs %" PRIu64 "\n", p->name, p->obj_size,
+	       stats.allocs, stats.frees, stats.in_use, stats.capacity,
+	       stats.slab_allocs);
+}
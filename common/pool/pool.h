@@ -0,0 +1,89 @@
+/**
+ * pool.h - Fixed size object pool backed by slabs
+ * Author: Brett Creeley
+ *
+ * Note: Objects are carved out of slabs that are malloc()'d
+ *	 objs_per_slab at a time and are never returned to the system until
+ *	 the pool is destroyed. Freed objects go on a free list and are handed
+ *	 back out by the next pool_alloc(), so once a pool has grown to its
+ *	 working set it stops calling malloc() altogether. The slab_allocs
+ *	 counter shows exactly how many times malloc() was called.
+ *
+ *	 Every thread using a thread safe pool keeps a small cache of free
+ *	 objects of its own, allocations and frees only take the pool's lock
+ *	 to move POOL_CACHE_BATCH objects at a time between the cache and the
+ *	 pool. An object can be freed by another thread than the one that
+ *	 allocated it, it simply ends up in the freeing thread's cache.
+ */
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* Objects moved between a thread's cache and its pool at a time */
+#define POOL_CACHE_BATCH	16
+/* A thread's cache gives a batch back once it holds more than this */
+#define POOL_CACHE_MAX		(2 * POOL_CACHE_BATCH)
+/* Thread safe pools beyond this many work without thread caches */
+#define POOL_MAX_CACHED		64
+
+/**
+ * struct pool_stats - pool counters
+ * @allocs: total number of objects handed out
+ * @frees: total number of objects given back
+ * @slab_allocs: number of slabs allocated, i.e. calls to malloc()
+ * @in_use: objects currently handed out or held by a thread's cache
+ * @capacity: objects available across all slabs
+ *
+ * A thread's cache adds what it handed out and got back to allocs and frees
+ * whenever it takes the pool's lock, so they can lag by a few batches.
+ */
+struct pool_stats {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t slab_allocs;
+	uint64_t in_use;
+	uint64_t capacity;
+};
+
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+/**
+ * struct pool - object pool handle
+ * @name: name used when printing stats
+ * @obj_size: size of each object, rounded up for alignment
+ * @objs_per_slab: objects allocated at a time when the pool is empty
+ * @free_list: singly linked list of free objects
+ * @slabs: every slab allocated by this pool
+ * @thread_safe: take lock around every operation
+ * @lock: protects everything above when thread_safe is set
+ * @cache_id: index of this pool's cache in every thread, -1 if it has none
+ * @stats: pool counters
+ */
+struct pool {
+	const char *name;
+	size_t obj_size;
+	uint32_t objs_per_slab;
+	void *free_list;
+	struct pool_slab *slabs;
+	bool thread_safe;
+	pthread_mutex_t lock;
+	int cache_id;
+	struct pool_stats stats;
+};
+
+int pool_init(struct pool *p, const char *name, size_t obj_size,
+	      uint32_t objs_per_slab, bool thread_safe);
+void pool_destroy(struct pool *p);
+void *pool_alloc(struct pool *p);
+void *pool_zalloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+void pool_get_stats(struct pool *p, struct pool_stats *stats);
+void pool_print_stats(struct pool *p);
+
+#endif /* _POOL_H */
@@ -0,0 +1,506 @@
+/**
+ * protocol.c - Encode and decode version 2 pdx irc frames
+ * Author: Brett Creeley
+ */
+
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
+
+/**
+ * struct wire - cursor over a frame being encoded or decoded
+ * @pos: next byte to read or write
+ * @end: one past the last usable byte
+ */
+struct wire {
+	uint8_t *pos;
+	uint8_t *end;
+};
+
+static int put_u8(struct wire *w, uint8_t val)
+{
+	if (w->pos + 1 > w->end)
+		return -1;
+
+	*w->pos++ = val;
+
+	return 0;
+}
+
+static int put_u16(struct wire *w, uint16_t val)
+{
+	val = htons(val);
+	if (w->pos + sizeof(val) > w->end)
+		return -1;
+
+	memcpy(w->pos, &val, sizeof(val));
+	w->pos += sizeof(val);
+
+	return 0;
+}
+
+static int put_u32(struct wire *w, uint32_t val)
+{
+	val = htonl(val);
+	if (w->pos + sizeof(val) > w->end)
+		return -1;
+
+	memcpy(w->pos, &val, sizeof(val));
+	w->pos += sizeof(val);
+
+	return 0;
+}
+
+/* Fields don't have to be NUL terminated when they use all max_len bytes.
+ * Only a chat text can be longer than a length byte can hold, its last byte
+ * is dropped then like a NUL terminator would have.
+ */
+static int put_str(struct wire *w, const char *str, size_t max_len)
+{
+	size_t len = strnlen(str, max_len);
+
+	if (len > UINT8_MAX)
+		len = UINT8_MAX;
+
+	if (put_u8(w, len) || w->pos + len > w->end)
+		return -1;
+
+	memcpy(w->pos, str, len);
+	w->pos += len;
+
+	return 0;
+}
+
+static int put_u64(struct wire *w, uint64_t val)
+{
+	val = htobe64(val);
+	if (w->pos + sizeof(val) > w->end)
+		return -1;
+
+	memcpy(w->pos, &val, sizeof(val));
+	w->pos += sizeof(val);
+
+	return 0;
+}
+
+static int get_u8(struct wire *w, uint8_t *val)
+{
+	if (w->pos + 1 > w->end)
+		return -1;
+
+	*val = *w->pos++;
+
+	return 0;
+}
+
+static int get_u16(struct wire *w, uint16_t *val)
+{
+	if (w->pos + sizeof(*val) > w->end)
+		return -1;
+
+	memcpy(val, w->pos, sizeof(*val));
+	*val = ntohs(*val);
+	w->pos += sizeof(*val);
+
+	return 0;
+}
+
+static int get_u32(struct wire *w, uint32_t *val)
+{
+	if (w->pos + sizeof(*val) > w->end)
+		return -1;
+
+	memcpy(val, w->pos, sizeof(*val));
+	*val = ntohl(*val);
+	w->pos += sizeof(*val);
+
+	return 0;
+}
+
+static int get_u64(struct wire *w, uint64_t *val)
+{
+	if (w->pos + sizeof(*val) > w->end)
+		return -1;
+
+	memcpy(val, w->pos, sizeof(*val));
+	*val = be64toh(*val);
+	w->pos += sizeof(*val);
+
+	return 0;
+}
+
+/* str must be zeroed, it's left NUL terminated unless all max_len are used */
+static int get_str(struct wire *w, char *str, size_t max_len)
+{
+	uint8_t len;
+
+	if (get_u8(w, &len) || len > max_len || w->pos + len > w->end)
+		return -1;
+
+	memcpy(str, w->pos, len);
+	w->pos += len;
+
+	return 0;
+}
+
+/**
+ * msg_channel_id - channel_id of a message
+ * @msg: the message
+ *
+ * Returns CHANNEL_ID_NONE if msg has no channel_id or names its channel
+ */
+uint32_t msg_channel_id(const struct message *msg)
+{
+	switch (msg->type) {
+	case JOIN:
+		return msg->join.channel_id;
+	case LEAVE:
+		return msg->leave.channel_id;
+	case CHAT:
+		return msg->chat_channel_id;
+	case LIST_USERS:
+		return msg->list_users.channel_id;
+	case HISTORY:
+		return msg->history.channel_id;
+	default:
+		return CHANNEL_ID_NONE;
+	}
+}
+
+/**
+ * proto_frame_len - total length of a v2 frame
+ * @hdr: the frame's header
+ */
+uint32_t proto_frame_len(const struct msg_hdr *hdr)
+{
+	return MSG_HDR_SIZE + ntohs(hdr->len);
+}
+
+/**
+ * proto_encode - encode a message as a v2 frame
+ * @msg: message to encode
+ * @buf: where the frame is written
+ * @size: size of buf, MSG_V2_MAX_LEN is always enough
+ *
+ * Returns the length of the frame or -1 if msg can't be encoded
+ */
+int proto_encode(const struct message *msg, uint8_t *buf, uint32_t size)
+{
+	struct wire w = { buf + MSG_HDR_SIZE, buf + size };
+	struct msg_hdr hdr = { .type = msg->type };
+	int err = 0;
+
+	if (size < MSG_HDR_SIZE)
+		return -1;
+
+	if (msg->response) {
+		hdr.flags |= MSG_FLAG_RESPONSE;
+		err |= put_u32(&w, msg->response);
+	}
+
+	if (msg_channel_id(msg) != CHANNEL_ID_NONE)
+		hdr.flags |= MSG_FLAG_CHANNEL_ID;
+
+	switch (msg->type) {
+	case HELLO:
+		err |= put_u8(&w, msg->hello.version);
+		break;
+	case LOGIN:
+		err |= put_str(&w, msg->login.username, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->login.password, PW_MAX_LEN);
+		break;
+	case JOIN:
+		err |= put_str(&w, msg->join.src_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->join.channel_name, CHANNEL_NAME_MAX_LEN);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= put_u32(&w, msg->join.channel_id);
+		if (msg->join.replay) {
+			hdr.flags |= MSG_FLAG_REPLAY;
+			err |= put_u16(&w, msg->join.replay);
+		}
+		break;
+	case LEAVE:
+		err |= put_str(&w, msg->leave.src_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->leave.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= put_u32(&w, msg->leave.channel_id);
+		break;
+	case CHAT:
+		err |= put_str(&w, msg->chat.src_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->chat.channel_name, CHANNEL_NAME_MAX_LEN);
+		err |= put_str(&w, msg->chat.text, CHAT_MSG_MAX_LEN);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= put_u32(&w, msg->chat_channel_id);
+		break;
+	case DIRECT:
+		err |= put_str(&w, msg->direct.src_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->direct.dst_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->direct.text, CHAT_MSG_MAX_LEN);
+		break;
+	case HISTORY:
+		err |= put_str(&w, msg->history.src_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->history.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		err |= put_u64(&w, msg->history.before_seq);
+		err |= put_u64(&w, msg->history.before_ms);
+		err |= put_u16(&w, msg->history.count);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= put_u32(&w, msg->history.channel_id);
+		break;
+	case LIST_CHANNELS:
+		err |= put_u8(&w, msg->list_channels.list_key);
+		err |= put_str(&w, msg->list_channels.src_user,
+			       USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->list_channels.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		err |= put_u32(&w, msg->list_channels.cursor);
+		err |= put_u16(&w, msg->list_channels.page_size);
+		break;
+	case LIST_USERS:
+		err |= put_u8(&w, msg->list_users.list_key);
+		err |= put_str(&w, msg->list_users.src_user, USER_NAME_MAX_LEN);
+		err |= put_str(&w, msg->list_users.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		err |= put_str(&w, msg->list_users.username, USER_NAME_MAX_LEN);
+		err |= put_u32(&w, msg->list_users.cursor);
+		err |= put_u16(&w, msg->list_users.page_size);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= put_u32(&w, msg->list_users.channel_id);
+		break;
+	default:
+		/* ERROR and unknown types only carry the response */
+		break;
+	}
+
+	if (err)
+		return -1;
+
+	hdr.len = htons(w.pos - buf - MSG_HDR_SIZE);
+	memcpy(buf, &hdr, MSG_HDR_SIZE);
+
+	return w.pos - buf;
+}
+
+/**
+ * proto_decode - decode a v2 frame into a message
+ * @buf: the complete frame, header included
+ * @len: length of the frame
+ * @msg: where the message is decoded to
+ *
+ * Returns 0 on success or -1 if the frame is malformed
+ */
+int proto_decode(const uint8_t *buf, uint32_t len, struct message *msg)
+{
+	struct wire w = { (uint8_t *)buf + MSG_HDR_SIZE, (uint8_t *)buf + len };
+	struct msg_hdr hdr;
+	int err = 0;
+
+	if (len < MSG_HDR_SIZE)
+		return -1;
+
+	memcpy(&hdr, buf, MSG_HDR_SIZE);
+	if (proto_frame_len(&hdr) != len)
+		return -1;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->type = hdr.type;
+
+	if (hdr.flags & MSG_FLAG_RESPONSE)
+		err |= get_u32(&w, &msg->response);
+
+	/* Only the list_key, the names are read with proto_list_names() */
+	if (hdr.flags & MSG_FLAG_PACKED) {
+		if (msg->type == LIST_CHANNELS)
+			err |= get_u8(&w, &msg->list_channels.list_key);
+		else if (msg->type == LIST_USERS)
+			err |= get_u8(&w, &msg->list_users.list_key);
+		else
+			err = -1;
+
+		return err ? -1 : 0;
+	}
+
+	switch (msg->type) {
+	case HELLO:
+		err |= get_u8(&w, &msg->hello.version);
+		break;
+	case LOGIN:
+		err |= get_str(&w, msg->login.username, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->login.password, PW_MAX_LEN);
+		break;
+	case JOIN:
+		err |= get_str(&w, msg->join.src_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->join.channel_name, CHANNEL_NAME_MAX_LEN);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= get_u32(&w, &msg->join.channel_id);
+		if (hdr.flags & MSG_FLAG_REPLAY)
+			err |= get_u16(&w, &msg->join.replay);
+		break;
+	case LEAVE:
+		err |= get_str(&w, msg->leave.src_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->leave.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= get_u32(&w, &msg->leave.channel_id);
+		break;
+	case CHAT:
+		err |= get_str(&w, msg->chat.src_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->chat.channel_name, CHANNEL_NAME_MAX_LEN);
+		err |= get_str(&w, msg->chat.text, CHAT_MSG_MAX_LEN);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= get_u32(&w, &msg->chat_channel_id);
+		break;
+	case DIRECT:
+		err |= get_str(&w, msg->direct.src_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->direct.dst_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->direct.text, CHAT_MSG_MAX_LEN);
+		break;
+	case HISTORY:
+		err |= get_str(&w, msg->history.src_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->history.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		err |= get_u64(&w, &msg->history.before_seq);
+		err |= get_u64(&w, &msg->history.before_ms);
+		err |= get_u16(&w, &msg->history.count);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= get_u32(&w, &msg->history.channel_id);
+		break;
+	case LIST_CHANNELS:
+		err |= get_u8(&w, &msg->list_channels.list_key);
+		err |= get_str(&w, msg->list_channels.src_user,
+			       USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->list_channels.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		err |= get_u32(&w, &msg->list_channels.cursor);
+		err |= get_u16(&w, &msg->list_channels.page_size);
+		break;
+	case LIST_USERS:
+		err |= get_u8(&w, &msg->list_users.list_key);
+		err |= get_str(&w, msg->list_users.src_user, USER_NAME_MAX_LEN);
+		err |= get_str(&w, msg->list_users.channel_name,
+			       CHANNEL_NAME_MAX_LEN);
+		err |= get_str(&w, msg->list_users.username, USER_NAME_MAX_LEN);
+		err |= get_u32(&w, &msg->list_users.cursor);
+		err |= get_u16(&w, &msg->list_users.page_size);
+		if (hdr.flags & MSG_FLAG_CHANNEL_ID)
+			err |= get_u32(&w, &msg->list_users.channel_id);
+		break;
+	default:
+		break;
+	}
+
+	return err ? -1 : 0;
+}
+
+/**
+ * proto_list_begin - start a packed LIST_CHANNELS or LIST_USERS reply
+ * @buf: MSG_V2_LIST_MAX_LEN bytes the frame is built in
+ * @type: LIST_CHANNELS or LIST_USERS
+ * @response: response of the reply
+ * @list_key: list_key of the request being answered
+ *
+ * Returns the length of the frame so far
+ */
+uint32_t proto_list_begin(uint8_t *buf, uint8_t type, uint32_t response,
+			  uint8_t list_key)
+{
+	struct wire w = { buf + MSG_HDR_SIZE, buf + MSG_V2_LIST_MAX_LEN };
+	struct msg_hdr hdr = {
+		.type = type,
+		.flags = MSG_FLAG_RESPONSE | MSG_FLAG_PACKED,
+	};
+
+	memcpy(buf, &hdr, MSG_HDR_SIZE);
+	put_u32(&w, response);
+	put_u8(&w, list_key);
+
+	return w.pos - buf;
+}
+
+/**
+ * proto_list_name_valid - check a name can be sent in a packed reply
+ * @name: name to check
+ * @max_len: size of the field name is stored in
+ *
+ * An empty name or one containing LIST_NAME_SEPARATOR can't be told apart
+ * from its neighbours once packed.
+ */
+bool proto_list_name_valid(const char *name, size_t max_len)
+{
+	size_t name_len = strnlen(name, max_len);
+
+	return name_len && !memchr(name, LIST_NAME_SEPARATOR, name_len);
+}
+
+/**
+ * proto_list_add - append a name to a packed reply
+ * @buf: frame started by proto_list_begin()
+ * @len: length of the frame, updated on success
+ * @name: name to add, see proto_list_name_valid()
+ * @max_len: size of the field name is stored in
+ *
+ * Returns 0 on success or -1 if the frame is full
+ */
+int proto_list_add(uint8_t *buf, uint32_t *len, const char *name,
+		   size_t max_len)
+{
+	size_t name_len = strnlen(name, max_len);
+	uint32_t needed = name_len;
+
+	/* The first name directly follows list_key */
+	if (*len > MSG_HDR_SIZE + sizeof(uint32_t) + 1)
+		++needed;
+
+	if (*len + needed > MSG_V2_LIST_MAX_LEN)
+		return -1;
+
+	if (needed > name_len)
+		buf[(*len)++] = LIST_NAME_SEPARATOR;
+	memcpy(buf + *len, name, name_len);
+	*len += name_len;
+
+	return 0;
+}
+
+/**
+ * proto_list_end - finish a packed reply so it can be sent
+ * @buf: frame started by proto_list_begin()
+ * @len: final length of the frame
+ */
+void proto_list_end(uint8_t *buf, uint32_t len)
+{
+	uint16_t body_len = htons(len - MSG_HDR_SIZE);
+
+	memcpy(buf + offsetof(struct msg_hdr, len), &body_len,
+	       sizeof(body_len));
+}
+
+/**
+ * proto_list_names - find the names in a packed reply
+ * @buf: the complete frame, header included
+ * @len: length of the frame
+ * @names_len: set to the length of the names
+ *
+ * Returns the LIST_NAME_SEPARATOR separated names, not NUL terminated, or NULL
+ * if the frame is not a packed reply
+ */
+const char *proto_list_names(const uint8_t *buf, uint32_t len,
+			     uint32_t *names_len)
+{
+	uint32_t start = MSG_HDR_SIZE + sizeof(uint32_t) + 1;
+	struct msg_hdr hdr;
+
+	if (len < start)
+		return NULL;
+
+	memcpy(&hdr, buf, MSG_HDR_SIZE);
+	if ((hdr.flags & (MSG_FLAG_RESPONSE | MSG_FLAG_PACKED)) !=
+	    (MSG_FLAG_RESPONSE | MSG_FLAG_PACKED))
+		return NULL;
+
+	*names_len = len - start;
+
+	return (const char *)buf + start;
+}
@@ -15,10 +15,17 @@
  * 	 will determine the type of message.  Based on this the size of the
  * 	 message can be determine by using sizeof(struct new_type_msg) for the
  * 	 following call(s) to recv() the data.
+ *
+ * 	 That fixed size layout is protocol version 1. Version 2 frames start
+ * 	 with a struct msg_hdr and only carry the bytes each field actually
+ * 	 uses. A client asks for version 2 by making a HELLO frame the first
+ * 	 thing it sends, clients that don't are served version 1 unchanged.
  */
 #ifndef _PROTOCOL_H
 #define _PROTOCOL_H
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <assert.h>
 
 #define CONNECTION_CLOSED 0
@@ -31,6 +38,7 @@
 #define PW_MAX_LEN		16
 #define CHANNEL_NAME_MAX_LEN	16
 #define CHAT_MSG_MAX_LEN	256
+#define CHANNEL_ID_NONE		0
 
 enum message_type {
 	MSG_TYPE_INVALID = 0,
@@ -41,6 +49,9 @@ enum message_type {
 	CHAT		 = 5,
 	LIST_CHANNELS	 = 6,	/* channel names are separated by ":" */
 	LIST_USERS	 = 7,	/* user names are separated by ":" */
+	HELLO		 = 8,	/* version negotiation, always a v2 frame */
+	DIRECT		 = 9,	/* chat to one user instead of a channel */
+	HISTORY		 = 10,	/* CHATs a channel had, from the server's log */
 
 	/* Do not put any new message types after MAX_MSG_NUM */
 	MAX_MSG_NUM	 = 255
@@ -50,6 +61,44 @@ enum message_type {
 /* Make sure there is no padding in message structures */
 #pragma pack(push, 1)
 
+#define PROTO_V1		1
+#define PROTO_V2		2
+
+/**
+ * struct msg_hdr - header of every version 2 frame
+ * @type: enum message_type
+ * @flags: MSG_FLAG_* bits
+ * @len: number of bytes following the header, in network byte order
+ *
+ * The body is the message's fields in the order struct message declares
+ * them. A string is a length byte followed by that many bytes without a
+ * terminating NUL, list_key is a single byte and other integers are in
+ * network byte order. If MSG_FLAG_RESPONSE is set
+ * the fields are preceded by the response in network byte order.
+ *
+ * channel_id is only there if MSG_FLAG_CHANNEL_ID is set. A request that
+ * addresses its channel by id leaves channel_name empty, so the name only
+ * costs its length byte. Likewise the replay of a JOIN is only there if
+ * MSG_FLAG_REPLAY is set.
+ *
+ * LIST_CHANNELS and LIST_USERS replies to a v2 client have MSG_FLAG_PACKED
+ * set. Their body is the response, list_key and then as many ":" separated
+ * names as fit in MSG_V2_LIST_MAX_LEN bytes, instead of one name per frame.
+ */
+struct msg_hdr {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t len;
+};
+#define MSG_HDR_SIZE		(sizeof(struct msg_hdr))
+#define MSG_FLAG_RESPONSE	BIT(0)
+#define MSG_FLAG_PACKED		BIT(1)
+#define MSG_FLAG_CHANNEL_ID	BIT(2)
+#define MSG_FLAG_REPLAY		BIT(3)
+#define MSG_V2_LIST_MAX_LEN	8192
+/* Separates the names of a packed LIST reply, no name can contain it */
+#define LIST_NAME_SEPARATOR	':'
+
 struct message {
 	uint8_t type;
 
@@ -72,9 +121,24 @@ struct message {
 #define RESP_LIST_USERS_IN_PROGRESS	BIT(15)
 #define RESP_DONE_SENDING_USERS		BIT(16)
 #define RESP_CANNOT_LIST_USERS		BIT(17)
+#define RESP_USER_NOT_ONLINE		BIT(18)
+#define RESP_NO_HISTORY			BIT(19)
 /* BIT(31) is the largest define with resposne being a 32-bit value */
 	uint32_t response;
+	/* A successful JOIN is answered with the channel's channel_id. JOIN,
+	 * LEAVE, CHAT, LIST_USERS and HISTORY can then address the channel by
+	 * it instead of by channel_name, CHANNEL_ID_NONE means they name it.
+	 * The one of a CHAT is chat_channel_id, after the union.
+	 */
 	union {
+		struct {
+			uint8_t version;
+		} hello;
+		/* Optional, claims username for good. A client that never
+		 * sends it is a guest named by the src_user of its first
+		 * message. A guest is never refused, but only the first
+		 * session under a name receives the DIRECTs sent to it.
+		 */
 		struct {
 			char username[USER_NAME_MAX_LEN];
 			char password[PW_MAX_LEN];
@@ -82,38 +146,106 @@ struct message {
 		struct {
 			char src_user[USER_NAME_MAX_LEN];
 			char channel_name[CHANNEL_NAME_MAX_LEN];
+			uint32_t channel_id;
+			/* Most recent CHATs of the channel to send the new
+			 * member, they arrive ahead of the JOIN's response.
+			 */
+			uint16_t replay;
 		} join;
 		struct {
 			char src_user[USER_NAME_MAX_LEN];
 			char channel_name[CHANNEL_NAME_MAX_LEN];
+			uint32_t channel_id;
 		} leave;
 		struct {
 			char src_user[USER_NAME_MAX_LEN];
 			char channel_name[CHANNEL_NAME_MAX_LEN];
 			char text[CHAT_MSG_MAX_LEN];
 		} chat;
+		/* Delivered to whoever is logged in as dst_user right now,
+		 * src_user of the delivered message is the sender.
+		 */
+		struct {
+			char src_user[USER_NAME_MAX_LEN];
+			char dst_user[USER_NAME_MAX_LEN];
+			char text[CHAT_MSG_MAX_LEN];
+		} direct;
+		/* Asks for at most count of the channel's CHATs that came
+		 * before before_seq, or before the wall clock time before_ms
+		 * in milliseconds, 0 meaning now for either. The CHATs are
+		 * sent oldest first, ahead of the response. The response has
+		 * count set to how many were sent and before_seq to the
+		 * sequence number of the oldest, to ask for the page before
+		 * it, or 0 if there is nothing older. Only a member of the
+		 * channel can ask, RESP_NOT_IN_CHANNEL otherwise.
+		 */
+		struct {
+			char src_user[USER_NAME_MAX_LEN];
+			char channel_name[CHANNEL_NAME_MAX_LEN];
+			uint64_t before_seq;
+			uint64_t before_ms;
+			uint16_t count;
+			uint32_t channel_id;
+		} history;
 		/* Server only sends one channel name back to src_user at a
 		 * time, but the list_key remains the same. The server needs to
 		 * set RESP_LIST_CHANNELS_IN_PROGRESS in the message response to
 		 * let the client know more channels are coming. On the last
 		 * channel send the server will set the response to RESP_SUCCES
+		 *
+		 * Listing is paginated when page_size is non-zero, at most
+		 * page_size names are sent starting at cursor. The final
+		 * response carries the cursor of the next page, or 0 once
+		 * there is nothing left. A cursor of 0 starts at the first
+		 * page, otherwise it is opaque to the client.
 		 */
 		struct {
 			uint8_t list_key;
 			char src_user[USER_NAME_MAX_LEN];
 			char channel_name[CHANNEL_NAME_MAX_LEN];
+			uint32_t cursor;
+			uint16_t page_size;
 		} list_channels;
 		struct {
 			uint8_t list_key;
 			char src_user[USER_NAME_MAX_LEN];
 			char channel_name[CHANNEL_NAME_MAX_LEN];
 			char username[USER_NAME_MAX_LEN];
+			uint32_t cursor;
+			uint16_t page_size;
+			uint32_t channel_id;
 		} list_users;
 	};
+	/* A v1 frame ends with the union, chat is its largest member and
+	 * can't grow without changing the frame size old clients use. So
+	 * only a v2 frame can carry this, it is CHANNEL_ID_NONE in a message
+	 * received as v1.
+	 */
+	uint32_t chat_channel_id;
 };
-#define MSG_SIZE (sizeof(struct message))
+/* Size of a v1 frame, the union included but nothing after it */
+#define MSG_SIZE (offsetof(struct message, chat_channel_id))
+_Static_assert(MSG_SIZE == 293, "the v1 frame size must never change");
 
 /* Remove structure packing format */
 #pragma pack(pop)
 
+/* A v2 encoding is never larger than this, every field is at most a length
+ * byte larger than in memory and no message has more than 4 string fields.
+ */
+#define MSG_V2_MAX_LEN		(MSG_HDR_SIZE + sizeof(struct message) + 4)
+
+uint32_t msg_channel_id(const struct message *msg);
+uint32_t proto_frame_len(const struct msg_hdr *hdr);
+int proto_encode(const struct message *msg, uint8_t *buf, uint32_t size);
+int proto_decode(const uint8_t *buf, uint32_t len, struct message *msg);
+uint32_t proto_list_begin(uint8_t *buf, uint8_t type, uint32_t response,
+			  uint8_t list_key);
+bool proto_list_name_valid(const char *name, size_t max_len);
+int proto_list_add(uint8_t *buf, uint32_t *len, const char *name,
+		   size_t max_len);
+void proto_list_end(uint8_t *buf, uint32_t len);
+const char *proto_list_names(const uint8_t *buf, uint32_t len,
+			     uint32_t *names_len);
+
 #endif /* _PROTOCOL_H */
@@ -0,0 +1,360 @@
+/**
+ * uring_helpers.c - Minimal io_uring wrapper on top of the raw system calls
+ * Author: Brett Creeley
+ */
+
+#include "uring_helpers.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#define uring_load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define uring_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned wait_nr,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+				 unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * uring_init - create an io_uring instance and map its rings
+ * @ring: filled in with the new instance
+ * @entries: number of SQEs, the completion ring is twice as large
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p = { 0 };
+	unsigned *sq_array;
+	unsigned i;
+
+	memset(ring, 0, sizeof(*ring));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		perror("mmap");
+		goto err_close;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			perror("mmap");
+			goto err_unmap_sq;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		perror("mmap");
+		goto err_unmap_cq;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)((char *)ring->sq_ring +
+				      p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	/* SQE i always sits in slot i, so the index array is set up once */
+	sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i)
+		sq_array[i] = i;
+
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((char *)ring->cq_ring +
+				      p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+					     p.cq_off.cqes);
+
+	return 0;
+
+err_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* Publish every prepared SQE and hand them to the kernel */
+static int uring_enter(struct uring *ring, unsigned wait_nr)
+{
+	unsigned to_submit;
+	int ret;
+
+	uring_store_release(ring->sq_tail, ring->sqe_tail);
+	to_submit = ring->sqe_tail - uring_load_acquire(ring->sq_head);
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+				 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		perror("io_uring_enter");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * uring_get_sqe - get the next free SQE
+ * @ring: ring to submit to
+ *
+ * The SQE is zeroed and only submitted by the next uring_submit_and_wait(). If
+ * the submission ring is full whatever is already prepared is submitted first.
+ *
+ * Returns the SQE or NULL if the ring can't take any more
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - uring_load_acquire(ring->sq_head) ==
+	    ring->sq_entries) {
+		if (uring_enter(ring, 0))
+			return NULL;
+
+		if (ring->sqe_tail - uring_load_acquire(ring->sq_head) ==
+		    ring->sq_entries)
+			return NULL;
+	}
+
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	++ring->sqe_tail;
+
+	return sqe;
+}
+
+/**
+ * uring_submit_and_wait - submit every prepared SQE and wait for completions
+ * @ring: ring to submit to
+ * @wait_nr: number of completions to wait for, 0 to only submit
+ *
+ * Being interrupted by a signal is not an error, the caller simply finds fewer
+ * completions than it waited for.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr)
+{
+	return uring_enter(ring, wait_nr);
+}
+
+/* Returns the oldest completion not yet seen or NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == uring_load_acquire(ring->cq_tail))
+		return NULL;
+
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Give the completion returned by uring_peek_cqe() back to the kernel */
+void uring_cqe_seen(struct uring *ring)
+{
+	uring_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+/**
+ * uring_buf_ring_init - register a group of buffers for provided receives
+ * @ring: ring the buffers are registered with
+ * @bufs: filled in with the buffer group
+ * @bgid: id of the buffer group
+ * @nbufs: number of buffers, must be a power of 2
+ * @buf_size: size of each buffer
+ *
+ * Every buffer starts out owned by the kernel. A receive completion names the
+ * buffer it filled, which has to be given back with uring_buf_recycle().
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bufs,
+			uint16_t bgid, uint32_t nbufs, uint32_t buf_size)
+{
+	struct io_uring_buf_reg reg = { 0 };
+	uint32_t i;
+
+	memset(bufs, 0, sizeof(*bufs));
+	if (!nbufs || (nbufs & (nbufs - 1)) || nbufs > 32768) {
+		printf("[%s:%d] invalid number of buffers %u\n", __func__,
+		       __LINE__, nbufs);
+		return -1;
+	}
+
+	bufs->ring_size = nbufs * sizeof(struct io_uring_buf);
+	bufs->br = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs->br == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	bufs->bufs = mmap(NULL, (size_t)nbufs * buf_size,
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+	if (bufs->bufs == MAP_FAILED) {
+		perror("mmap");
+		goto err_unmap_ring;
+	}
+
+	reg.ring_addr = (uint64_t)(uintptr_t)bufs->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+				  1) < 0) {
+		perror("io_uring_register");
+		goto err_unmap_bufs;
+	}
+
+	bufs->nbufs = nbufs;
+	bufs->buf_size = buf_size;
+	bufs->bgid = bgid;
+	for (i = 0; i < nbufs; ++i)
+		uring_buf_recycle(bufs, i);
+
+	return 0;
+
+err_unmap_bufs:
+	munmap(bufs->bufs, (size_t)nbufs * buf_size);
+err_unmap_ring:
+	munmap(bufs->br, bufs->ring_size);
+	bufs->br = NULL;
+	return -1;
+}
+
+void uring_buf_ring_exit(struct uring *ring, struct uring_buf_ring *bufs)
+{
+	struct io_uring_buf_reg reg = { .bgid = bufs->bgid };
+
+	if (!bufs->br)
+		return;
+
+	sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(bufs->bufs, (size_t)bufs->nbufs * bufs->buf_size);
+	munmap(bufs->br, bufs->ring_size);
+	bufs->br = NULL;
+}
+
+/* Hand a buffer back to the kernel once its contents were consumed */
+void uring_buf_recycle(struct uring_buf_ring *bufs, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &bufs->br->bufs[bufs->tail & (bufs->nbufs - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf(bufs, bid);
+	buf->len = bufs->buf_size;
+	buf->bid = bid;
+	uring_store_release(&bufs->br->tail, ++bufs->tail);
+}
+
+/* One request that keeps posting a completion for every accepted client */
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int listenfd,
+				 int flags, uint64_t data)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenfd;
+	sqe->accept_flags = flags;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = data;
+}
+
+/* One request that keeps receiving into buffers picked from group bgid */
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+			       uint16_t bgid, uint64_t data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bgid;
+	sqe->user_data = data;
+}
+
+/* msg and everything it points to must stay valid until the completion */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+			const struct msghdr *msg, int flags, uint64_t data)
+{
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+		     unsigned len, uint64_t data)
+{
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = data;
+}
@@ -0,0 +1,108 @@
+/**
+ * uring_helpers.h - Minimal io_uring wrapper on top of the raw system calls
+ * Author: Brett Creeley
+ *
+ * Note: Only what the server's io_uring event loop needs is covered. SQEs are
+ *	 prepared with the uring_prep_*() helpers and only handed to the
+ *	 kernel by uring_submit_and_wait(), so everything prepared during one
+ *	 event loop iteration goes in with a single io_uring_enter().
+ */
+#ifndef _URING_HELPERS_H
+#define _URING_HELPERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct msghdr;
+
+/* user_data of a request, tells the loop which op on which fd completed */
+#define URING_DATA(op, fd)	(((uint64_t)(op) << 32) | (uint32_t)(fd))
+#define URING_DATA_OP(data)	((uint32_t)((data) >> 32))
+#define URING_DATA_FD(data)	((int)(uint32_t)(data))
+
+/**
+ * struct uring - an io_uring instance and its mapped rings
+ * @fd: io_uring file descriptor
+ * @sq_head: kernel's submission ring head
+ * @sq_tail: submission ring tail shared with the kernel
+ * @sq_mask: mask of submission ring indices
+ * @sq_entries: number of SQEs
+ * @sqe_tail: tail including SQEs prepared but not yet published
+ * @sqes: submission queue entries
+ * @cq_head: completion ring head, advanced by uring_cqe_seen()
+ * @cq_tail: kernel's completion ring tail
+ * @cq_mask: mask of completion ring indices
+ * @cqes: completion queue entries
+ * @sq_ring: mapping of the submission ring
+ * @sq_ring_size: size of sq_ring
+ * @cq_ring: mapping of the completion ring, same as sq_ring on newer kernels
+ * @cq_ring_size: size of cq_ring
+ * @sqes_size: size of the sqes mapping
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/**
+ * struct uring_buf_ring - a group of buffers the kernel picks receives from
+ * @br: ring the buffers are handed to the kernel through
+ * @bufs: nbufs buffers of buf_size bytes each
+ * @ring_size: size of the br mapping
+ * @nbufs: number of buffers, a power of 2
+ * @buf_size: size of each buffer
+ * @bgid: buffer group id given to uring_prep_recv_multishot()
+ * @tail: tail of br, published to the kernel by uring_buf_recycle()
+ */
+struct uring_buf_ring {
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+	size_t ring_size;
+	uint32_t nbufs;
+	uint32_t buf_size;
+	uint16_t bgid;
+	uint16_t tail;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bufs,
+			uint16_t bgid, uint32_t nbufs, uint32_t buf_size);
+void uring_buf_ring_exit(struct uring *ring, struct uring_buf_ring *bufs);
+void uring_buf_recycle(struct uring_buf_ring *bufs, uint16_t bid);
+
+static inline void *uring_buf(struct uring_buf_ring *bufs, uint16_t bid)
+{
+	return bufs->bufs + (size_t)bid * bufs->buf_size;
+}
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int listenfd,
+				 int flags, uint64_t data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+			       uint16_t bgid, uint64_t data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+			const struct msghdr *msg, int flags, uint64_t data);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+		     unsigned len, uint64_t data);
+
+#endif /* _URING_HELPERS_H */
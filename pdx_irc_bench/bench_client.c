@@ -0,0 +1,249 @@
+/**
+ * bench_client.c - Blocking v2 client helpers shared by the benchmarks
+ * Author: Brett Creeley
+ */
+
+#include "bench_client.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* How long a freshly started server gets to start listening */
+#define SERVER_START_TIMEOUT_MS	5000
+
+double bench_now(void)
+{
+	return bench_now_ns() / 1e9;
+}
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_port(int port)
+{
+	struct sockaddr_in addr = { 0 };
+	int fd, yes = 1;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	return fd;
+}
+
+/**
+ * bench_server_start - run a server in the background
+ * @srv: filled in with the running server
+ * @path: path of the server binary
+ * @argv: NULL terminated arguments of the server, argv[0] included
+ *
+ * The server's output is discarded. Returns once it accepts connections.
+ *
+ * On success returns 0, otherwise return -1
+ */
+int bench_server_start(struct bench_server *srv, const char *path,
+		       char *const argv[])
+{
+	int waited, fd;
+
+	srv->pid = fork();
+	if (srv->pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!srv->pid) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(path, argv);
+		_exit(127);
+	}
+
+	for (waited = 0; waited < SERVER_START_TIMEOUT_MS; waited += 10) {
+		fd = connect_port(srv->port);
+		if (fd >= 0) {
+			close(fd);
+			return 0;
+		}
+
+		if (waitpid(srv->pid, NULL, WNOHANG) == srv->pid)
+			break;
+
+		usleep(10 * 1000);
+	}
+
+	printf("Failed to start %s\n", path);
+	bench_server_stop(srv);
+
+	return -1;
+}
+
+void bench_server_stop(struct bench_server *srv)
+{
+	if (srv->pid <= 0)
+		return;
+
+	kill(srv->pid, SIGTERM);
+	waitpid(srv->pid, NULL, 0);
+	srv->pid = 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t bytes = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("send");
+			return -1;
+		}
+
+		p += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+int bench_send(int fd, const struct message *msg)
+{
+	return bench_send_many(fd, msg, 1);
+}
+
+/**
+ * bench_send_many - pipeline the same message count times
+ * @fd: connected socket
+ * @msg: message to send
+ * @count: number of copies to send back to back
+ *
+ * On success returns 0, otherwise return -1
+ */
+int bench_send_many(int fd, const struct message *msg, int count)
+{
+	uint8_t frame[MSG_V2_MAX_LEN];
+	uint8_t *buf;
+	int len, i, ret;
+
+	len = proto_encode(msg, frame, sizeof(frame));
+	if (len < 0)
+		return -1;
+
+	if (count == 1)
+		return send_all(fd, frame, len);
+
+	buf = malloc((size_t)len * count);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i)
+		memcpy(buf + (size_t)i * len, frame, len);
+
+	ret = send_all(fd, buf, (size_t)len * count);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * bench_recv - receive one frame
+ * @fd: connected socket
+ * @msg: where the frame is decoded to, names of a packed LIST are skipped
+ *
+ * On success returns 0, otherwise return -1
+ */
+int bench_recv(int fd, struct message *msg)
+{
+	uint8_t buf[MSG_V2_LIST_MAX_LEN];
+	uint32_t len;
+
+	if (recv(fd, buf, MSG_HDR_SIZE, MSG_WAITALL) != MSG_HDR_SIZE)
+		return -1;
+
+	len = proto_frame_len((struct msg_hdr *)buf);
+	if (len > sizeof(buf))
+		return -1;
+
+	if (len > MSG_HDR_SIZE &&
+	    recv(fd, buf + MSG_HDR_SIZE, len - MSG_HDR_SIZE, MSG_WAITALL) !=
+	    len - MSG_HDR_SIZE)
+		return -1;
+
+	return proto_decode(buf, len, msg);
+}
+
+/* Send a message and wait for its response, which overwrites msg */
+int bench_request(int fd, struct message *msg)
+{
+	if (bench_send(fd, msg))
+		return -1;
+
+	return bench_recv(fd, msg);
+}
+
+/**
+ * bench_connect - connect to a local server and switch to protocol v2
+ * @port: port the server listens on
+ *
+ * Returns the connected socket or -1 on failure
+ */
+int bench_connect(int port)
+{
+	struct message msg = {
+		.type = HELLO,
+		.hello.version = PROTO_V2,
+	};
+	int fd;
+
+	fd = connect_port(port);
+	if (fd < 0) {
+		perror("connect");
+		return -1;
+	}
+
+	if (bench_request(fd, &msg) || msg.type != HELLO ||
+	    msg.response != RESP_SUCCESS) {
+		printf("Protocol negotiation failed\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
@@ -0,0 +1,34 @@
+/**
+ * bench_client.h - Blocking v2 client helpers shared by the benchmarks
+ * Author: Brett Creeley
+ */
+#ifndef _BENCH_CLIENT_H
+#define _BENCH_CLIENT_H
+
+#include "../common/protocol.h"
+#include <sys/types.h>
+
+#define BENCH_DEFAULT_PORT	5000
+
+/**
+ * struct bench_server - a server started by a benchmark
+ * @pid: process id of the server
+ * @port: port the server listens on
+ */
+struct bench_server {
+	pid_t pid;
+	int port;
+};
+
+int bench_server_start(struct bench_server *srv, const char *path,
+		       char *const argv[]);
+void bench_server_stop(struct bench_server *srv);
+int bench_connect(int port);
+int bench_send(int fd, const struct message *msg);
+int bench_send_many(int fd, const struct message *msg, int count);
+int bench_recv(int fd, struct message *msg);
+int bench_request(int fd, struct message *msg);
+double bench_now(void);
+uint64_t bench_now_ns(void);
+
+#endif /* _BENCH_CLIENT_H */
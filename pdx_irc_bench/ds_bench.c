@@ -0,0 +1,406 @@
+/**
+ * ds_bench.c - Microbenchmarks for the channel and user containers
+ * Author: Brett Creeley
+ *
+ * Note: Every container is driven through struct container_ops, so comparing
+ *	 a replacement only takes adding its ops to containers[]. Each size
+ *	 runs the same phases: add every element, look up random elements that
+ *	 exist, check for random elements that don't, remove random elements
+ *	 and delete whatever is left. A phase stops early once it ran for the
+ *	 time budget, so an O(n) lookup at 1M elements still finishes.
+ *
+ *	 Allocations are counted by wrapping malloc(), calloc() and realloc()
+ *	 at link time (see the Makefile), which covers every call made by the
+ *	 containers' code.
+ */
+
+#include "bench_client.h"
+#include "../common/list/list.h"
+#include "../common/hash/hash_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#define DEFAULT_MAX_SIZE	1000000
+#define DEFAULT_BUDGET_MS	500
+#define MIN_SIZE		10
+
+static uint64_t num_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	++num_allocs;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	++num_allocs;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	++num_allocs;
+	return __real_realloc(ptr, size);
+}
+
+/**
+ * struct container_ops - a channel store under test
+ * @name: name selecting the container with -c
+ * @create: create an empty container
+ * @add: add a channel, the name is unique within the container
+ * @get: find a channel by name, NULL if it isn't there
+ * @contains: check whether a channel is there
+ * @remove: remove a channel and free it, returns -1 if it isn't there
+ * @destroy: free the container and every channel left in it
+ */
+struct container_ops {
+	const char *name;
+	void *(*create)(void);
+	int (*add)(void *ds, char *name);
+	void *(*get)(void *ds, char *name);
+	bool (*contains)(void *ds, char *name);
+	int (*remove)(void *ds, char *name);
+	void (*destroy)(void *ds);
+};
+
+static void *list_create(void)
+{
+	return calloc(1, sizeof(struct list_node *));
+}
+
+static int list_add(void *ds, char *name)
+{
+	return add_channel(ds, name);
+}
+
+/* Only the name of the channel being looked for is compared */
+static void *list_get(void *ds, char *name)
+{
+	struct channel key;
+
+	strncpy(key.name, name, CHANNEL_NAME_MAX_LEN);
+
+	return get_list_node_data(*(struct list_node **)ds, &key,
+				  is_equal_channels);
+}
+
+static bool list_has(void *ds, char *name)
+{
+	struct channel key;
+
+	strncpy(key.name, name, CHANNEL_NAME_MAX_LEN);
+
+	return list_contains(*(struct list_node **)ds, &key,
+			     is_equal_channels);
+}
+
+static int list_remove(void *ds, char *name)
+{
+	struct list_node *node;
+	struct channel key;
+
+	strncpy(key.name, name, CHANNEL_NAME_MAX_LEN);
+	node = rm_list_node(ds, &key, is_equal_channels);
+	if (!node)
+		return -1;
+
+	free_channel((struct channel *)node);
+
+	return 0;
+}
+
+static void list_destroy(void *ds)
+{
+	del_list(ds, del_channel_data);
+	free(ds);
+}
+
+static void *hash_create(void)
+{
+	struct hash_table *ht = malloc(sizeof(*ht));
+
+	if (ht && hash_table_init(ht, offsetof(struct channel, name),
+				  CHANNEL_NAME_MAX_LEN)) {
+		free(ht);
+		return NULL;
+	}
+
+	return ht;
+}
+
+static int hash_add(void *ds, char *name)
+{
+	struct channel *c = alloc_channel();
+
+	if (!c)
+		return -1;
+
+	strncpy(c->name, name, CHANNEL_NAME_MAX_LEN);
+	if (hash_table_insert(ds, c)) {
+		free_channel(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *hash_get(void *ds, char *name)
+{
+	char key[CHANNEL_NAME_MAX_LEN];
+
+	/* Keys are zero padded out to their full length */
+	strncpy(key, name, CHANNEL_NAME_MAX_LEN);
+
+	return hash_table_lookup(ds, key);
+}
+
+static bool hash_contains(void *ds, char *name)
+{
+	return hash_get(ds, name) != NULL;
+}
+
+static int hash_remove(void *ds, char *name)
+{
+	char key[CHANNEL_NAME_MAX_LEN];
+	struct channel *c;
+
+	strncpy(key, name, CHANNEL_NAME_MAX_LEN);
+	c = hash_table_remove(ds, key);
+	if (!c)
+		return -1;
+
+	free_channel(c);
+
+	return 0;
+}
+
+static void hash_destroy(void *ds)
+{
+	struct channel *c;
+	uint32_t iter;
+
+	hash_table_for_each(ds, iter, c)
+		free_channel(c);
+	hash_table_destroy(ds);
+	free(ds);
+}
+
+static const struct container_ops containers[] = {
+	{
+		.name = "list",
+		.create = list_create,
+		.add = list_add,
+		.get = list_get,
+		.contains = list_has,
+		.remove = list_remove,
+		.destroy = list_destroy,
+	},
+	{
+		.name = "hash",
+		.create = hash_create,
+		.add = hash_add,
+		.get = hash_get,
+		.contains = hash_contains,
+		.remove = hash_remove,
+		.destroy = hash_destroy,
+	},
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t budget_ns = DEFAULT_BUDGET_MS * 1000000ULL;
+
+static uint32_t bench_rand(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* Names are "c<index>", indices past the container's size never exist */
+static void elem_name(uint32_t idx, char *name)
+{
+	snprintf(name, CHANNEL_NAME_MAX_LEN, "c%u", idx);
+}
+
+/**
+ * struct phase - timing of one phase
+ * @start_ns: when the phase started
+ * @allocs: num_allocs when the phase started
+ * @ops: operations done so far
+ */
+struct phase {
+	uint64_t start_ns;
+	uint64_t allocs;
+	uint64_t ops;
+};
+
+static void phase_start(struct phase *p)
+{
+	p->ops = 0;
+	p->allocs = num_allocs;
+	p->start_ns = bench_now_ns();
+}
+
+/* Only look at the clock every few operations, it costs more than a lookup */
+static bool phase_over(struct phase *p, uint64_t max_ops)
+{
+	if (p->ops >= max_ops)
+		return true;
+
+	return !(p->ops & 15) && p->ops &&
+		bench_now_ns() - p->start_ns >= budget_ns;
+}
+
+static void phase_end(struct phase *p, const char *container, uint32_t size,
+		      const char *op)
+{
+	uint64_t ns = bench_now_ns() - p->start_ns;
+	uint64_t allocs = num_allocs - p->allocs;
+
+	printf("%-8s %10u %-10s %10" PRIu64 " %12.1f %12.3f\n", container,
+	       size, op, p->ops, p->ops ? (double)ns / p->ops : 0.0,
+	       p->ops ? (double)allocs / p->ops : 0.0);
+}
+
+/**
+ * bench_size - run every phase on one container of one size
+ * @ops: container under test
+ * @size: number of elements
+ *
+ * Returns 0 on success or -1 if the container misbehaved
+ */
+static int bench_size(const struct container_ops *ops, uint32_t size)
+{
+	char name[CHANNEL_NAME_MAX_LEN];
+	uint32_t left = size;
+	struct phase p;
+	void *ds;
+
+	ds = ops->create();
+	if (!ds)
+		return -1;
+
+	phase_start(&p);
+	for (; p.ops < size; ++p.ops) {
+		elem_name(p.ops, name);
+		if (ops->add(ds, name)) {
+			printf("%s: add %s failed\n", ops->name, name);
+			return -1;
+		}
+	}
+	phase_end(&p, ops->name, size, "add");
+
+	phase_start(&p);
+	for (; !phase_over(&p, size); ++p.ops) {
+		elem_name(bench_rand() % size, name);
+		if (!ops->get(ds, name)) {
+			printf("%s: %s not found\n", ops->name, name);
+			return -1;
+		}
+	}
+	phase_end(&p, ops->name, size, "get");
+
+	phase_start(&p);
+	for (; !phase_over(&p, size); ++p.ops) {
+		elem_name(size + bench_rand() % size, name);
+		if (ops->contains(ds, name)) {
+			printf("%s: %s found\n", ops->name, name);
+			return -1;
+		}
+	}
+	phase_end(&p, ops->name, size, "contains");
+
+	/* Remove from the front of a random permutation so each one exists */
+	phase_start(&p);
+	for (; !phase_over(&p, size); ++p.ops) {
+		elem_name(((uint64_t)p.ops * 2654435761u) % size, name);
+		if (ops->remove(ds, name)) {
+			printf("%s: remove %s failed\n", ops->name, name);
+			return -1;
+		}
+		--left;
+	}
+	phase_end(&p, ops->name, size, "remove");
+
+	phase_start(&p);
+	ops->destroy(ds);
+	p.ops = left;
+	phase_end(&p, ops->name, size, "destroy");
+
+	return 0;
+}
+
+static void print_usage(char *prog)
+{
+	int i;
+
+	printf("Usage: %s [-c container] [-n max_size] [-t budget_ms]\n"
+	       "\t-c: container to run, one of", prog);
+	for (i = 0; i < sizeof(containers) / sizeof(containers[0]); ++i)
+		printf(" %s", containers[i].name);
+	printf(" (default all)\n"
+	       "\t-n: largest size, sizes go up by 10x from %d (default %d)\n"
+	       "\t-t: time budget of each phase in ms (default %d)\n",
+	       MIN_SIZE, DEFAULT_MAX_SIZE, DEFAULT_BUDGET_MS);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t max_size = DEFAULT_MAX_SIZE, size;
+	const char *only = NULL;
+	int opt, i, ret = 0;
+	bool found = false;
+
+	while ((opt = getopt(argc, argv, "c:n:t:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			only = optarg;
+			break;
+		case 'n':
+			max_size = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			budget_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (max_size < MIN_SIZE || !budget_ns) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-8s %10s %-10s %10s %12s %12s\n", "store", "size", "op", "ops",
+	       "ns/op", "allocs/op");
+
+	for (i = 0; i < sizeof(containers) / sizeof(containers[0]); ++i) {
+		if (only && strcmp(only, containers[i].name))
+			continue;
+
+		found = true;
+		for (size = MIN_SIZE; size <= max_size; size *= 10)
+			ret |= bench_size(&containers[i], size);
+	}
+
+	if (!found) {
+		printf("Unknown container %s\n", only);
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+/**
+ * epoll_bench.c - Compare level and edge triggered servers under pipelining
+ * Author: Brett Creeley
+ *
+ * Note: Every client joins its own channel and then repeatedly pipelines a
+ *	 burst of CHAT messages and waits for all of their responses. The same
+ *	 load is run against a server started with its defaults, which is level
+ *	 triggered with the default event batch, against one started with
+ *	 -E and the requested batch size and against the io_uring backend.
+ *	 The io_uring server runs last, its listening socket can outlive the
+ *	 process for a moment while the kernel tears the ring down.
+ */
+
+#include "bench_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DEFAULT_SERVER_PATH	"../pdx_irc_server/server"
+#define DEFAULT_CLIENTS		32
+#define DEFAULT_BURST		100
+#define DEFAULT_ROUNDS		200
+#define DEFAULT_BATCH		"256"
+
+/**
+ * struct bench_config - one server configuration under test
+ * @name: printed name of the configuration
+ * @args: extra server arguments, NULL terminated
+ */
+struct bench_config {
+	const char *name;
+	char *args[8];
+};
+
+static int num_clients = DEFAULT_CLIENTS;
+static int burst = DEFAULT_BURST;
+static int rounds = DEFAULT_ROUNDS;
+static pthread_barrier_t start_barrier;
+
+struct client {
+	pthread_t thread;
+	int id;
+	int fd;
+	int failed;
+};
+
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+	struct message msg = { 0 };
+	int r, i;
+
+	msg.type = JOIN;
+	snprintf(msg.join.src_user, USER_NAME_MAX_LEN, "bench%d", c->id);
+	snprintf(msg.join.channel_name, CHANNEL_NAME_MAX_LEN, "bench%d", c->id);
+	if (bench_request(c->fd, &msg) || msg.response != RESP_SUCCESS)
+		c->failed = 1;
+
+	pthread_barrier_wait(&start_barrier);
+	if (c->failed)
+		return NULL;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = CHAT;
+	snprintf(msg.chat.src_user, USER_NAME_MAX_LEN, "bench%d", c->id);
+	snprintf(msg.chat.channel_name, CHANNEL_NAME_MAX_LEN, "bench%d", c->id);
+	strcpy(msg.chat.text, "the quick brown fox jumps over the lazy dog");
+
+	for (r = 0; r < rounds; ++r) {
+		struct message resp;
+
+		if (bench_send_many(c->fd, &msg, burst)) {
+			c->failed = 1;
+			break;
+		}
+
+		for (i = 0; i < burst; ++i) {
+			if (bench_recv(c->fd, &resp) ||
+			    resp.response != RESP_SUCCESS) {
+				c->failed = 1;
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int run_config(const char *server_path, struct bench_config *cfg)
+{
+	struct bench_server srv = { .port = BENCH_DEFAULT_PORT };
+	char *argv[16] = { (char *)server_path, "-w", "1" };
+	struct client *clients;
+	double start, secs;
+	int i, failed = 0;
+
+	for (i = 0; cfg->args[i]; ++i)
+		argv[3 + i] = cfg->args[i];
+
+	if (bench_server_start(&srv, server_path, argv))
+		return -1;
+
+	clients = calloc(num_clients, sizeof(*clients));
+	if (!clients) {
+		perror("calloc");
+		bench_server_stop(&srv);
+		return -1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, num_clients + 1);
+	for (i = 0; i < num_clients; ++i) {
+		clients[i].id = i;
+		clients[i].fd = bench_connect(srv.port);
+		if (clients[i].fd < 0)
+			clients[i].failed = 1;
+		pthread_create(&clients[i].thread, NULL, client_thread,
+			       &clients[i]);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = bench_now();
+	for (i = 0; i < num_clients; ++i) {
+		pthread_join(clients[i].thread, NULL);
+		failed |= clients[i].failed;
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	}
+	secs = bench_now() - start;
+
+	pthread_barrier_destroy(&start_barrier);
+	free(clients);
+	bench_server_stop(&srv);
+
+	if (failed) {
+		printf("%-24s failed\n", cfg->name);
+		return -1;
+	}
+
+	printf("%-24s %10.3f %14.0f %12.1f\n", cfg->name, secs,
+	       (double)num_clients * rounds * burst / secs,
+	       secs * 1e6 / rounds);
+
+	return 0;
+}
+
+static void print_usage(char *prog)
+{
+	printf("Usage: %s [-s server] [-c clients] [-b burst] [-r rounds] [-e batch]\n"
+	       "\t-s: server binary to run (default %s)\n"
+	       "\t-c: concurrent clients (default %d)\n"
+	       "\t-b: CHAT messages pipelined per round (default %d)\n"
+	       "\t-r: rounds per client (default %d)\n"
+	       "\t-e: epoll batch of the edge triggered server (default %s)\n",
+	       prog, DEFAULT_SERVER_PATH, DEFAULT_CLIENTS, DEFAULT_BURST,
+	       DEFAULT_ROUNDS, DEFAULT_BATCH);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *server_path = DEFAULT_SERVER_PATH;
+	char *batch = DEFAULT_BATCH;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "s:c:b:r:e:h")) != -1) {
+		switch (opt) {
+		case 's':
+			server_path = optarg;
+			break;
+		case 'c':
+			num_clients = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'e':
+			batch = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (num_clients < 1 || burst < 1 || rounds < 1) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct bench_config configs[] = {
+		{ "level triggered", { NULL } },
+		{ "level triggered, batch", { "-e", batch, NULL } },
+		{ "edge triggered, batch", { "-E", "-e", batch, NULL } },
+		{ "io_uring", { "-B", "io_uring", NULL } },
+	};
+	int i;
+
+	printf("%d clients, %d rounds of %d pipelined CHATs\n", num_clients,
+	       rounds, burst);
+	printf("%-24s %10s %14s %12s\n", "server", "seconds", "msgs/s",
+	       "us/round");
+
+	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i)
+		ret |= run_config(server_path, &configs[i]);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+/**
+ * histogram.c - Log-linear histogram for latency percentiles
+ * Author: Brett Creeley
+ */
+
+#include "histogram.h"
+#include <string.h>
+
+static uint32_t hist_bucket(uint64_t val)
+{
+	uint32_t shift;
+
+	if (val < HIST_SUB_BUCKETS)
+		return val;
+
+	shift = 63 - __builtin_clzll(val) - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB_BUCKETS +
+		((val >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Largest value that lands in a bucket */
+static uint64_t hist_bucket_max(uint32_t bucket)
+{
+	uint32_t shift;
+
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / HIST_SUB_BUCKETS - 1;
+
+	return (((uint64_t)HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS + 1)
+		<< shift) - 1;
+}
+
+void hist_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_add(struct histogram *h, uint64_t val)
+{
+	++h->buckets[hist_bucket(val)];
+	++h->count;
+	h->sum += val;
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/* Add everything recorded in src to dst */
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	uint32_t i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/**
+ * hist_percentile - value below which a percentage of the values fall
+ * @h: histogram to look at
+ * @pct: percentage between 0 and 100
+ *
+ * Returns the largest value of the bucket the percentile falls in, capped at
+ * the largest value recorded, or 0 if nothing was recorded.
+ */
+uint64_t hist_percentile(const struct histogram *h, double pct)
+{
+	uint64_t rank, seen = 0;
+	uint32_t i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (uint64_t)(pct / 100.0 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == HIST_BUCKETS || hist_bucket_max(i) > h->max)
+		return h->max;
+
+	return hist_bucket_max(i);
+}
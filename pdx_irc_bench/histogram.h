@@ -0,0 +1,41 @@
+/**
+ * histogram.h - Log-linear histogram for latency percentiles
+ * Author: Brett Creeley
+ *
+ * Note: A value lands in a bucket picked by its highest set bit and then
+ *	 linearly by the HIST_SUB_BITS bits below it, so a percentile is never
+ *	 off by more than 1 / HIST_SUB_BUCKETS of the real value. Recording is
+ *	 a handful of instructions and the histogram has a fixed size, which
+ *	 lets every delivered message be recorded.
+ */
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS		5
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/**
+ * struct histogram - recorded values
+ * @count: number of values recorded
+ * @min: smallest value recorded
+ * @max: largest value recorded
+ * @sum: sum of every value recorded
+ * @buckets: number of values recorded per bucket
+ */
+struct histogram {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *h);
+void hist_add(struct histogram *h, uint64_t val);
+void hist_merge(struct histogram *dst, const struct histogram *src);
+uint64_t hist_percentile(const struct histogram *h, double pct);
+
+#endif /* _HISTOGRAM_H */
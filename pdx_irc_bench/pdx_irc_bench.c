@@ -0,0 +1,832 @@
+/**
+ * pdx_irc_bench.c - Load generator reporting throughput and delivery latency
+ * Author: Brett Creeley
+ *
+ * Note: Every connection is driven by a single epoll loop in this process
+ *	 and only ever talks to a server on the loopback interface.
+ *	 Connections are grouped into channels of -C members. Once every
+ *	 connection joined its channel, operations are picked from the -m mix
+ *	 and issued at -r per second in total, each connection keeping at
+ *	 most -W requests outstanding. A CHAT carries the time it was sent in
+ *	 its text, so every member it is delivered to records the latency.
+ *	 A DIRECT goes to a random other connection and is timed the same.
+ *	 Channels are addressed by the id their JOIN returned unless -n is
+ *	 given, which makes every request carry the channel's name instead.
+ */
+
+#include "bench_client.h"
+#include "histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define DEFAULT_CONNS		1000
+#define DEFAULT_CHANNEL_SIZE	10
+#define DEFAULT_RATE		10000
+#define DEFAULT_DURATION	10
+#define DEFAULT_WINDOW		8
+#define DEFAULT_TEXT_LEN	64
+#define DEFAULT_MIX		"chat=100"
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_USEC		1000ULL
+/* How long outstanding requests get to complete once the run is over */
+#define DRAIN_TIMEOUT_NS	(2 * NSEC_PER_SEC)
+#define RX_SCRATCH_SIZE		(64 * 1024)
+#define MAX_EVENTS		256
+
+enum bench_op {
+	OP_CHAT,
+	OP_JOIN,
+	OP_LEAVE,
+	OP_LIST,
+	OP_DIRECT,
+	NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+	[OP_CHAT] = "chat",
+	[OP_JOIN] = "join",
+	[OP_LEAVE] = "leave",
+	[OP_LIST] = "list",
+	[OP_DIRECT] = "direct",
+};
+
+/**
+ * struct bench_conn - one client connection
+ * @fd: non-blocking socket
+ * @home: channel this connection always stays in and chats to
+ * @extra: channel joined by a JOIN of the mix, -1 if none
+ * @home_id: channel id the server gave home
+ * @extra_id: channel id the server gave extra, CHANNEL_ID_NONE until known
+ * @outstanding: requests sent that haven't been answered yet
+ * @listing: a LIST_USERS is in progress, only one at a time is allowed
+ * @name: user name of this connection
+ * @rx_buf: bytes of a partially received frame, allocated when first needed
+ * @rx_len: number of bytes in rx_buf
+ * @tx_buf: bytes the socket didn't take yet, allocated when first needed
+ * @tx_len: number of bytes in tx_buf
+ * @tx_size: allocated size of tx_buf
+ */
+struct bench_conn {
+	int fd;
+	uint32_t home;
+	int32_t extra;
+	uint32_t home_id;
+	uint32_t extra_id;
+	uint32_t outstanding;
+	bool listing;
+	char name[USER_NAME_MAX_LEN];
+	uint8_t *rx_buf;
+	uint32_t rx_len;
+	uint8_t *tx_buf;
+	uint32_t tx_len;
+	uint32_t tx_size;
+};
+
+/**
+ * struct bench_stats - what happened during an interval or the whole run
+ * @sent: requests sent per operation
+ * @delivered: CHAT messages received from other members
+ * @errors: requests that failed
+ * @latency: delivery latency of every CHAT received, in nanoseconds
+ */
+struct bench_stats {
+	uint64_t sent[NUM_OPS];
+	uint64_t delivered;
+	uint64_t errors;
+	struct histogram latency;
+};
+
+static struct bench_conn *conns;
+static int num_conns = DEFAULT_CONNS;
+static int channel_size = DEFAULT_CHANNEL_SIZE;
+static int num_channels;
+static int window = DEFAULT_WINDOW;
+static int text_len = DEFAULT_TEXT_LEN;
+static bool by_name;
+static uint32_t mix[NUM_OPS];
+static uint32_t mix_total;
+static uint64_t total_outstanding;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static int epollfd;
+static uint8_t rx_scratch[RX_SCRATCH_SIZE];
+
+/* Interval stats are printed and merged into the totals every second */
+static struct bench_stats interval;
+static struct bench_stats total;
+
+static uint32_t bench_rand(void)
+{
+	/* xorshift64*, plenty for picking operations and channels */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/**
+ * parse_mix - parse the operation mix
+ * @spec: comma separated op=weight pairs, i.e. "chat=90,join=5,leave=5"
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int parse_mix(const char *spec)
+{
+	char *copy, *tok, *save;
+	int i, ret = 0;
+
+	copy = strdup(spec);
+	if (!copy)
+		return -1;
+
+	memset(mix, 0, sizeof(mix));
+	mix_total = 0;
+	for (tok = strtok_r(copy, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(tok, '=');
+
+		if (!eq) {
+			ret = -1;
+			break;
+		}
+
+		*eq = '\0';
+		for (i = 0; i < NUM_OPS; ++i)
+			if (!strcmp(tok, op_names[i]))
+				break;
+
+		if (i == NUM_OPS || atoi(eq + 1) < 0) {
+			ret = -1;
+			break;
+		}
+
+		mix[i] = atoi(eq + 1);
+		mix_total += mix[i];
+	}
+
+	free(copy);
+	if (!mix_total)
+		ret = -1;
+
+	return ret;
+}
+
+static enum bench_op pick_op(void)
+{
+	uint32_t r = bench_rand() % mix_total;
+	int i;
+
+	for (i = 0; i < NUM_OPS - 1; ++i) {
+		if (r < mix[i])
+			break;
+		r -= mix[i];
+	}
+
+	return i;
+}
+
+static void channel_name(uint32_t channel, char *name)
+{
+	snprintf(name, CHANNEL_NAME_MAX_LEN, "bench%u", channel);
+}
+
+static void set_want_out(struct bench_conn *c, bool want_out)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+		.data.ptr = c,
+	};
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev))
+		perror("epoll_ctl");
+}
+
+/* Send whatever the socket didn't take earlier, returns -1 on error */
+static int conn_flush(struct bench_conn *c)
+{
+	ssize_t sent;
+
+	if (!c->tx_len)
+		return 0;
+
+	sent = send(c->fd, c->tx_buf, c->tx_len, MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("send");
+		return -1;
+	}
+
+	c->tx_len -= sent;
+	memmove(c->tx_buf, c->tx_buf + sent, c->tx_len);
+	if (!c->tx_len)
+		set_want_out(c, false);
+
+	return 0;
+}
+
+/**
+ * conn_send - send a message, parking what the socket doesn't take
+ * @c: connection to send on
+ * @msg: message to send
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int conn_send(struct bench_conn *c, const struct message *msg)
+{
+	uint8_t frame[MSG_V2_MAX_LEN];
+	ssize_t sent = 0;
+	int len;
+
+	len = proto_encode(msg, frame, sizeof(frame));
+	if (len < 0)
+		return -1;
+
+	if (!c->tx_len) {
+		sent = send(c->fd, frame, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("send");
+				return -1;
+			}
+			sent = 0;
+		}
+
+		if (sent == len)
+			return 0;
+	}
+
+	if (c->tx_len + len - sent > c->tx_size) {
+		uint32_t size = c->tx_size ? c->tx_size * 2 : 4096;
+		uint8_t *buf;
+
+		while (size < c->tx_len + len - sent)
+			size *= 2;
+
+		buf = realloc(c->tx_buf, size);
+		if (!buf) {
+			perror("realloc");
+			return -1;
+		}
+
+		c->tx_buf = buf;
+		c->tx_size = size;
+	}
+
+	memcpy(c->tx_buf + c->tx_len, frame + sent, len - sent);
+	if (!c->tx_len)
+		set_want_out(c, true);
+	c->tx_len += len - sent;
+
+	return 0;
+}
+
+/* Send the next operation of the mix on a connection */
+static int issue_op(struct bench_conn *c, uint64_t now)
+{
+	enum bench_op op = pick_op();
+	struct message msg = { 0 };
+	int len;
+
+	/* Operations that don't apply to the connection's state chat instead */
+	if ((op == OP_JOIN && (c->extra >= 0 || num_channels < 2)) ||
+	    (op == OP_LEAVE && c->extra < 0) || (op == OP_LIST && c->listing) ||
+	    (op == OP_DIRECT && num_conns < 2))
+		op = OP_CHAT;
+
+	switch (op) {
+	case OP_CHAT:
+		msg.type = CHAT;
+		strncpy(msg.chat.src_user, c->name, USER_NAME_MAX_LEN);
+		if (by_name)
+			channel_name(c->home, msg.chat.channel_name);
+		else
+			msg.chat_channel_id = c->home_id;
+		len = snprintf(msg.chat.text, CHAT_MSG_MAX_LEN, "%" PRIu64 " ",
+			       now);
+		while (len < text_len)
+			msg.chat.text[len++] = 'x';
+		break;
+	case OP_JOIN:
+		c->extra = bench_rand() % (num_channels - 1);
+		if (c->extra >= c->home)
+			++c->extra;
+		msg.type = JOIN;
+		strncpy(msg.join.src_user, c->name, USER_NAME_MAX_LEN);
+		channel_name(c->extra, msg.join.channel_name);
+		break;
+	case OP_LEAVE:
+		msg.type = LEAVE;
+		strncpy(msg.leave.src_user, c->name, USER_NAME_MAX_LEN);
+		/* The JOIN may not have been answered yet */
+		if (by_name || c->extra_id == CHANNEL_ID_NONE)
+			channel_name(c->extra, msg.leave.channel_name);
+		else
+			msg.leave.channel_id = c->extra_id;
+		c->extra = -1;
+		c->extra_id = CHANNEL_ID_NONE;
+		break;
+	case OP_DIRECT: {
+		int dst = bench_rand() % (num_conns - 1);
+
+		if (dst >= c - conns)
+			++dst;
+		msg.type = DIRECT;
+		strncpy(msg.direct.src_user, c->name, USER_NAME_MAX_LEN);
+		strncpy(msg.direct.dst_user, conns[dst].name, USER_NAME_MAX_LEN);
+		len = snprintf(msg.direct.text, CHAT_MSG_MAX_LEN, "%" PRIu64 " ",
+			       now);
+		while (len < text_len)
+			msg.direct.text[len++] = 'x';
+		break;
+	}
+	case OP_LIST:
+		msg.type = LIST_USERS;
+		strncpy(msg.list_users.src_user, c->name, USER_NAME_MAX_LEN);
+		if (by_name)
+			channel_name(c->home, msg.list_users.channel_name);
+		else
+			msg.list_users.channel_id = c->home_id;
+		c->listing = true;
+		break;
+	default:
+		return -1;
+	}
+
+	if (conn_send(c, &msg))
+		return -1;
+
+	++c->outstanding;
+	++total_outstanding;
+	++interval.sent[op];
+
+	return 0;
+}
+
+static void complete_request(struct bench_conn *c, bool ok)
+{
+	if (c->outstanding) {
+		--c->outstanding;
+		--total_outstanding;
+	}
+
+	if (!ok)
+		++interval.errors;
+}
+
+static int handle_frame(struct bench_conn *c, const uint8_t *frame,
+			uint32_t len, uint64_t now)
+{
+	struct message msg;
+
+	if (proto_decode(frame, len, &msg)) {
+		printf("Malformed frame on %s\n", c->name);
+		return -1;
+	}
+
+	switch (msg.type) {
+	case CHAT:
+		/* Our own CHAT only comes back as the response */
+		if (strncmp(msg.chat.src_user, c->name, USER_NAME_MAX_LEN)) {
+			uint64_t sent = strtoull(msg.chat.text, NULL, 10);
+
+			++interval.delivered;
+			hist_add(&interval.latency, now > sent ? now - sent : 0);
+		} else {
+			complete_request(c, msg.response == RESP_SUCCESS);
+		}
+		break;
+	case DIRECT:
+		if (strncmp(msg.direct.src_user, c->name, USER_NAME_MAX_LEN)) {
+			uint64_t sent = strtoull(msg.direct.text, NULL, 10);
+
+			++interval.delivered;
+			hist_add(&interval.latency, now > sent ? now - sent : 0);
+		} else {
+			complete_request(c, msg.response == RESP_SUCCESS);
+		}
+		break;
+	case JOIN:
+		/* Unless it was left again, maybe for another JOIN already */
+		if (msg.response == RESP_SUCCESS && c->extra >= 0) {
+			char name[CHANNEL_NAME_MAX_LEN];
+
+			channel_name(c->extra, name);
+			if (!strncmp(name, msg.join.channel_name,
+				     CHANNEL_NAME_MAX_LEN))
+				c->extra_id = msg.join.channel_id;
+		}
+		complete_request(c, msg.response == RESP_SUCCESS);
+		break;
+	case LEAVE:
+		complete_request(c, msg.response == RESP_SUCCESS);
+		break;
+	case LIST_USERS:
+		if (msg.response == RESP_LIST_USERS_IN_PROGRESS)
+			break;
+		c->listing = false;
+		complete_request(c, msg.response == RESP_DONE_SENDING_USERS);
+		break;
+	default:
+		++interval.errors;
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * conn_read - receive and handle every complete frame
+ * @c: connection with data to read
+ * @now: time the data was picked up
+ *
+ * A partial frame left at the end is kept in rx_buf and put back in front of
+ * the next read.
+ *
+ * Returns 0 on success or -1 if the connection is gone
+ */
+static int conn_read(struct bench_conn *c, uint64_t now)
+{
+	uint32_t len = c->rx_len, pos = 0;
+	ssize_t bytes;
+
+	memcpy(rx_scratch, c->rx_buf, c->rx_len);
+	bytes = recv(c->fd, rx_scratch + len, sizeof(rx_scratch) - len, 0);
+	if (bytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("recv");
+		return -1;
+	}
+
+	if (!bytes) {
+		printf("Server closed the connection of %s\n", c->name);
+		return -1;
+	}
+
+	len += bytes;
+	while (len - pos >= MSG_HDR_SIZE) {
+		uint32_t frame_len;
+
+		frame_len = proto_frame_len((struct msg_hdr *)(rx_scratch + pos));
+		if (frame_len > MSG_V2_LIST_MAX_LEN) {
+			printf("Frame of %u bytes on %s is too large\n",
+			       frame_len, c->name);
+			return -1;
+		}
+
+		if (len - pos < frame_len)
+			break;
+
+		if (handle_frame(c, rx_scratch + pos, frame_len, now))
+			return -1;
+		pos += frame_len;
+	}
+
+	c->rx_len = len - pos;
+	if (c->rx_len) {
+		if (!c->rx_buf) {
+			c->rx_buf = malloc(MSG_V2_LIST_MAX_LEN);
+			if (!c->rx_buf) {
+				perror("malloc");
+				return -1;
+			}
+		}
+		memcpy(c->rx_buf, rx_scratch + pos, c->rx_len);
+	}
+
+	return 0;
+}
+
+/* Connect every client and join each to its home channel */
+static int setup_conns(void)
+{
+	int i;
+
+	conns = calloc(num_conns, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
+		return -1;
+	}
+
+	epollfd = epoll_create1(0);
+	if (epollfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	for (i = 0; i < num_conns; ++i) {
+		struct bench_conn *c = &conns[i];
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		struct message msg = { .type = JOIN };
+
+		snprintf(c->name, USER_NAME_MAX_LEN, "b%d", i);
+		c->home = i / channel_size;
+		c->extra = -1;
+
+		c->fd = bench_connect(BENCH_DEFAULT_PORT);
+		if (c->fd < 0)
+			return -1;
+
+		strncpy(msg.join.src_user, c->name, USER_NAME_MAX_LEN);
+		channel_name(c->home, msg.join.channel_name);
+		if (bench_request(c->fd, &msg) || msg.response != RESP_SUCCESS) {
+			printf("%s failed to join its channel\n", c->name);
+			return -1;
+		}
+		c->home_id = msg.join.channel_id;
+
+		if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK)) {
+			perror("fcntl");
+			return -1;
+		}
+
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Thousands of connections need more fds than the default soft limit */
+static void raise_fd_limit(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		return;
+
+	rlim.rlim_cur = rlim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rlim))
+		perror("setrlimit");
+}
+
+static void print_stats_line(double secs, struct bench_stats *s, double len)
+{
+	uint64_t sent = 0;
+	int i;
+
+	for (i = 0; i < NUM_OPS; ++i)
+		sent += s->sent[i];
+
+	printf("%8.1f %12.0f %14.0f %10.1f %10.1f %10.1f %8" PRIu64 "\n", secs,
+	       sent / len, s->delivered / len,
+	       hist_percentile(&s->latency, 50) / (double)NSEC_PER_USEC,
+	       hist_percentile(&s->latency, 99) / (double)NSEC_PER_USEC,
+	       hist_percentile(&s->latency, 99.9) / (double)NSEC_PER_USEC,
+	       s->errors);
+}
+
+/* Fold the interval into the totals, printing it first if asked to */
+static void end_interval(double secs, double len, bool print)
+{
+	int i;
+
+	if (print)
+		print_stats_line(secs, &interval, len);
+
+	for (i = 0; i < NUM_OPS; ++i)
+		total.sent[i] += interval.sent[i];
+	total.delivered += interval.delivered;
+	total.errors += interval.errors;
+	hist_merge(&total.latency, &interval.latency);
+
+	memset(interval.sent, 0, sizeof(interval.sent));
+	interval.delivered = 0;
+	interval.errors = 0;
+	hist_init(&interval.latency);
+}
+
+/**
+ * run - drive the load until the duration is over
+ * @rate: operations per second in total, 0 to keep every window full
+ * @duration: seconds to run for
+ *
+ * Outstanding requests get DRAIN_TIMEOUT_NS to complete afterwards.
+ *
+ * Returns the number of seconds the load was issued for or a negative value
+ * if a connection failed
+ */
+static double run(uint64_t rate, int duration)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t start, now, end, next_report, stopped, issued = 0;
+	uint32_t next_conn = 0;
+	bool draining = false;
+
+	start = bench_now_ns();
+	end = start + duration * NSEC_PER_SEC;
+	next_report = start + NSEC_PER_SEC;
+
+	while (1) {
+		int nfds, i;
+
+		nfds = epoll_wait(epollfd, events, MAX_EVENTS, rate ? 1 : 100);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		now = bench_now_ns();
+		for (i = 0; i < nfds; ++i) {
+			struct bench_conn *c = events[i].data.ptr;
+
+			if ((events[i].events & EPOLLOUT) && conn_flush(c))
+				return -1;
+
+			if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+			    conn_read(c, now))
+				return -1;
+		}
+
+		if (now >= next_report) {
+			end_interval((next_report - start) / (double)NSEC_PER_SEC,
+				     1.0, !draining);
+			next_report += NSEC_PER_SEC;
+		}
+
+		if (!draining && now >= end) {
+			draining = true;
+			stopped = now;
+			end += DRAIN_TIMEOUT_NS;
+		}
+
+		if (draining) {
+			if (!total_outstanding || now >= end)
+				break;
+			continue;
+		}
+
+		/* Hand out what is due round robin, skipping full windows */
+		while (!rate || issued < (now - start) * rate / NSEC_PER_SEC) {
+			uint32_t tried;
+
+			for (tried = 0; tried < num_conns; ++tried) {
+				struct bench_conn *c = &conns[next_conn];
+
+				next_conn = (next_conn + 1) % num_conns;
+				if (c->outstanding < window)
+					break;
+			}
+
+			if (tried == num_conns)
+				break;
+
+			if (issue_op(&conns[(next_conn + num_conns - 1) %
+					    num_conns], now))
+				return -1;
+			++issued;
+		}
+	}
+
+	end_interval(0, 1.0, false);
+
+	return (stopped - start) / (double)NSEC_PER_SEC;
+}
+
+static void print_usage(char *prog)
+{
+	printf("Usage: %s [-c conns] [-C channel_size] [-r rate] [-d secs] [-W window]\n"
+	       "\t\t[-t text_len] [-m mix] [-n] [-s server [-- server args]]\n"
+	       "\t-c: connections to open (default %d)\n"
+	       "\t-C: members per channel (default %d)\n"
+	       "\t-r: operations per second in total, 0 for as fast as the\n"
+	       "\t    windows allow (default %d)\n"
+	       "\t-d: seconds to run for (default %d)\n"
+	       "\t-W: outstanding requests per connection (default %d)\n"
+	       "\t-t: bytes of CHAT text, at least the timestamp (default %d)\n"
+	       "\t-m: weights of chat, join, leave, list and direct (default %s)\n"
+	       "\t-n: address channels by name instead of by channel id\n"
+	       "\t-s: start this server binary instead of using a running one\n"
+	       "The server must listen on port %d of the loopback interface\n",
+	       prog, DEFAULT_CONNS, DEFAULT_CHANNEL_SIZE, DEFAULT_RATE,
+	       DEFAULT_DURATION, DEFAULT_WINDOW, DEFAULT_TEXT_LEN,
+	       DEFAULT_MIX, BENCH_DEFAULT_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_server srv = { .port = BENCH_DEFAULT_PORT };
+	const char *mix_spec = DEFAULT_MIX;
+	const char *server_path = NULL;
+	int duration = DEFAULT_DURATION;
+	uint64_t rate = DEFAULT_RATE, sent;
+	double secs;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:C:r:d:W:t:m:ns:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			num_conns = atoi(optarg);
+			break;
+		case 'C':
+			channel_size = atoi(optarg);
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'W':
+			window = atoi(optarg);
+			break;
+		case 't':
+			text_len = atoi(optarg);
+			break;
+		case 'm':
+			mix_spec = optarg;
+			break;
+		case 'n':
+			by_name = true;
+			break;
+		case 's':
+			server_path = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (num_conns < 1 || channel_size < 1 || duration < 1 || window < 1 ||
+	    text_len < 0 || text_len >= CHAT_MSG_MAX_LEN ||
+	    parse_mix(mix_spec)) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	num_channels = (num_conns + channel_size - 1) / channel_size;
+	hist_init(&interval.latency);
+	hist_init(&total.latency);
+	raise_fd_limit();
+
+	if (server_path) {
+		char **srv_argv = calloc(argc - optind + 2, sizeof(*srv_argv));
+
+		if (!srv_argv) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Anything after -- is passed on to the server */
+		srv_argv[0] = (char *)server_path;
+		for (i = optind; i < argc; ++i)
+			srv_argv[i - optind + 1] = argv[i];
+
+		if (bench_server_start(&srv, server_path, srv_argv))
+			exit(EXIT_FAILURE);
+		free(srv_argv);
+	}
+
+	printf("%d connections in %d channels of %d, mix %s, ", num_conns,
+	       num_channels, channel_size, mix_spec);
+	if (rate)
+		printf("%" PRIu64 " ops/s\n", rate);
+	else
+		printf("unthrottled\n");
+
+	if (setup_conns()) {
+		bench_server_stop(&srv);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%8s %12s %14s %10s %10s %10s %8s\n", "secs", "sent/s",
+	       "delivered/s", "p50 us", "p99 us", "p999 us", "errors");
+
+	secs = run(rate, duration);
+	bench_server_stop(&srv);
+	if (secs < 0)
+		exit(EXIT_FAILURE);
+
+	printf("\nsent:");
+	for (i = 0; i < NUM_OPS; ++i)
+		printf(" %s %" PRIu64, op_names[i], total.sent[i]);
+	printf(", errors %" PRIu64 ", unanswered %" PRIu64 "\n", total.errors,
+	       total_outstanding);
+	for (i = 0, sent = 0; i < NUM_OPS; ++i)
+		sent += total.sent[i];
+	printf("%.0f ops/s, %.0f msgs/s delivered over %.1f s\n", sent / secs,
+	       total.delivered / secs, secs);
+	printf("delivery latency: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+	       hist_percentile(&total.latency, 50) / (double)NSEC_PER_USEC,
+	       hist_percentile(&total.latency, 99) / (double)NSEC_PER_USEC,
+	       hist_percentile(&total.latency, 99.9) / (double)NSEC_PER_USEC,
+	       total.latency.max / (double)NSEC_PER_USEC);
+
+	return total_outstanding ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -15,19 +15,41 @@
 #include <sys/types.h>
 #include "../common/epoll/epoll_helpers.h"
 #include "../common/debug/debug.h"
+#include "../common/debug/log.h"
 #include "../common/list/list.h"
+#include "../common/pool/pool.h"
 
-/* User can only request for channel list once before this list is deleted */
-static struct list_node *channel_list_head = NULL;
+/**
+ * struct name_buf - names of a LIST reply collected until the server is done
+ * @data: one name per line, the buffer is reused by the next list
+ * @len: number of valid bytes in data
+ * @size: size of data
+ */
+struct name_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/* User can only request for channel list once before this list is printed */
+static struct name_buf channel_names;
 static bool list_channels_active = false;
 
-/* User can only request for user list once before this list is deleted */
-static struct list_node *user_list_head = NULL;
+/* User can only request for user list once before this list is printed */
+static struct name_buf user_names;
 static bool list_users_active = false;
 
+/* Every frame from the server is received here */
+static uint8_t rx_frame[MSG_V2_LIST_MAX_LEN];
+
 #define MAX_EPOLL_EVENTS	10
 #define MAX_CMDLINE_INPUT	1024
 
+/* Messages and stdin buffers are recycled instead of calloc()'d every time */
+#define OBJS_PER_SLAB		16
+static struct pool msg_pool;
+static struct pool input_pool;
+
 #define MIN(a,b) (a < b ? a : b)
 
 /**
@@ -62,19 +84,126 @@ int connect_to_server(int *sockfd)
 	return 0;
 }
 
+/**
+ * send_to_server - send a message to the server as a v2 frame
+ * @sockfd: socket connected to the server
+ * @msg: message to send
+ *
+ * On success returns 0, otherwise return -1
+ */
+static int send_to_server(int sockfd, const struct message *msg)
+{
+	uint8_t buf[MSG_V2_MAX_LEN];
+	int len;
+
+	len = proto_encode(msg, buf, sizeof(buf));
+	if (len < 0) {
+		printf("Failed to encode %s\n", msg_type_to_str(msg->type));
+		return -1;
+	}
+
+	if (send(sockfd, buf, len, 0) != len) {
+		perror("Error sending message to server");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * recv_from_server - receive one v2 frame from the server
+ * @sockfd: socket connected to the server
+ * @msg: where the received message is decoded to
+ *
+ * The raw frame is left in rx_frame, packed LIST replies have their names
+ * read from there.
+ *
+ * Returns the frame's length, 0 if the server closed the connection or -1 on
+ * error
+ */
+static int recv_from_server(int sockfd, struct message *msg)
+{
+	uint8_t *buf = rx_frame;
+	uint32_t len;
+	int bytes;
+
+	bytes = recv(sockfd, buf, MSG_HDR_SIZE, MSG_WAITALL);
+	if (bytes < 0) {
+		perror("recv");
+		return -1;
+	} else if (bytes < MSG_HDR_SIZE) {
+		return CONNECTION_CLOSED;
+	}
+
+	len = proto_frame_len((struct msg_hdr *)buf);
+	if (len > sizeof(rx_frame)) {
+		printf("Frame of %u bytes from server is too large\n", len);
+		return -1;
+	}
+
+	if (len > MSG_HDR_SIZE) {
+		bytes = recv(sockfd, buf + MSG_HDR_SIZE, len - MSG_HDR_SIZE,
+			     MSG_WAITALL);
+		if (bytes < 0) {
+			perror("recv");
+			return -1;
+		} else if (bytes < len - MSG_HDR_SIZE) {
+			return CONNECTION_CLOSED;
+		}
+	}
+
+	if (proto_decode(buf, len, msg)) {
+		printf("Malformed frame from server\n");
+		return -1;
+	}
+
+	return len;
+}
+
+/**
+ * negotiate_protocol - switch the connection to protocol version 2
+ * @sockfd: socket connected to the server
+ *
+ * On success returns 0, otherwise return -1
+ */
+static int negotiate_protocol(int sockfd)
+{
+	struct message msg = {
+		.type = HELLO,
+		.hello.version = PROTO_V2,
+	};
+
+	if (send_to_server(sockfd, &msg) || recv_from_server(sockfd, &msg) <= 0)
+		return -1;
+
+	if (msg.type != HELLO || msg.response != RESP_SUCCESS ||
+	    msg.hello.version != PROTO_V2) {
+		printf("Server does not support protocol version %d\n",
+		       PROTO_V2);
+		return -1;
+	}
+
+	return 0;
+}
+
 static void print_usage()
 {
 	printf("\nAvailable Commands:\n"
-	       "\t#JOIN  /<username> /<channel_name>\n"
+	       "\t#LOGIN /<username> /<password>\n"
+	       "\t#JOIN  /<username> /<channel_name> [/<replay>]\n"
 	       "\t#LEAVE /<username> /<channel_name>\n"
 	       "\t#CHAT  /<username> /<channel_name> /<chat_message>\n"
-	       "\t#LIST_CHANNELS /<username>\n"
-	       "\t#LIST_USERS /<username> /<channel_name>"
+	       "\t#DIRECT /<username> /<dst_username> /<chat_message>\n"
+	       "\t#HISTORY /<username> /<channel_name> [/<count> [/<before_seq>]]\n"
+	       "\t#LIST_CHANNELS /<username> [/<page_size> [/<cursor>]]\n"
+	       "\t#LIST_USERS /<username> /<channel_name> [/<page_size> [/<cursor>]]\n"
+	       "\t#STATS"
 	       "\nMaximum Lengths:\n"
 	       "\tusername: %d characters\n"
+	       "\tpassword: %d characters\n"
 	       "\tchannel_name: %d characters\n"
 	       "\tchat_message: %d characters\n\n", USER_NAME_MAX_LEN-1,
-	       CHANNEL_NAME_MAX_LEN-1, CHAT_MSG_MAX_LEN-1);
+	       PW_MAX_LEN-1, CHANNEL_NAME_MAX_LEN-1, CHAT_MSG_MAX_LEN-1);
 }
 
 static void remove_whitespace(char *str)
@@ -100,17 +229,64 @@ static void remove_whitespace(char *str)
 	str[len] = '\0';
 }
 
+static struct message *login_input(char *input)
+{
+	struct message *msg;
+	char *prev, *next;
+	int len;
+
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
+		return NULL;
+
+	/* Find the start of username */
+	prev = strstr(input, "/");
+	if (!prev)
+		goto free_msg;
+	/* Don't want "/" as part of the username */
+	++prev;
+
+	/* Find the start of password */
+	next = strstr(prev, "/");
+	if (!next)
+		goto free_msg;
+
+	len = MIN(USER_NAME_MAX_LEN-1, next-prev);
+	strncpy(msg->login.username, prev, len);
+	msg->login.username[len] = '\0';
+	remove_whitespace(msg->login.username);
+
+	/* Don't want "/" as part of the password */
+	prev = ++next;
+	/* Find the end of password */
+	next = strstr(prev, "\n");
+	if (!next)
+		goto free_msg;
+
+	len = MIN(PW_MAX_LEN-1, next-prev);
+	strncpy(msg->login.password, prev, len);
+	msg->login.password[len] = '\0';
+	remove_whitespace(msg->login.password);
+
+	msg->type = LOGIN;
+
+	return msg;
+
+free_msg:
+	printf("Error parsing %s\n", __FUNCTION__);
+	pool_free(&msg_pool, msg);
+	return NULL;
+}
+
 static struct message *join_input(char *input)
 {
 	struct message *msg;
 	char *prev, *next;
 	int len;
 
-	msg = calloc(1, sizeof(*msg));
-	if (!msg) {
-		perror("calloc");
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
 		return NULL;
-	}
 
 	/* Find the start of username */
 	prev = strstr(input, "/");
@@ -132,7 +308,7 @@ static struct message *join_input(char *input)
 	/* Don't want "/" as part of the channel_name */
 	prev = ++next;
 	/* Find the end of channel_name */
-	next = strstr(prev, "\n");
+	next = strpbrk(prev, "/\n");
 	if (!next)
 		goto free_msg;
 
@@ -141,13 +317,22 @@ static struct message *join_input(char *input)
 	msg->join.channel_name[len] = '\0';
 	remove_whitespace(msg->join.channel_name);
 
+	/* Optionally how many recent messages to be sent */
+	if (*next == '/') {
+		unsigned int replay;
+
+		if (sscanf(next, "/%u", &replay) != 1 || replay > UINT16_MAX)
+			goto free_msg;
+		msg->join.replay = replay;
+	}
+
 	msg->type = JOIN;
 
 	return msg;
 
 free_msg:
 	printf("Error parsing %s\n", __FUNCTION__);
-	free(msg);
+	pool_free(&msg_pool, msg);
 	return NULL;
 }
 
@@ -157,11 +342,9 @@ static struct message *leave_input(char *input)
 	char *prev, *next;
 	int len;
 
-	msg = calloc(1, sizeof(*msg));
-	if (!msg) {
-		perror("calloc");
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
 		return NULL;
-	}
 
 	/* Find the start of username */
 	prev = strstr(input, "/");
@@ -198,7 +381,7 @@ static struct message *leave_input(char *input)
 
 free_msg:
 	printf("Error parsing %s\n", __FUNCTION__);
-	free(msg);
+	pool_free(&msg_pool, msg);
 	return NULL;
 }
 
@@ -208,11 +391,9 @@ static struct message *chat_input(char *input)
 	char *prev, *next;
 	int len;
 
-	msg = calloc(1, sizeof(*msg));
-	if (!msg) {
-		perror("calloc");
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
 		return NULL;
-	}
 
 	/* Find the start of username */
 	prev = strstr(input, "/");
@@ -259,21 +440,19 @@ static struct message *chat_input(char *input)
 
 free_msg:
 	printf("Error parsing %s\n", __FUNCTION__);
-	free(msg);
+	pool_free(&msg_pool, msg);
 	return NULL;
 }
 
-static struct message *list_channels_input(char *input)
+static struct message *direct_input(char *input)
 {
 	struct message *msg;
 	char *prev, *next;
 	int len;
 
-	msg = calloc(1, sizeof(*msg));
-	if (!msg) {
-		perror("calloc");
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
 		return NULL;
-	}
 
 	/* Find the start of username */
 	prev = strstr(input, "/");
@@ -282,14 +461,162 @@ static struct message *list_channels_input(char *input)
 	/* Don't want "/" as part of the username */
 	++prev;
 
+	/* Find the start of dst_username */
+	next = strstr(prev, "/");
+	if (!next)
+		goto free_msg;
+
+	len = MIN(USER_NAME_MAX_LEN-1, next-prev);
+	strncpy(msg->direct.src_user, prev, len);
+	msg->direct.src_user[len] = '\0';
+	remove_whitespace(msg->direct.src_user);
+
+	/* Don't want "/" as part of the dst_username */
+	prev = ++next;
+	/* Find the end of dst_username */
+	next = strstr(prev, "/");
+	if (!next)
+		goto free_msg;
+
+	len = MIN(USER_NAME_MAX_LEN-1, next-prev);
+	strncpy(msg->direct.dst_user, prev, len);
+	msg->direct.dst_user[len] = '\0';
+	remove_whitespace(msg->direct.dst_user);
+
+	/* Don't want "/" as part of the chat text */
+	prev = ++next;
 	next = strstr(prev, "\n");
 	if (!next)
 		goto free_msg;
 
+	len = MIN(CHAT_MSG_MAX_LEN-1, next-prev);
+	strncpy(msg->direct.text, prev, len);
+	msg->direct.text[len] = '\0';
+
+	msg->type = DIRECT;
+
+	return msg;
+
+free_msg:
+	printf("Error parsing %s\n", __FUNCTION__);
+	pool_free(&msg_pool, msg);
+	return NULL;
+}
+
+/**
+ * parse_page_args - parse the optional page of a LIST command
+ * @args: rest of the input after the last name
+ * @page_size: set to the page size, left alone if there are no page args
+ * @cursor: set to the cursor, 0 for the first page
+ *
+ * On success returns 0, otherwise return -1
+ */
+static int parse_page_args(char *args, uint16_t *page_size, uint32_t *cursor)
+{
+	unsigned int size, start = 0;
+
+	if (*args != '/')
+		return 0;
+
+	if (sscanf(args, "/%u /%u", &size, &start) < 1 || size > UINT16_MAX)
+		return -1;
+
+	*page_size = size;
+	*cursor = start;
+
+	return 0;
+}
+
+static struct message *history_input(char *input)
+{
+	unsigned long long before_seq = 0;
+	unsigned int count = 0;
+	struct message *msg;
+	char *prev, *next;
+	int len;
+
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
+		return NULL;
+
+	/* Find the start of username */
+	prev = strstr(input, "/");
+	if (!prev)
+		goto free_msg;
+	/* Don't want "/" as part of the username */
+	++prev;
+
+	/* Find the start of channel_name */
+	next = strstr(prev, "/");
+	if (!next)
+		goto free_msg;
+
+	len = MIN(USER_NAME_MAX_LEN-1, next-prev);
+	strncpy(msg->history.src_user, prev, len);
+	msg->history.src_user[len] = '\0';
+	remove_whitespace(msg->history.src_user);
+
+	/* Don't want "/" as part of the channel_name */
+	prev = ++next;
+	next = strpbrk(prev, "/\n");
+	if (!next)
+		goto free_msg;
+
+	len = MIN(CHANNEL_NAME_MAX_LEN-1, next-prev);
+	strncpy(msg->history.channel_name, prev, len);
+	msg->history.channel_name[len] = '\0';
+	remove_whitespace(msg->history.channel_name);
+
+	if (*next == '/' &&
+	    (sscanf(next, "/%u /%llu", &count, &before_seq) < 1 ||
+	     count > UINT16_MAX))
+		goto free_msg;
+
+	msg->history.count = count;
+	msg->history.before_seq = before_seq;
+	msg->type = HISTORY;
+
+	return msg;
+
+free_msg:
+	printf("Error parsing %s\n", __FUNCTION__);
+	pool_free(&msg_pool, msg);
+	return NULL;
+}
+
+static struct message *list_channels_input(char *input)
+{
+	uint16_t page_size = 0;
+	uint32_t cursor = 0;
+	struct message *msg;
+	char *prev, *next;
+	int len;
+
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
+		return NULL;
+
+	/* Find the start of username */
+	prev = strstr(input, "/");
+	if (!prev)
+		goto free_msg;
+	/* Don't want "/" as part of the username */
+	++prev;
+
+	next = strpbrk(prev, "/\n");
+	if (!next)
+		goto free_msg;
+
 	len = MIN(USER_NAME_MAX_LEN-1, next-prev);
 	strncpy(msg->list_channels.src_user, prev, len);
 	msg->list_channels.src_user[len] = '\0';
+	remove_whitespace(msg->list_channels.src_user);
+
+	if (parse_page_args(next, &page_size, &cursor))
+		goto free_msg;
 
+	msg->list_channels.page_size = page_size;
+	msg->list_channels.cursor = cursor;
 	msg->type = LIST_CHANNELS;
 
 	return msg;
@@ -298,21 +625,21 @@ free_msg:
 	/* Allow another request to LIST_CHANNELS */
 	list_channels_active = false;
 	printf("Error parsing %s\n", __FUNCTION__);
-	free(msg);
+	pool_free(&msg_pool, msg);
 	return NULL;
 }
 
 static struct message *list_users_input(char *input)
 {
+	uint16_t page_size = 0;
+	uint32_t cursor = 0;
 	struct message *msg;
 	char *prev, *next;
 	int len;
 
-	msg = calloc(1, sizeof(*msg));
-	if (!msg) {
-		perror("calloc");
+	msg = pool_zalloc(&msg_pool);
+	if (!msg)
 		return NULL;
-	}
 
 	/* Find the start of src_usr */
 	prev = strstr(input, "/");
@@ -331,14 +658,20 @@ static struct message *list_users_input(char *input)
 
 	/* Don't want "/" as part of the chat text */
 	prev = ++next;
-	next = strstr(prev, "\n");
+	next = strpbrk(prev, "/\n");
 	if (!next)
 		goto free_msg;
 
-	len = MIN(CHAT_MSG_MAX_LEN-1, next-prev);
+	len = MIN(CHANNEL_NAME_MAX_LEN-1, next-prev);
 	strncpy(msg->list_users.channel_name, prev, len);
 	msg->list_users.channel_name[len] = '\0';
+	remove_whitespace(msg->list_users.channel_name);
+
+	if (parse_page_args(next, &page_size, &cursor))
+		goto free_msg;
 
+	msg->list_users.page_size = page_size;
+	msg->list_users.cursor = cursor;
 	msg->type = LIST_USERS;
 
 	return msg;
@@ -347,64 +680,132 @@ free_msg:
 	/* Allow another request to LIST_CHANNELS */
 	list_users_active = false;
 	printf("Error parsing %s\n", __FUNCTION__);
-	free(msg);
+	pool_free(&msg_pool, msg);
 	return NULL;
 }
 
+static void print_pool_stats(void)
+{
+	pool_print_stats(&msg_pool);
+	pool_print_stats(&input_pool);
+}
+
 static struct message *parse_user_input()
 {
 	struct message *send_msg = NULL;
 	char *input;
 	int bytes;
 
-	input = (char *)calloc(1, MAX_CMDLINE_INPUT);
-	if (!input) {
-		perror("calloc");
+	input = pool_zalloc(&input_pool);
+	if (!input)
 		return NULL;
-	}
 
-	bytes = read(STDIN_FILENO, input, MAX_CMDLINE_INPUT);
+	/* Leave room for the terminating '\0' */
+	bytes = read(STDIN_FILENO, input, MAX_CMDLINE_INPUT - 1);
 	if (bytes < 0) {
 		perror("read from stdin");
-		free(input);
+		pool_free(&input_pool, input);
 		return NULL;
 	}
 
 	if (strcasestr(input, "help"))
 		print_usage();
+	else if (strcasestr(input, "#LOGIN"))
+		send_msg = login_input(input);
 	else if (strcasestr(input, "#JOIN"))
 		send_msg = join_input(input);
 	else if (strcasestr(input, "#LEAVE"))
 		send_msg = leave_input(input);
 	else if (strcasestr(input, "#CHAT"))
 		send_msg = chat_input(input);
+	else if (strcasestr(input, "#DIRECT"))
+		send_msg = direct_input(input);
+	else if (strcasestr(input, "#HISTORY"))
+		send_msg = history_input(input);
 	else if (strcasestr(input, "#LIST_CHANNELS") && !list_channels_active)
 		send_msg = list_channels_input(input);
 	else if (strcasestr(input, "#LIST_USERS") && !list_users_active)
 		send_msg = list_users_input(input);
+	else if (strcasestr(input, "#STATS"))
+		print_pool_stats();
 	else
 		printf("Unsupported message type");
 
-	free(input);
+	pool_free(&input_pool, input);
 
 	return send_msg;
 }
 
+/**
+ * append_names - add the names of a LIST reply to a list being collected
+ * @nb: list to add to
+ * @names: LIST_NAME_SEPARATOR separated names, not NUL terminated
+ * @len: length of names
+ *
+ * The names are split in place while copying, no per name allocation.
+ *
+ * On success returns 0, otherwise return -1
+ */
+static int append_names(struct name_buf *nb, const char *names, uint32_t len)
+{
+	uint32_t i;
+
+	if (!len)
+		return 0;
+
+	/* Room for the names and the final newline */
+	if (nb->len + len + 1 > nb->size) {
+		size_t size = nb->size ? nb->size : 4096;
+		char *data;
+
+		while (size < nb->len + len + 1)
+			size *= 2;
+
+		data = realloc(nb->data, size);
+		if (!data) {
+			perror("realloc");
+			return -1;
+		}
+
+		nb->data = data;
+		nb->size = size;
+	}
+
+	for (i = 0; i < len; ++i)
+		nb->data[nb->len++] = names[i] == LIST_NAME_SEPARATOR ?
+			'\n' : names[i];
+	nb->data[nb->len++] = '\n';
+
+	return 0;
+}
+
+/* A v1 style reply carries a single name in a fixed size field */
+static int append_name_field(struct name_buf *nb, const char *name,
+			     size_t max_len)
+{
+	return append_names(nb, name, strnlen(name, max_len));
+}
+
+static void print_names(struct name_buf *nb)
+{
+	fwrite(nb->data, 1, nb->len, stdout);
+	nb->len = 0;
+}
+
 static int handle_recv_msg(int recvfd)
 {
 	struct message *recv_msg;
+	const char *names;
+	uint32_t names_len;
 	int ret = 0;
 	int bytes;
 
-	recv_msg = (struct message *)calloc(1, sizeof(*recv_msg));
-	if (!recv_msg) {
-		perror("calloc");
+	recv_msg = pool_zalloc(&msg_pool);
+	if (!recv_msg)
 		return -1;
-	}
 
-	bytes = recv(recvfd, recv_msg, MSG_SIZE, MSG_WAITALL);
-	if (bytes < 0) {
-		perror("recv");
+	bytes = recv_from_server(recvfd, recv_msg);
+	if (bytes <= 0) {
 		ret = -1;
 		goto out;
 	}
@@ -415,17 +816,51 @@ static int handle_recv_msg(int recvfd)
 			printf("(%s) %s: %s\n", recv_msg->chat.channel_name,
 		      	       recv_msg->chat.src_user, recv_msg->chat.text);
 
+		break;
+	case HISTORY:
+		/* The CHATs themselves came ahead of this */
+		if (recv_msg->response != RESP_SUCCESS)
+			printf("Cannot get history of %s: %s\n",
+			       recv_msg->history.channel_name,
+			       resp_type_to_str(recv_msg->response));
+		else if (recv_msg->history.before_seq)
+			printf("(%u messages, older ones are before %llu)\n",
+			       recv_msg->history.count,
+			       (unsigned long long)recv_msg->history.before_seq);
+		else
+			printf("(%u messages, no older ones)\n",
+			       recv_msg->history.count);
+
+		break;
+	case DIRECT:
+		if (recv_msg->response != RESP_SUCCESS)
+			printf("Cannot message %s: %s\n",
+			       recv_msg->direct.dst_user,
+			       resp_type_to_str(recv_msg->response));
+		else
+			printf("[%s -> %s] %s\n", recv_msg->direct.src_user,
+			       recv_msg->direct.dst_user, recv_msg->direct.text);
+
 		break;
 	case LIST_CHANNELS:
 		if (recv_msg->response & RESP_LIST_CHANNELS_IN_PROGRESS) {
-			ret = add_channel(&channel_list_head,
-					  recv_msg->list_channels.channel_name);
+			names = proto_list_names(rx_frame, bytes, &names_len);
+			if (names)
+				ret = append_names(&channel_names, names,
+						   names_len);
+			else
+				ret = append_name_field(&channel_names,
+						recv_msg->list_channels.channel_name,
+						CHANNEL_NAME_MAX_LEN);
 			if (ret)
 				printf("Failed to add channel!\n");
 
 		} else if (recv_msg->response & RESP_DONE_SENDING_CHANNELS) {
-			print_channel_list(channel_list_head);
-			del_channel_list(&channel_list_head);
+			printf("Channel List:\n");
+			print_names(&channel_names);
+			if (recv_msg->list_channels.cursor)
+				printf("More channels, continue from cursor %u\n",
+				       recv_msg->list_channels.cursor);
 			/* Allow another request to LIST_CHANNELS */
 			list_channels_active = false;
 		} else {
@@ -437,14 +872,25 @@ static int handle_recv_msg(int recvfd)
 		break;
 	case LIST_USERS:
 		if (recv_msg->response & RESP_LIST_USERS_IN_PROGRESS) {
-			ret = add_user(&user_list_head,
-				       recv_msg->list_users.username);
+			names = proto_list_names(rx_frame, bytes, &names_len);
+			if (names)
+				ret = append_names(&user_names, names,
+						   names_len);
+			else
+				ret = append_name_field(&user_names,
+						recv_msg->list_users.username,
+						USER_NAME_MAX_LEN);
 			if (ret)
 				printf("Failed to add user!\n");
 
 		} else if (recv_msg->response & RESP_DONE_SENDING_USERS) {
-			print_user_list(user_list_head, recv_msg->list_users.channel_name);
-			del_user_list(&user_list_head);
+			printf("User List for channel: %.*s\n",
+			       CHANNEL_NAME_MAX_LEN,
+			       recv_msg->list_users.channel_name);
+			print_names(&user_names);
+			if (recv_msg->list_users.cursor)
+				printf("More users, continue from cursor %u\n",
+				       recv_msg->list_users.cursor);
 			/* Allow another request to LIST_CHANNELS */
 			list_users_active = false;
 		} else {
@@ -462,7 +908,7 @@ static int handle_recv_msg(int recvfd)
 	}
 
 out:
-	free(recv_msg);
+	pool_free(&msg_pool, recv_msg);
 	return ret;
 }
 
@@ -470,10 +916,22 @@ int main(int argc, char *argv[])
 {
 	int sockfd, epollfd;
 
+	if (log_init())
+		exit(EXIT_FAILURE);
+
+	if (pool_init(&msg_pool, "message", sizeof(struct message),
+		      OBJS_PER_SLAB, false) ||
+	    pool_init(&input_pool, "input", MAX_CMDLINE_INPUT, OBJS_PER_SLAB,
+		      false))
+		exit(EXIT_FAILURE);
+
 	/* No reason to continue if we can't connect to the server */
 	if (connect_to_server(&sockfd))
 		exit(EXIT_FAILURE);
 
+	if (negotiate_protocol(sockfd))
+		goto exit_fail_close_sockfd;
+
 	if (create_epoll_manager(&epollfd))
 		goto exit_fail_close_sockfd;
 
@@ -508,23 +966,20 @@ int main(int argc, char *argv[])
 				/* Read user input */
 				if (eventfd == STDIN_FILENO) {
 					struct message *send_msg;
-					int bytes;
 
 					send_msg = parse_user_input();
 					if (!send_msg ||
 					    send_msg->type == MSG_TYPE_INVALID)
 						continue;
 
-					bytes = send(sockfd, send_msg, MSG_SIZE, 0);
-					if (bytes != MSG_SIZE) {
-						perror("Error sending message to server");
+					if (send_to_server(sockfd, send_msg)) {
 						/* TODO: Decide if we should just print the error message and
 						 * 		 continue to go on about our business
 						 */
-						free(send_msg);
+						pool_free(&msg_pool, send_msg);
 						goto exit_fail_close_epollfd;
 					}
-					free(send_msg);
+					pool_free(&msg_pool, send_msg);
 
 				/* Received CHAT or server response message */
 				} else if (eventfd == sockfd) {
@@ -539,17 +994,16 @@ int main(int argc, char *argv[])
 			 */
 			case (EPOLLIN | EPOLLRDHUP):
 				if (eventfd == sockfd) {
-					struct message *recv_msg = (struct message *)
-						calloc(1, sizeof(*recv_msg));
-					if (!recv_msg) {
-						perror("calloc");
+					struct message *recv_msg = pool_zalloc(&msg_pool);
+					int bytes;
+
+					if (!recv_msg)
 						goto exit_fail_close_epollfd;
-					}
 
-					if (recv(sockfd, recv_msg, MSG_SIZE, MSG_WAITALL) == 0) {
-						free(recv_msg);
+					bytes = recv_from_server(sockfd, recv_msg);
+					pool_free(&msg_pool, recv_msg);
+					if (bytes == 0)
 						goto exit_success;
-					}
 				}
 
 				break;
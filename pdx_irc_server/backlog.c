@@ -0,0 +1,218 @@
+/**
+ * backlog.c - Recent CHAT frames of a channel, replayed to new members
+ * Author: Brett Creeley
+ */
+
+#include "backlog.h"
+#include "connection.h"
+#include "frame.h"
+#include "metrics.h"
+#include "handover.h"
+#include "../common/pool/pool.h"
+#include "../common/protocol.h"
+#include "../common/debug/log.h"
+
+#define BACKLOGS_PER_SLAB	64
+static struct pool backlog_pool;
+
+int backlog_pool_init(void)
+{
+	return pool_init(&backlog_pool, "backlog", sizeof(struct backlog),
+			 BACKLOGS_PER_SLAB, true);
+}
+
+void backlog_print_pool_stats(void)
+{
+	pool_print_stats(&backlog_pool);
+}
+
+/**
+ * backlog_alloc - get an empty backlog
+ *
+ * Returns the backlog or NULL on failure
+ */
+struct backlog *backlog_alloc(void)
+{
+	struct backlog *b;
+
+	b = pool_zalloc(&backlog_pool);
+	if (!b)
+		return NULL;
+
+	if (pthread_mutex_init(&b->lock, NULL)) {
+		pool_free(&backlog_pool, b);
+		return NULL;
+	}
+
+	return b;
+}
+
+/* Caller must hold b->lock */
+static void backlog_drop_oldest(struct backlog *b)
+{
+	struct frame_buf *frame = b->frames[b->head];
+
+	b->frames[b->head] = NULL;
+	b->head = (b->head + 1) % BACKLOG_MAX_MSGS;
+	--b->count;
+	b->bytes -= frame->len;
+
+	metrics_add(&thread_metrics->backlog_frames, -1);
+	metrics_add(&thread_metrics->backlog_bytes, -(uint64_t)frame->len);
+	frame_put(frame);
+}
+
+/**
+ * backlog_free - drop a backlog's frames and free it
+ * @b: backlog of a channel no other thread can see
+ */
+void backlog_free(struct backlog *b)
+{
+	while (b->count)
+		backlog_drop_oldest(b);
+	pthread_mutex_destroy(&b->lock);
+	pool_free(&backlog_pool, b);
+}
+
+/**
+ * backlog_add - remember a CHAT frame
+ * @b: backlog of the channel the CHAT went to
+ * @frame: v2 frame of the CHAT, the backlog takes its own reference
+ */
+void backlog_add(struct backlog *b, struct frame_buf *frame)
+{
+	uint32_t tail;
+
+	/* Too large to ever fit, can't happen with a CHAT frame */
+	if (frame->len > BACKLOG_MAX_BYTES)
+		return;
+
+	pthread_mutex_lock(&b->lock);
+	while (b->count == BACKLOG_MAX_MSGS ||
+	       b->bytes + frame->len > BACKLOG_MAX_BYTES)
+		backlog_drop_oldest(b);
+
+	tail = (b->head + b->count) % BACKLOG_MAX_MSGS;
+	b->frames[tail] = frame_get(frame);
+	++b->count;
+	b->bytes += frame->len;
+	pthread_mutex_unlock(&b->lock);
+
+	metrics_add(&thread_metrics->backlog_frames, 1);
+	metrics_add(&thread_metrics->backlog_bytes, frame->len);
+}
+
+/* v1 connections need the fixed size layout, so the frame is re-encoded */
+static int backlog_send_v1(struct connection *conn, struct frame_buf *frame)
+{
+	struct message msg;
+
+	if (proto_decode(frame->data, frame->len, &msg))
+		return -1;
+
+	return conn_send_msg(conn, &msg);
+}
+
+/**
+ * backlog_replay - send the most recent frames of a backlog to a connection
+ * @b: backlog of the channel joined
+ * @conn: connection of the new member, owned by the calling worker
+ * @max: most frames to send
+ *
+ * Frames are only queued, they go out with the rest of the connection's
+ * queue in the worker's next flush.
+ *
+ * Returns the number of frames queued
+ */
+uint32_t backlog_replay(struct backlog *b, struct connection *conn,
+			uint32_t max)
+{
+	uint32_t i, sent = 0;
+
+	pthread_mutex_lock(&b->lock);
+	i = max < b->count ? b->count - max : 0;
+	for (; i < b->count; ++i) {
+		struct frame_buf *frame;
+		int err;
+
+		frame = b->frames[(b->head + i) % BACKLOG_MAX_MSGS];
+		if (conn->proto == PROTO_V2)
+			err = conn_queue(conn, frame);
+		else
+			err = backlog_send_v1(conn, frame);
+		if (err) {
+			log_warn("Failed to replay backlog to fd %d\n",
+				 conn->fd);
+			break;
+		}
+		++sent;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	metrics_add(&thread_metrics->backlog_replayed, sent);
+
+	return sent;
+}
+
+/**
+ * backlog_usage - how much of a backlog is in use
+ * @b: backlog of a channel
+ * @frames: set to the number of frames held
+ * @bytes: set to the bytes of those frames
+ */
+void backlog_usage(struct backlog *b, uint32_t *frames, uint32_t *bytes)
+{
+	pthread_mutex_lock(&b->lock);
+	*frames = b->count;
+	*bytes = b->bytes;
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * backlog_handover_save - serialize a backlog for the server taking over
+ * @h: handover being written, every worker is parked
+ * @b: backlog to serialize
+ */
+void backlog_handover_save(struct handover *h, struct backlog *b)
+{
+	uint32_t i;
+
+	handover_put_u32(h, b->count);
+	for (i = 0; i < b->count; ++i) {
+		struct frame_buf *frame;
+
+		frame = b->frames[(b->head + i) % BACKLOG_MAX_MSGS];
+		handover_put_u32(h, frame->len);
+		handover_put(h, frame->data, frame->len);
+	}
+}
+
+/**
+ * backlog_handover_restore - refill a backlog from the server handing over
+ * @h: handover being read
+ * @b: empty backlog of the channel the frames were remembered for
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int backlog_handover_restore(struct handover *h, struct backlog *b)
+{
+	uint32_t i, count = handover_get_u32(h);
+
+	for (i = 0; i < count && !h->err; ++i) {
+		uint32_t len = handover_get_u32(h);
+		struct frame_buf *frame;
+
+		if (len > BACKLOG_MAX_BYTES)
+			return -1;
+
+		frame = frame_alloc(len);
+		if (!frame)
+			return -1;
+
+		handover_get(h, frame->data, len);
+		backlog_add(b, frame);
+		frame_put(frame);
+	}
+
+	return h->err;
+}
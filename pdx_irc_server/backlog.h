@@ -0,0 +1,50 @@
+/**
+ * backlog.h - Recent CHAT frames of a channel, replayed to new members
+ * Author: Brett Creeley
+ *
+ * Note: A backlog only holds references to the v2 frames that were already
+ *	 built for the CHAT's fan-out, so remembering a message costs no copy.
+ *	 It is bounded both by number of frames and by their bytes, the oldest
+ *	 frames are dropped to make room.
+ */
+#ifndef _BACKLOG_H
+#define _BACKLOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define BACKLOG_MAX_MSGS	32
+#define BACKLOG_MAX_BYTES	(8 * 1024)
+
+struct frame_buf;
+struct connection;
+struct handover;
+
+/**
+ * struct backlog - ring of a channel's most recent CHAT frames
+ * @lock: serializes CHATs of the channel being handled by different workers
+ * @head: index of the oldest frame
+ * @count: number of frames held
+ * @bytes: sum of the lengths of the frames held
+ * @frames: the frames, oldest at head
+ */
+struct backlog {
+	pthread_mutex_t lock;
+	uint32_t head;
+	uint32_t count;
+	uint32_t bytes;
+	struct frame_buf *frames[BACKLOG_MAX_MSGS];
+};
+
+int backlog_pool_init(void);
+void backlog_print_pool_stats(void);
+struct backlog *backlog_alloc(void);
+void backlog_free(struct backlog *b);
+void backlog_add(struct backlog *b, struct frame_buf *frame);
+uint32_t backlog_replay(struct backlog *b, struct connection *conn,
+			uint32_t max);
+void backlog_usage(struct backlog *b, uint32_t *frames, uint32_t *bytes);
+void backlog_handover_save(struct handover *h, struct backlog *b);
+int backlog_handover_restore(struct handover *h, struct backlog *b);
+
+#endif /* _BACKLOG_H */
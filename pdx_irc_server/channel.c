@@ -0,0 +1,98 @@
+/**
+ * channel.c - Channels of the pdx irc server and their members
+ * Author: Brett Creeley
+ */
+
+#include "channel.h"
+#include "backlog.h"
+#include "history.h"
+#include "../common/pool/pool.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHANNELS_PER_SLAB	64
+#define MEMBERS_PER_SLAB	256
+
+static struct pool channel_pool;
+static struct pool member_pool;
+
+int channel_pools_init(void)
+{
+	if (pool_init(&channel_pool, "irc_channel", sizeof(struct irc_channel),
+		      CHANNELS_PER_SLAB, true))
+		return -1;
+
+	return pool_init(&member_pool, "member", sizeof(struct member),
+			 MEMBERS_PER_SLAB, true);
+}
+
+void channel_print_pool_stats(void)
+{
+	pool_print_stats(&channel_pool);
+	pool_print_stats(&member_pool);
+}
+
+/**
+ * channel_alloc - get a channel without members
+ * @name: name of the channel, at most CHANNEL_NAME_MAX_LEN bytes
+ *
+ * The channel gets its backlog and, if history is on, its history.
+ *
+ * Returns the channel or NULL on failure
+ */
+struct irc_channel *channel_alloc(const char *name)
+{
+	struct irc_channel *c;
+
+	c = pool_zalloc(&channel_pool);
+	if (!c)
+		return NULL;
+
+	strncpy(c->chan.name, name, CHANNEL_NAME_MAX_LEN);
+	if (hash_table_init(&c->user_table, offsetof(struct member, user.fd),
+			    sizeof(int)))
+		goto err_free;
+
+	c->backlog = backlog_alloc();
+	if (!c->backlog)
+		goto err_destroy_users;
+
+	/* Without history if it can't be opened, the channel still works */
+	c->history = history_open(name);
+
+	return c;
+
+err_destroy_users:
+	hash_table_destroy(&c->user_table);
+err_free:
+	pool_free(&channel_pool, c);
+	return NULL;
+}
+
+/**
+ * channel_free - free a channel and everything it owns
+ * @c: channel no other thread can see
+ */
+void channel_free(struct irc_channel *c)
+{
+	int i;
+
+	for (i = 0; i < c->num_users; ++i)
+		member_free(c->users[i]);
+	free(c->users);
+	hash_table_destroy(&c->user_table);
+	backlog_free(c->backlog);
+	history_close(c->history);
+	pool_free(&channel_pool, c);
+}
+
+struct member *member_alloc(void)
+{
+	return pool_zalloc(&member_pool);
+}
+
+void member_free(struct member *m)
+{
+	pool_free(&member_pool, m);
+}
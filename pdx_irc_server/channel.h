@@ -0,0 +1,68 @@
+/**
+ * channel.h - Channels of the pdx irc server and their members
+ * Author: Brett Creeley
+ *
+ * Note: The struct channel and struct user of common/list only have what any
+ *	 program needs, a list link and a name or socket. The server embeds
+ *	 them as the first member of its own structs, which add the member
+ *	 array, backlog and history nobody else has a use for.
+ */
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include "../common/list/list.h"
+#include "../common/hash/hash_table.h"
+
+struct identity;
+struct backlog;
+struct history_log;
+struct irc_channel;
+
+/**
+ * struct member - membership of a connection in a channel
+ * @user: generic part, user.fd is the socket of the member's connection
+ * @ident: interned identity of the member, names it
+ * @idx: index of this member in its channel's users array
+ * @channel: channel this is a member of
+ * @next_joined: next channel membership of the same connection
+ * @prev_joined: previous channel membership of the same connection
+ */
+struct member {
+	struct user user;
+	const struct identity *ident;
+	int idx;
+	struct irc_channel *channel;
+	struct member *next_joined;
+	struct member *prev_joined;
+};
+
+/**
+ * struct irc_channel - a channel of the server and its members
+ * @chan: generic part, chan.name is the zero padded channel name
+ * @id: position in the server's channel array, never reused
+ * @num_users: number of members in users
+ * @users_size: number of entries allocated for users
+ * @users: dense array of members, fast to iterate for CHAT fan-out
+ * @user_table: the same members indexed by fd for O(1) lookup and removal
+ * @backlog: recent CHATs, replayed on JOIN
+ * @history: durable log of the channel's CHATs, NULL if history is off
+ */
+struct irc_channel {
+	struct channel chan;
+	uint32_t id;
+	int num_users;
+	int users_size;
+	struct member **users;
+	struct hash_table user_table;
+	struct backlog *backlog;
+	struct history_log *history;
+};
+
+int channel_pools_init(void);
+void channel_print_pool_stats(void);
+struct irc_channel *channel_alloc(const char *name);
+void channel_free(struct irc_channel *c);
+struct member *member_alloc(void);
+void member_free(struct member *m);
+
+#endif /* _CHANNEL_H */
@@ -0,0 +1,937 @@
+/**
+ * connection.c - Per client connection state for the pdx irc server
+ * Author: Brett Creeley
+ */
+
+#include "connection.h"
+#include "metrics.h"
+#include "handover.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include "../common/epoll/epoll_helpers.h"
+#include "../common/uring/uring_helpers.h"
+#include "../common/pool/pool.h"
+#include "../common/debug/log.h"
+
+/* Connections indexed by fd, sized to the process' fd limit. A slot is only
+ * ever written by the worker that owns the fd.
+ */
+static struct connection **conn_table = NULL;
+static int conn_table_size = 0;
+
+/* Receive buffers and send queue blocks are recycled between connections */
+#define IO_BUFS_PER_SLAB	64
+static struct pool rx_buf_pool;
+static struct pool tx_block_pool;
+static struct pool tx_req_pool;
+
+/* Each worker's event loop and the connections it owns that had frames
+ * queued since its last conn_flush_dirty(). Tracked by fd so a connection
+ * closed in the meantime is simply skipped.
+ */
+static __thread struct conn_loop *worker_loop;
+static __thread int *dirty_fds;
+static __thread uint32_t num_dirty;
+static __thread uint32_t dirty_size;
+
+/**
+ * conn_table_init - allocate the fd indexed connection table and I/O pools
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int conn_table_init(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim)) {
+		perror("getrlimit");
+		return -1;
+	}
+
+	conn_table_size = rlim.rlim_cur;
+	conn_table = calloc(conn_table_size, sizeof(*conn_table));
+	if (!conn_table) {
+		perror("calloc");
+		return -1;
+	}
+
+	if (pool_init(&rx_buf_pool, "rx_buf", CONN_RX_BUF_SIZE,
+		      IO_BUFS_PER_SLAB, true))
+		return -1;
+
+	if (pool_init(&tx_block_pool, "tx_block", sizeof(struct tx_block),
+		      IO_BUFS_PER_SLAB, true))
+		return -1;
+
+	if (pool_init(&tx_req_pool, "tx_req", sizeof(struct tx_req),
+		      IO_BUFS_PER_SLAB, true))
+		return -1;
+
+	return frame_pools_init();
+}
+
+void conn_print_pool_stats(void)
+{
+	pool_print_stats(&rx_buf_pool);
+	pool_print_stats(&tx_block_pool);
+	pool_print_stats(&tx_req_pool);
+	frame_print_pool_stats();
+}
+
+/**
+ * conn_loop_init - set up a worker's event loop
+ * @loop: loop to initialize
+ * @epollfd: the worker's epoll instance or -1 for an io_uring worker
+ * @ring: the worker's io_uring or NULL for an epoll worker
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int conn_loop_init(struct conn_loop *loop, int epollfd, struct uring *ring)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->epollfd = epollfd;
+	loop->ring = ring;
+	pthread_mutex_init(&loop->kick_lock, NULL);
+
+	loop->kickfd = eventfd(0, EFD_CLOEXEC | (ring ? 0 : EFD_NONBLOCK));
+	if (loop->kickfd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * conn_loop_take_kicked - take every connection kicked since the last call
+ * @loop: the calling worker's loop
+ * @fds: set to the kicked fds, valid until the next call
+ *
+ * Returns the number of fds
+ */
+uint32_t conn_loop_take_kicked(struct conn_loop *loop, int **fds)
+{
+	uint32_t num, size;
+	int *taken;
+
+	pthread_mutex_lock(&loop->kick_lock);
+	taken = loop->kicked_fds;
+	size = loop->kicked_size;
+	num = loop->num_kicked;
+	loop->kicked_fds = loop->taken_fds;
+	loop->kicked_size = loop->taken_size;
+	loop->num_kicked = 0;
+	pthread_mutex_unlock(&loop->kick_lock);
+
+	loop->taken_fds = taken;
+	loop->taken_size = size;
+	*fds = taken;
+
+	return num;
+}
+
+/**
+ * conn_worker_init - register the calling thread as a worker
+ * @loop: the worker's event loop, connections with the same loop are owned by
+ *	  this worker
+ */
+void conn_worker_init(struct conn_loop *loop)
+{
+	worker_loop = loop;
+}
+
+struct connection *conn_create(int fd, struct conn_loop *loop,
+			       uint32_t epoll_flags)
+{
+	struct connection *conn;
+
+	if (fd < 0 || fd >= conn_table_size) {
+		printf("[%s:%d] fd %d out of range\n", __func__, __LINE__, fd);
+		return NULL;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		perror("calloc");
+		return NULL;
+	}
+
+	conn->rx_buf = pool_alloc(&rx_buf_pool);
+	if (!conn->rx_buf) {
+		free(conn);
+		return NULL;
+	}
+
+	conn->fd = fd;
+	conn->loop = loop;
+	conn->epoll_flags = epoll_flags;
+	conn->rx_state = RX_STATE_TYPE;
+	pthread_mutex_init(&conn->tx_lock, NULL);
+	conn_table[fd] = conn;
+
+	return conn;
+}
+
+struct connection *conn_lookup(int fd)
+{
+	if (fd < 0 || fd >= conn_table_size)
+		return NULL;
+
+	return conn_table[fd];
+}
+
+/**
+ * conn_next - iterate over every connection
+ * @iter: iteration cursor, must be 0 for the first call
+ *
+ * Only safe while no worker can create or destroy a connection.
+ *
+ * Returns the next connection or NULL once every one has been visited
+ */
+struct connection *conn_next(int *iter)
+{
+	while (*iter < conn_table_size) {
+		struct connection *conn = conn_table[(*iter)++];
+
+		if (conn)
+			return conn;
+	}
+
+	return NULL;
+}
+
+/**
+ * conn_destroy - free the connection state
+ * @conn: connection to destroy
+ *
+ * Note: This does not close conn->fd. The caller must close it after this
+ * returns so the fd can't be reused while its table slot is still taken.
+ */
+void conn_destroy(struct connection *conn)
+{
+	struct tx_block *block;
+
+	if (!conn)
+		return;
+
+	conn_table[conn->fd] = NULL;
+	while ((block = conn->tx_head) != NULL) {
+		uint32_t i;
+
+		for (i = block->head; i < block->tail; ++i)
+			frame_put(block->frames[i]);
+		conn->tx_head = block->next;
+		pool_free(&tx_block_pool, block);
+	}
+	pthread_mutex_destroy(&conn->tx_lock);
+	if (conn->tx_req)
+		pool_free(&tx_req_pool, conn->tx_req);
+	pool_free(&rx_buf_pool, conn->rx_buf);
+	free(conn);
+}
+
+/* Move the bytes of a partially received frame to the front of the buffer */
+static void conn_rx_compact(struct connection *conn)
+{
+	if (!conn->rx_start)
+		return;
+
+	conn->rx_len -= conn->rx_start;
+	memmove(conn->rx_buf, conn->rx_buf + conn->rx_start, conn->rx_len);
+	conn->rx_start = 0;
+}
+
+/**
+ * conn_recv - read whatever the socket has into the receive buffer
+ * @conn: connection to read from
+ *
+ * Bytes of a partially received frame are moved to the front of the buffer
+ * first, so any frame returned by conn_next_msg() before this call is no
+ * longer valid after it.
+ *
+ * Returns the number of bytes read, 0 if the peer closed the connection,
+ * -EAGAIN if there was nothing to read and -1 on error.
+ */
+int conn_recv(struct connection *conn)
+{
+	ssize_t bytes;
+
+	conn_rx_compact(conn);
+
+	/* Can only happen if a single frame is larger than the buffer */
+	if (conn->rx_len == CONN_RX_BUF_SIZE) {
+		log_err("fd %d receive buffer full\n", conn->fd);
+		return -1;
+	}
+
+	bytes = recv(conn->fd, conn->rx_buf + conn->rx_len,
+		     CONN_RX_BUF_SIZE - conn->rx_len, 0);
+	if (bytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -EAGAIN;
+		log_err("fd %d recv: %m\n", conn->fd);
+		return -1;
+	}
+
+	conn->rx_len += bytes;
+
+	return bytes;
+}
+
+/**
+ * conn_rx_push - append bytes the io_uring backend received
+ * @conn: connection the bytes were received on
+ * @data: received bytes
+ * @len: number of received bytes
+ *
+ * Same as conn_recv() for bytes that already left the socket. Any frame
+ * returned by conn_next_msg() before this call is no longer valid after it.
+ *
+ * Returns the number of bytes taken, fewer than len once the buffer is full
+ * and 0 only if a single frame is larger than the buffer.
+ */
+uint32_t conn_rx_push(struct connection *conn, const uint8_t *data,
+		      uint32_t len)
+{
+	uint32_t room;
+
+	conn_rx_compact(conn);
+
+	room = CONN_RX_BUF_SIZE - conn->rx_len;
+	if (len > room)
+		len = room;
+
+	memcpy(conn->rx_buf + conn->rx_len, data, len);
+	conn->rx_len += len;
+
+	return len;
+}
+
+/**
+ * conn_next_msg - decode the next complete frame in the receive buffer
+ * @conn: connection to decode from
+ *
+ * The first byte a client sends picks the protocol version. Either way the
+ * message is decoded into conn->rx_msg and is only valid until the next call
+ * to conn_next_msg(). A v1 frame is copied rather than used in place, it is
+ * shorter than struct message.
+ *
+ * Returns the next message or NULL if no complete frame is buffered. After a
+ * malformed frame rx_state is RX_STATE_INVALID and NULL is always returned.
+ */
+struct message *conn_next_msg(struct connection *conn)
+{
+	uint32_t avail;
+	uint8_t *frame;
+
+	while (1) {
+		avail = conn->rx_len - conn->rx_start;
+		frame = conn->rx_buf + conn->rx_start;
+
+		switch (conn->rx_state) {
+		case RX_STATE_TYPE:
+			if (avail < 1)
+				return NULL;
+
+			if (!conn->proto)
+				conn->proto = frame[0] == HELLO ?
+					PROTO_V2 : PROTO_V1;
+
+			if (conn->proto == PROTO_V1) {
+				conn->rx_frame_len = MSG_SIZE;
+			} else {
+				if (avail < MSG_HDR_SIZE)
+					return NULL;
+
+				conn->rx_frame_len =
+					proto_frame_len((struct msg_hdr *)frame);
+				if (conn->rx_frame_len > MSG_V2_MAX_LEN) {
+					log_warn("fd %d frame of %u bytes is too large\n",
+						 conn->fd, conn->rx_frame_len);
+					conn->rx_state = RX_STATE_INVALID;
+					return NULL;
+				}
+			}
+
+			conn->rx_state = RX_STATE_BODY;
+			break;
+		case RX_STATE_BODY:
+			if (avail < conn->rx_frame_len)
+				return NULL;
+
+			conn->rx_start += conn->rx_frame_len;
+			conn->rx_state = RX_STATE_TYPE;
+			if (conn->proto == PROTO_V1) {
+				memcpy(&conn->rx_msg, frame, MSG_SIZE);
+				conn->rx_msg.chat_channel_id = CHANNEL_ID_NONE;
+				return &conn->rx_msg;
+			}
+
+			if (proto_decode(frame, conn->rx_frame_len,
+					 &conn->rx_msg)) {
+				log_warn("fd %d malformed frame\n", conn->fd);
+				conn->rx_state = RX_STATE_INVALID;
+				return NULL;
+			}
+
+			return &conn->rx_msg;
+		case RX_STATE_INVALID:
+			return NULL;
+		}
+	}
+}
+
+/* Called with tx_lock held */
+static void conn_mod_epoll(struct connection *conn, bool want_out)
+{
+	uint32_t events = want_out ? SOCKET_EPOLL_WANT_OUT :
+		SOCKET_EPOLL_NEW_MEMBER;
+
+	if (mod_epoll_member(conn->loop->epollfd, conn->fd,
+			     events | conn->epoll_flags))
+		return;
+
+	conn->tx_want_out = want_out;
+}
+
+/**
+ * conn_kick - ask the worker owning a connection to flush or close it
+ * @conn: connection to flush, called with its tx_lock held
+ *
+ * The owner finds the connection with conn_loop_take_kicked() after kickfd
+ * wakes it up. Only the first kick wakes the owner, until it takes them.
+ */
+static void conn_kick(struct connection *conn)
+{
+	struct conn_loop *loop = conn->loop;
+	uint64_t one = 1;
+	bool wake;
+
+	pthread_mutex_lock(&loop->kick_lock);
+	if (loop->num_kicked == loop->kicked_size) {
+		uint32_t size = loop->kicked_size ? loop->kicked_size * 2 : 64;
+		int *fds;
+
+		fds = realloc(loop->kicked_fds, size * sizeof(*fds));
+		if (!fds) {
+			perror("realloc");
+			pthread_mutex_unlock(&loop->kick_lock);
+			return;
+		}
+
+		loop->kicked_fds = fds;
+		loop->kicked_size = size;
+	}
+
+	wake = !loop->num_kicked;
+	loop->kicked_fds[loop->num_kicked++] = conn->fd;
+	pthread_mutex_unlock(&loop->kick_lock);
+
+	if (wake && write(loop->kickfd, &one, sizeof(one)) != sizeof(one))
+		perror("write");
+}
+
+/* Called with tx_lock held */
+static void conn_set_want_out(struct connection *conn, bool want_out)
+{
+	if (conn->tx_want_out == want_out)
+		return;
+
+	/* Completions drive an io_uring worker, only a kick needs doing */
+	if (conn->loop->ring) {
+		if (want_out)
+			conn_kick(conn);
+		conn->tx_want_out = want_out;
+		return;
+	}
+
+	conn_mod_epoll(conn, want_out);
+}
+
+/* Remember an owned connection so conn_flush_dirty() sends its queue */
+static void conn_mark_dirty(struct connection *conn)
+{
+	if (conn->tx_dirty)
+		return;
+
+	if (num_dirty == dirty_size) {
+		uint32_t size = dirty_size ? dirty_size * 2 : 64;
+		int *fds;
+
+		fds = realloc(dirty_fds, size * sizeof(*fds));
+		if (!fds) {
+			/* Fall back to flushing on EPOLLOUT */
+			perror("realloc");
+			conn_set_want_out(conn, true);
+			return;
+		}
+
+		dirty_fds = fds;
+		dirty_size = size;
+	}
+
+	dirty_fds[num_dirty++] = conn->fd;
+	conn->tx_dirty = true;
+}
+
+/**
+ * conn_queue - queue a reference to a frame on a connection
+ * @conn: connection to send to, may be owned by another worker
+ * @frame: frame to send, the caller keeps its own reference
+ *
+ * Nothing is sent here. Connections owned by the calling worker are flushed
+ * by its next conn_flush_dirty(), all queued frames with a single call into
+ * the kernel. For connections owned by another worker EPOLLOUT is armed so
+ * the owner flushes them. If the queue limit is hit the connection is
+ * flagged and its owner kicked to close it, EPOLLOUT never comes for a peer
+ * that stopped reading.
+ *
+ * Returns 0 if the frame was queued, otherwise -1
+ */
+int conn_queue(struct connection *conn, struct frame_buf *frame)
+{
+	struct tx_block *block;
+	int ret = 0;
+
+	if (!conn || !frame)
+		return -1;
+
+	pthread_mutex_lock(&conn->tx_lock);
+	if (conn->tx_failed) {
+		ret = -1;
+		goto unlock;
+	}
+
+	if (conn->tx_bytes + frame->len > CONN_TX_MAX_BYTES) {
+		log_warn("fd %d send queue full, disconnecting\n", conn->fd);
+		goto fail;
+	}
+
+	block = conn->tx_tail;
+	if (!block || block->tail == TX_BLOCK_FRAMES) {
+		block = pool_alloc(&tx_block_pool);
+		if (!block)
+			goto fail;
+
+		block->next = NULL;
+		block->head = 0;
+		block->tail = 0;
+		if (conn->tx_tail)
+			conn->tx_tail->next = block;
+		else
+			conn->tx_head = block;
+		conn->tx_tail = block;
+	}
+
+	block->frames[block->tail++] = frame_get(frame);
+	conn->tx_bytes += frame->len;
+
+	if (conn->loop == worker_loop)
+		conn_mark_dirty(conn);
+	else
+		conn_set_want_out(conn, true);
+
+	goto unlock;
+
+fail:
+	conn->tx_failed = true;
+	ret = -1;
+	conn_kick(conn);
+
+unlock:
+	pthread_mutex_unlock(&conn->tx_lock);
+
+	return ret;
+}
+
+/**
+ * conn_send_msg - encode a message for a connection's protocol and queue it
+ * @conn: connection to send to
+ * @msg: message to send
+ *
+ * Returns 0 if the message was queued, otherwise -1
+ */
+int conn_send_msg(struct connection *conn, const struct message *msg)
+{
+	struct frame_buf *frame;
+	int ret;
+
+	if (!conn)
+		return -1;
+
+	frame = frame_from_msg(msg, conn->proto);
+	if (!frame)
+		return -1;
+
+	ret = conn_queue(conn, frame);
+	frame_put(frame);
+
+	return ret;
+}
+
+/**
+ * conn_tx_space - number of bytes that can still be queued to a connection
+ * @conn: connection to check
+ */
+uint32_t conn_tx_space(struct connection *conn)
+{
+	uint32_t space;
+
+	pthread_mutex_lock(&conn->tx_lock);
+	space = conn->tx_failed ? 0 : CONN_TX_MAX_BYTES - conn->tx_bytes;
+	pthread_mutex_unlock(&conn->tx_lock);
+
+	return space;
+}
+
+/**
+ * conn_tx_failed - check whether a connection has to be closed
+ * @conn: connection to check
+ *
+ * Once its queue limit was hit or a send failed nothing more is sent to the
+ * connection, so its owner shouldn't handle anything it receives either.
+ */
+bool conn_tx_failed(struct connection *conn)
+{
+	bool failed;
+
+	pthread_mutex_lock(&conn->tx_lock);
+	failed = conn->tx_failed;
+	pthread_mutex_unlock(&conn->tx_lock);
+
+	return failed;
+}
+
+/**
+ * conn_set_more - note whether the owner has more to queue
+ * @conn: connection owned by the calling worker
+ * @more: true to get EPOLLOUT as soon as the connection is writable
+ *
+ * Lets the owner produce a large response in steps, each one continuing on the
+ * next EPOLLOUT instead of queueing everything at once. An io_uring worker
+ * continues whenever one of the connection's sends completes instead.
+ */
+void conn_set_more(struct connection *conn, bool more)
+{
+	pthread_mutex_lock(&conn->tx_lock);
+	conn->tx_more = more;
+	/* Always rearm, an edge triggered fd that stayed writable would
+	 * otherwise never report EPOLLOUT again.
+	 */
+	if (more && !conn->loop->ring)
+		conn_mod_epoll(conn, true);
+	pthread_mutex_unlock(&conn->tx_lock);
+}
+
+/* Drop the first sent bytes of the queue, called with tx_lock held */
+static void conn_tx_consume(struct connection *conn, size_t sent)
+{
+	while (sent) {
+		struct tx_block *block = conn->tx_head;
+		struct frame_buf *frame = block->frames[block->head];
+		uint32_t left = frame->len - conn->tx_head_off;
+
+		if (sent < left) {
+			conn->tx_head_off += sent;
+			conn->tx_bytes -= sent;
+			return;
+		}
+
+		sent -= left;
+		conn->tx_bytes -= left;
+		conn->tx_head_off = 0;
+		frame_put(frame);
+
+		if (++block->head < block->tail)
+			continue;
+
+		/* Block is empty, keep the last one around for reuse */
+		if (block == conn->tx_tail) {
+			block->head = 0;
+			block->tail = 0;
+		} else {
+			conn->tx_head = block->next;
+			pool_free(&tx_block_pool, block);
+		}
+	}
+}
+
+/* Fill iov with the oldest queued frames, called with tx_lock held */
+static size_t conn_tx_iov(struct connection *conn, struct iovec *iov,
+			  size_t *bytes)
+{
+	uint32_t off = conn->tx_head_off;
+	struct tx_block *block;
+	size_t n = 0;
+
+	*bytes = 0;
+	for (block = conn->tx_head; block; block = block->next) {
+		uint32_t i;
+
+		for (i = block->head; i < block->tail; ++i) {
+			struct frame_buf *frame = block->frames[i];
+
+			if (n == CONN_TX_IOV_MAX)
+				return n;
+
+			iov[n].iov_base = (void *)(frame_bytes(frame) + off);
+			iov[n].iov_len = frame->len - off;
+			*bytes += iov[n].iov_len;
+			++n;
+			off = 0;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * conn_submit_send - prepare an io_uring send of the queued frames
+ * @conn: connection owned by the calling io_uring worker, tx_lock held
+ *
+ * The send is only submitted with everything else prepared during the current
+ * event loop iteration. The frames stay queued until conn_send_done(), so at
+ * most one send per connection is in flight.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int conn_submit_send(struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+	size_t bytes;
+
+	conn->tx_want_out = false;
+	if (conn->tx_inflight || !conn->tx_bytes)
+		return 0;
+
+	if (!conn->tx_req) {
+		conn->tx_req = pool_zalloc(&tx_req_pool);
+		if (!conn->tx_req)
+			return -1;
+		conn->tx_req->msg.msg_iov = conn->tx_req->iov;
+	}
+
+	sqe = uring_get_sqe(conn->loop->ring);
+	if (!sqe)
+		return -1;
+
+	conn->tx_req->msg.msg_iovlen = conn_tx_iov(conn, conn->tx_req->iov,
+						   &bytes);
+	uring_prep_sendmsg(sqe, conn->fd, &conn->tx_req->msg, MSG_NOSIGNAL,
+			   URING_DATA(CONN_OP_SEND, conn->fd));
+	conn->tx_inflight = true;
+	++conn->io_pending;
+
+	return 0;
+}
+
+/**
+ * conn_send_done - account for a completed io_uring send
+ * @conn: connection owned by the calling io_uring worker
+ * @res: result of the send
+ *
+ * Frames that went out are dropped from the queue. Anything still queued is
+ * sent by the worker's next conn_flush_dirty().
+ *
+ * Returns 0 on success or -1 if the connection needs to be closed
+ */
+int conn_send_done(struct connection *conn, int res)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&conn->tx_lock);
+	conn->tx_inflight = false;
+	--conn->io_pending;
+	if (res < 0) {
+		if (!conn->closing) {
+			errno = -res;
+			log_err("fd %d send failed: %m\n", conn->fd);
+		}
+		conn->tx_failed = true;
+		ret = -1;
+	} else {
+		metrics_add(&thread_metrics->bytes_out, res);
+		conn_tx_consume(conn, res);
+		if (conn->tx_bytes)
+			conn_mark_dirty(conn);
+	}
+	pthread_mutex_unlock(&conn->tx_lock);
+
+	return ret;
+}
+
+/**
+ * conn_flush - hand the queued frames to the kernel
+ * @conn: connection owned by the calling worker
+ *
+ * Up to CONN_TX_IOV_MAX frames go out with each sendmsg() (a writev() that
+ * can take MSG_NOSIGNAL), repeated until the queue is empty or the socket
+ * stops taking everything. Stopping any earlier would lose the wakeup of an
+ * edge triggered fd. Whatever the socket doesn't take stays queued and
+ * EPOLLOUT stays armed until the queue is empty. An io_uring worker only
+ * prepares a send, see conn_submit_send().
+ *
+ * Returns 0 on success or -1 if the connection needs to be closed
+ */
+int conn_flush(struct connection *conn)
+{
+	struct iovec iov[CONN_TX_IOV_MAX];
+	struct msghdr msg = { 0 };
+	int ret = 0;
+
+	if (!conn)
+		return -1;
+
+	pthread_mutex_lock(&conn->tx_lock);
+	if (conn->tx_failed || conn->closing) {
+		ret = -1;
+		goto unlock;
+	}
+
+	if (conn->loop->ring) {
+		ret = conn_submit_send(conn);
+		goto unlock;
+	}
+
+	msg.msg_iov = iov;
+	while (conn->tx_bytes) {
+		size_t bytes;
+		ssize_t sent;
+
+		msg.msg_iovlen = conn_tx_iov(conn, iov, &bytes);
+		sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			log_err("fd %d sendmsg: %m\n", conn->fd);
+			conn->tx_failed = true;
+			ret = -1;
+			goto unlock;
+		}
+
+		metrics_add(&thread_metrics->bytes_out, sent);
+		conn_tx_consume(conn, sent);
+		if (sent < bytes)
+			break;
+	}
+
+	conn_set_want_out(conn, conn->tx_bytes != 0 || conn->tx_more);
+
+unlock:
+	pthread_mutex_unlock(&conn->tx_lock);
+
+	return ret;
+}
+
+/**
+ * conn_flush_dirty - flush every connection this worker queued frames to
+ *
+ * Called once per event loop iteration, so however many frames were queued to
+ * a connection while handling the iteration's events they go out together.
+ */
+void conn_flush_dirty(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_dirty; ++i) {
+		struct connection *conn = conn_lookup(dirty_fds[i]);
+
+		if (!conn || !conn->tx_dirty || conn->loop != worker_loop)
+			continue;
+
+		conn->tx_dirty = false;
+		/* Closed once the caller takes its kicked connections */
+		if (conn_flush(conn)) {
+			pthread_mutex_lock(&conn->tx_lock);
+			conn_kick(conn);
+			pthread_mutex_unlock(&conn->tx_lock);
+		}
+	}
+
+	num_dirty = 0;
+}
+
+/**
+ * conn_handover_save - serialize what a connection has in flight
+ * @h: handover being written, every worker is parked
+ * @conn: connection to serialize
+ *
+ * Whatever is left of a partially received frame and every byte still queued
+ * to be sent, a frame already partially sent only with its remaining bytes.
+ */
+void conn_handover_save(struct handover *h, struct connection *conn)
+{
+	struct tx_block *block;
+	uint32_t i, num = 0, off;
+
+	handover_put_u32(h, conn->proto);
+	handover_put_u32(h, conn->rx_len - conn->rx_start);
+	handover_put(h, conn->rx_buf + conn->rx_start,
+		     conn->rx_len - conn->rx_start);
+
+	for (block = conn->tx_head; block; block = block->next)
+		num += block->tail - block->head;
+	handover_put_u32(h, num);
+
+	off = conn->tx_head_off;
+	for (block = conn->tx_head; block; block = block->next) {
+		for (i = block->head; i < block->tail; ++i) {
+			struct frame_buf *frame = block->frames[i];
+
+			handover_put_u32(h, frame->len - off);
+			handover_put(h, frame_bytes(frame) + off,
+				     frame->len - off);
+			off = 0;
+		}
+	}
+}
+
+/**
+ * conn_handover_restore - resume a connection of the server handing over
+ * @h: handover being read
+ * @conn: connection just created for the passed socket, already added to the
+ *	  epoll instance of the worker that will own it
+ *
+ * The received bytes are decoded once the rest of their frame arrives, the
+ * queued ones are sent by the owner as soon as it starts.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int conn_handover_restore(struct handover *h, struct connection *conn)
+{
+	uint32_t i, num, len;
+
+	conn->proto = handover_get_u32(h);
+	len = handover_get_u32(h);
+	if (len > CONN_RX_BUF_SIZE)
+		return -1;
+	handover_get(h, conn->rx_buf, len);
+	conn->rx_len = len;
+
+	num = handover_get_u32(h);
+	for (i = 0; i < num && !h->err; ++i) {
+		struct frame_buf *frame;
+		int err;
+
+		frame = frame_alloc(handover_get_u32(h));
+		if (!frame)
+			return -1;
+
+		handover_get(h, frame->data, frame->len);
+		err = conn_queue(conn, frame);
+		frame_put(frame);
+		if (err)
+			return -1;
+	}
+
+	return h->err;
+}
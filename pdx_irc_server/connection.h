@@ -0,0 +1,199 @@
+/**
+ * connection.h - Per client connection state for the pdx irc server
+ * Author: Brett Creeley
+ */
+#ifndef _CONNECTION_H
+#define _CONNECTION_H
+
+#include "../common/protocol.h"
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "frame.h"
+
+struct member;
+struct identity;
+struct list_stream;
+struct login_wait;
+struct uring;
+struct handover;
+
+/* Bounds how many pipelined frames can be decoded from a single recv() */
+#define CONN_RX_FRAMES		16
+#define CONN_RX_BUF_SIZE	(CONN_RX_FRAMES * MSG_SIZE)
+
+/* Bytes that can be parked for a peer that isn't reading before it's treated
+ * as a slow consumer and disconnected.
+ */
+#define CONN_TX_MAX_BYTES	(1024 * 1024)
+/* Most frames handed to the kernel by a single flush */
+#define CONN_TX_IOV_MAX		256
+#define TX_BLOCK_FRAMES		62
+
+/**
+ * struct tx_block - part of a connection's outbound queue
+ * @next: next block in the queue
+ * @head: index of the oldest frame not completely sent
+ * @tail: index the next queued frame goes to
+ * @frames: references to queued frames
+ */
+struct tx_block {
+	struct tx_block *next;
+	uint32_t head;
+	uint32_t tail;
+	struct frame_buf *frames[TX_BLOCK_FRAMES];
+};
+
+/**
+ * struct tx_req - an io_uring send in flight
+ * @msg: message header handed to IORING_OP_SENDMSG, points to iov
+ * @iov: the queued frames being sent, which stay queued until it completes
+ */
+struct tx_req {
+	struct msghdr msg;
+	struct iovec iov[CONN_TX_IOV_MAX];
+};
+
+/* What an io_uring request was for, tagged on it with URING_DATA() */
+enum conn_uring_op {
+	CONN_OP_ACCEPT,
+	CONN_OP_RECV,
+	CONN_OP_SEND,
+	CONN_OP_KICK,
+};
+
+/**
+ * struct conn_loop - a worker's event loop as seen by the connections it owns
+ * @epollfd: epoll instance of an epoll worker, -1 for an io_uring worker
+ * @ring: io_uring of an io_uring worker, NULL for an epoll worker
+ * @kickfd: eventfd signalled when kicked_fds becomes non-empty
+ * @kick_lock: protects kicked_fds, num_kicked and kicked_size
+ * @kicked_fds: connections that need a flush by the owner
+ * @num_kicked: number of fds in kicked_fds
+ * @kicked_size: allocated size of kicked_fds
+ * @taken_fds: kicked_fds handed to the owner by the last conn_loop_take_kicked()
+ * @taken_size: allocated size of taken_fds
+ *
+ * An epoll worker is told about connections that need a flush through
+ * EPOLLOUT. An io_uring worker has nothing to arm, so other workers add the
+ * connection to kicked_fds instead and wake it up through kickfd. Either one
+ * is kicked for a connection that has to be closed, a peer that stopped
+ * reading never makes its socket writable again.
+ */
+struct conn_loop {
+	int epollfd;
+	struct uring *ring;
+	int kickfd;
+	pthread_mutex_t kick_lock;
+	int *kicked_fds;
+	uint32_t num_kicked;
+	uint32_t kicked_size;
+	int *taken_fds;
+	uint32_t taken_size;
+};
+
+/* Decoder state, a frame is only handed out once all of its bytes arrived */
+enum rx_state {
+	RX_STATE_TYPE,		/* waiting for the type byte of the next frame */
+	RX_STATE_BODY,		/* waiting for the rest of the current frame */
+	RX_STATE_INVALID,	/* malformed frame, the connection must be closed */
+};
+
+/**
+ * struct connection - state for one accepted client socket
+ * @fd: non-blocking client socket
+ * @loop: event loop of the worker that owns this connection
+ * @epoll_flags: extra epoll flags the fd was registered with, i.e. EPOLLET
+ * @proto: PROTO_V1 or PROTO_V2, 0 until the first byte is received
+ * @rx_state: where the decoder is within the current frame
+ * @rx_frame_len: length of the current frame, valid in RX_STATE_BODY
+ * @rx_start: offset in rx_buf of the first byte not yet decoded
+ * @rx_len: number of valid bytes in rx_buf
+ * @rx_buf: CONN_RX_BUF_SIZE bytes received from the client
+ * @rx_msg: the last frame decoded
+ * @ident: user this connection is logged in as, NULL until its LOGIN or, for
+ *	   a client that never sends one, its first message naming a src_user
+ * @joined: list of this connection's channel memberships, protected by the
+ *	    channel table lock
+ * @list: LIST response being streamed to this connection, owned by the
+ *	  worker that owns the connection
+ * @login: LOGIN of this connection whose password is being hashed, owned by
+ *	   the worker that owns the connection
+ * @tx_lock: protects every tx_* member, any worker can queue to a connection
+ * @tx_head: oldest queued block, sent first
+ * @tx_tail: newest queued block, appended to
+ * @tx_head_off: bytes of the oldest queued frame that were already sent
+ * @tx_bytes: total bytes waiting in the queue
+ * @tx_want_out: EPOLLOUT is armed for this connection, for an io_uring
+ *		 worker the connection is on its kicked_fds instead
+ * @tx_more: the owner has more to queue once the connection is writable, keep
+ *	     EPOLLOUT armed even when the queue is empty
+ * @tx_failed: the queue limit was hit or the socket failed, the owner was
+ *	       kicked to close the connection
+ * @tx_dirty: on the owning worker's list of connections to flush, only ever
+ *	      touched by the owner
+ * @tx_req: io_uring send of this connection, allocated by its first flush
+ * @tx_inflight: tx_req was submitted and hasn't completed yet
+ * @io_pending: io_uring requests in flight for this connection, only touched
+ *		by the owner
+ * @closing: closed by the owner, freed once io_pending drops to 0
+ */
+struct connection {
+	int fd;
+	struct conn_loop *loop;
+	uint32_t epoll_flags;
+	uint8_t proto;
+	pthread_mutex_t tx_lock;
+	struct tx_block *tx_head;
+	struct tx_block *tx_tail;
+	uint32_t tx_head_off;
+	uint32_t tx_bytes;
+	bool tx_want_out;
+	bool tx_more;
+	bool tx_failed;
+	bool tx_dirty;
+	bool tx_inflight;
+	struct tx_req *tx_req;
+	uint32_t io_pending;
+	bool closing;
+	enum rx_state rx_state;
+	uint32_t rx_frame_len;
+	uint32_t rx_start;
+	uint32_t rx_len;
+	uint8_t *rx_buf;
+	struct message rx_msg;
+	struct identity *ident;
+	struct member *joined;
+	struct list_stream *list;
+	struct login_wait *login;
+};
+
+int conn_table_init(void);
+struct connection *conn_create(int fd, struct conn_loop *loop,
+				uint32_t epoll_flags);
+struct connection *conn_lookup(int fd);
+struct connection *conn_next(int *iter);
+void conn_destroy(struct connection *conn);
+void conn_print_pool_stats(void);
+
+int conn_recv(struct connection *conn);
+uint32_t conn_rx_push(struct connection *conn, const uint8_t *data,
+		      uint32_t len);
+struct message *conn_next_msg(struct connection *conn);
+
+int conn_loop_init(struct conn_loop *loop, int epollfd, struct uring *ring);
+uint32_t conn_loop_take_kicked(struct conn_loop *loop, int **fds);
+void conn_worker_init(struct conn_loop *loop);
+int conn_queue(struct connection *conn, struct frame_buf *frame);
+int conn_send_msg(struct connection *conn, const struct message *msg);
+uint32_t conn_tx_space(struct connection *conn);
+bool conn_tx_failed(struct connection *conn);
+void conn_set_more(struct connection *conn, bool more);
+int conn_flush(struct connection *conn);
+int conn_send_done(struct connection *conn, int res);
+void conn_flush_dirty(void);
+void conn_handover_save(struct handover *h, struct connection *conn);
+int conn_handover_restore(struct handover *h, struct connection *conn);
+
+#endif /* _CONNECTION_H */
@@ -0,0 +1,160 @@
+/**
+ * frame.c - Reference counted, immutable outbound frames
+ * Author: Brett Creeley
+ */
+
+#include "frame.h"
+#include "../common/pool/pool.h"
+#include "../common/protocol.h"
+#include "../common/debug/log.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FRAMES_PER_SLAB		256
+
+static struct pool frame_small_pool;
+static struct pool frame_large_pool;
+static struct pool frame_ext_pool;
+
+int frame_pools_init(void)
+{
+	if (pool_init(&frame_small_pool, "frame_512", sizeof(struct frame_buf) +
+		      FRAME_SMALL_LEN, FRAMES_PER_SLAB, true))
+		return -1;
+
+	if (pool_init(&frame_large_pool, "frame_8k", sizeof(struct frame_buf) +
+		      FRAME_LARGE_LEN, FRAMES_PER_SLAB / 8, true))
+		return -1;
+
+	if (pool_init(&frame_ext_pool, "frame_ext", sizeof(struct frame_buf),
+		      FRAMES_PER_SLAB, true))
+		return -1;
+
+	return 0;
+}
+
+void frame_print_pool_stats(void)
+{
+	pool_print_stats(&frame_small_pool);
+	pool_print_stats(&frame_large_pool);
+	pool_print_stats(&frame_ext_pool);
+}
+
+/**
+ * frame_alloc - get a frame that can hold len bytes
+ * @len: size of the frame, at most FRAME_MAX_LEN
+ *
+ * The caller holds the only reference and fills in data before queuing it.
+ *
+ * Returns the frame or NULL on failure
+ */
+struct frame_buf *frame_alloc(uint32_t len)
+{
+	struct pool *pool;
+	struct frame_buf *frame;
+
+	if (len <= FRAME_SMALL_LEN) {
+		pool = &frame_small_pool;
+	} else if (len <= FRAME_LARGE_LEN) {
+		pool = &frame_large_pool;
+	} else {
+		log_err("frame of %u bytes is too large\n", len);
+		return NULL;
+	}
+
+	frame = pool_alloc(pool);
+	if (!frame)
+		return NULL;
+
+	atomic_init(&frame->refcnt, 1);
+	frame->len = len;
+	frame->pool = pool;
+	frame->ext = NULL;
+	frame->unpin = NULL;
+
+	return frame;
+}
+
+/**
+ * frame_wrap - get a frame for bytes the caller keeps valid
+ * @bytes: the frame's bytes, not copied
+ * @len: number of bytes
+ * @unpin: called with pin once the frame is freed, NULL if not needed
+ * @pin: whatever keeps bytes valid, pinned by the caller beforehand
+ *
+ * unpin is not called if the frame can't be allocated, the caller still
+ * holds its pin then.
+ *
+ * Returns the frame holding one reference or NULL on failure
+ */
+struct frame_buf *frame_wrap(const uint8_t *bytes, uint32_t len,
+			     void (*unpin)(void *pin), void *pin)
+{
+	struct frame_buf *frame;
+
+	frame = pool_alloc(&frame_ext_pool);
+	if (!frame)
+		return NULL;
+
+	atomic_init(&frame->refcnt, 1);
+	frame->len = len;
+	frame->pool = &frame_ext_pool;
+	frame->ext = bytes;
+	frame->unpin = unpin;
+	frame->pin = pin;
+
+	return frame;
+}
+
+/**
+ * frame_from_msg - build the frame for a message
+ * @msg: message to encode
+ * @proto: protocol version of the connection(s) the frame is for
+ *
+ * Returns the frame holding one reference or NULL on failure
+ */
+struct frame_buf *frame_from_msg(const struct message *msg, uint8_t proto)
+{
+	struct frame_buf *frame;
+	int len;
+
+	if (proto != PROTO_V2) {
+		frame = frame_alloc(MSG_SIZE);
+		if (frame)
+			memcpy(frame->data, msg, MSG_SIZE);
+
+		return frame;
+	}
+
+	frame = frame_alloc(MSG_V2_MAX_LEN);
+	if (!frame)
+		return NULL;
+
+	len = proto_encode(msg, frame->data, MSG_V2_MAX_LEN);
+	if (len < 0) {
+		log_err("cannot encode message type %u\n", msg->type);
+		frame_put(frame);
+		return NULL;
+	}
+	frame->len = len;
+
+	return frame;
+}
+
+/**
+ * frame_put - drop a reference, the last one returns the frame to its pool
+ * @frame: frame to release
+ */
+void frame_put(struct frame_buf *frame)
+{
+	if (!frame)
+		return;
+
+	if (atomic_fetch_sub_explicit(&frame->refcnt, 1,
+				      memory_order_acq_rel) != 1)
+		return;
+
+	if (frame->unpin)
+		frame->unpin(frame->pin);
+	pool_free(frame->pool, frame);
+}
@@ -0,0 +1,67 @@
+/**
+ * frame.h - Reference counted, immutable outbound frames
+ * Author: Brett Creeley
+ *
+ * Note: A frame is built once and then only read. Every connection it is
+ *	 queued to holds a reference, so a CHAT going to a thousand members
+ *	 is one buffer with a thousand references instead of a thousand copies.
+ *	 A frame can also point into memory somebody else owns, like a mapped
+ *	 history segment, and keeps it pinned until the last reference is
+ *	 dropped.
+ */
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define FRAME_SMALL_LEN		512
+#define FRAME_LARGE_LEN		8192
+#define FRAME_MAX_LEN		FRAME_LARGE_LEN
+
+struct pool;
+struct message;
+
+/**
+ * struct frame_buf - an outbound frame
+ * @refcnt: number of queues (and builders) holding this frame
+ * @len: number of valid bytes in data
+ * @pool: pool the frame is returned to once refcnt drops to 0
+ * @ext: bytes of a frame from frame_wrap(), NULL when they are in data
+ * @unpin: called with pin once refcnt drops to 0, NULL if nothing is pinned
+ * @pin: what keeps ext valid
+ * @data: the frame's bytes exactly as they go on the wire
+ */
+struct frame_buf {
+	atomic_uint refcnt;
+	uint32_t len;
+	struct pool *pool;
+	const uint8_t *ext;
+	void (*unpin)(void *pin);
+	void *pin;
+	uint8_t data[];
+};
+
+int frame_pools_init(void);
+void frame_print_pool_stats(void);
+struct frame_buf *frame_alloc(uint32_t len);
+struct frame_buf *frame_from_msg(const struct message *msg, uint8_t proto);
+struct frame_buf *frame_wrap(const uint8_t *bytes, uint32_t len,
+			     void (*unpin)(void *pin), void *pin);
+
+/* Where the bytes that go on the wire are */
+static inline const uint8_t *frame_bytes(const struct frame_buf *frame)
+{
+	return frame->ext ? frame->ext : frame->data;
+}
+
+static inline struct frame_buf *frame_get(struct frame_buf *frame)
+{
+	atomic_fetch_add_explicit(&frame->refcnt, 1, memory_order_relaxed);
+
+	return frame;
+}
+
+void frame_put(struct frame_buf *frame);
+
+#endif /* _FRAME_H */
@@ -0,0 +1,483 @@
+/**
+ * handover.c - Hot upgrade of the pdx irc server to a new binary
+ * Author: Brett Creeley
+ */
+
+#include "handover.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * struct handover_hdr - first bytes the old server sends its successor
+ * @magic: HANDOVER_MAGIC
+ * @version: HANDOVER_VERSION of the old server
+ * @len: bytes of state sent after the descriptors
+ * @num_fds: number of descriptors sent right after this header
+ */
+struct handover_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t len;
+	uint32_t num_fds;
+};
+
+/* What the old server waits on while its workers are parked */
+#define HANDOVER_ACK	'A'
+
+static const struct handover_ops *handover_ops;
+
+void handover_put(struct handover *h, const void *data, uint32_t len)
+{
+	if (h->err)
+		return;
+
+	if (h->size - h->len < len) {
+		uint32_t size = h->size ? h->size : 64 * 1024;
+		uint8_t *grown;
+
+		while (size - h->len < len)
+			size *= 2;
+
+		grown = realloc(h->buf, size);
+		if (!grown) {
+			perror("realloc");
+			h->err = -1;
+			return;
+		}
+
+		h->buf = grown;
+		h->size = size;
+	}
+
+	memcpy(h->buf + h->len, data, len);
+	h->len += len;
+}
+
+void handover_put_u32(struct handover *h, uint32_t val)
+{
+	handover_put(h, &val, sizeof(val));
+}
+
+/* The state only holds the index, the descriptor itself goes along with it */
+void handover_put_fd(struct handover *h, int fd)
+{
+	if (h->err)
+		return;
+
+	if (h->num_fds == h->fds_size) {
+		uint32_t size = h->fds_size ? h->fds_size * 2 : 256;
+		int *fds;
+
+		fds = realloc(h->fds, size * sizeof(*fds));
+		if (!fds) {
+			perror("realloc");
+			h->err = -1;
+			return;
+		}
+
+		h->fds = fds;
+		h->fds_size = size;
+	}
+
+	handover_put_u32(h, h->num_fds);
+	h->fds[h->num_fds++] = fd;
+}
+
+/* Reads zeroes once the state ran out, h->err tells */
+void handover_get(struct handover *h, void *data, uint32_t len)
+{
+	if (h->err || h->len - h->pos < len) {
+		h->err = -1;
+		memset(data, 0, len);
+		return;
+	}
+
+	memcpy(data, h->buf + h->pos, len);
+	h->pos += len;
+}
+
+uint32_t handover_get_u32(struct handover *h)
+{
+	uint32_t val;
+
+	handover_get(h, &val, sizeof(val));
+
+	return val;
+}
+
+int handover_get_fd(struct handover *h)
+{
+	uint32_t idx = handover_get_u32(h);
+
+	if (h->err || idx >= h->num_fds) {
+		h->err = -1;
+		return -1;
+	}
+
+	return h->fds[idx];
+}
+
+/* Only frees the handover, the descriptors now belong to the server */
+void handover_free(struct handover *h)
+{
+	free(h->buf);
+	free(h->fds);
+	memset(h, 0, sizeof(*h));
+}
+
+static int handover_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("[%s:%d] handover socket path %s is too long\n", __func__,
+		       __LINE__, path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+static int write_all(int sock, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len) {
+		ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("send");
+			return -1;
+		}
+
+		p += sent;
+		len -= sent;
+	}
+
+	return 0;
+}
+
+static int read_all(int sock, void *data, size_t len)
+{
+	uint8_t *p = data;
+
+	while (len) {
+		ssize_t bytes = recv(sock, p, len, 0);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			if (bytes < 0)
+				perror("recv");
+			return -1;
+		}
+
+		p += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/* Each batch of descriptors rides on a count so it can't merge with another */
+static int send_fds(int sock, const int *fds, uint32_t num)
+{
+	char cbuf[CMSG_SPACE(HANDOVER_FDS_PER_MSG * sizeof(int))];
+	struct iovec iov = { .iov_base = &num, .iov_len = sizeof(num) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = CMSG_SPACE(num * sizeof(int)),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, num * sizeof(int));
+
+	while (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(num)) {
+		if (errno == EINTR)
+			continue;
+		perror("sendmsg");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int recv_fds(int sock, int *fds, uint32_t num)
+{
+	char cbuf[CMSG_SPACE(HANDOVER_FDS_PER_MSG * sizeof(int))];
+	uint32_t sent_num;
+	struct iovec iov = { .iov_base = &sent_num, .iov_len = sizeof(sent_num) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t bytes;
+
+	do {
+		bytes = recvmsg(sock, &msg, MSG_WAITALL);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes != sizeof(sent_num)) {
+		if (bytes < 0)
+			perror("recvmsg");
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (sent_num != num || (msg.msg_flags & MSG_CTRUNC) || !cmsg ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(num * sizeof(int))) {
+		printf("[%s:%d] unexpected descriptors from the old server\n",
+		       __func__, __LINE__);
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), num * sizeof(int));
+
+	return 0;
+}
+
+/**
+ * handover_connect - find a running server to take over from
+ * @path: its handover socket
+ *
+ * Returns the connected socket, -1 if no server is listening on path
+ */
+int handover_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (handover_addr(path, &addr))
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		/* Nothing there or a socket file left behind by a crash */
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			perror("connect");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+ * handover_recv - receive the state and sockets of the old server
+ * @sock: socket returned by handover_connect()
+ * @h: handover to fill in, freed with handover_free()
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int handover_recv(int sock, struct handover *h)
+{
+	struct handover_hdr hdr;
+	uint32_t i, num;
+
+	memset(h, 0, sizeof(*h));
+	if (read_all(sock, &hdr, sizeof(hdr)))
+		return -1;
+
+	if (hdr.magic != HANDOVER_MAGIC || hdr.version != HANDOVER_VERSION) {
+		printf("[%s:%d] old server speaks handover version %u, not %u\n",
+		       __func__, __LINE__, hdr.version, HANDOVER_VERSION);
+		return -1;
+	}
+
+	h->buf = malloc(hdr.len ? hdr.len : 1);
+	h->fds = malloc((hdr.num_fds ? hdr.num_fds : 1) * sizeof(int));
+	if (!h->buf || !h->fds) {
+		perror("malloc");
+		goto err_free;
+	}
+	h->size = hdr.len;
+	h->fds_size = hdr.num_fds;
+
+	for (i = 0; i < hdr.num_fds; i += num) {
+		num = hdr.num_fds - i;
+		if (num > HANDOVER_FDS_PER_MSG)
+			num = HANDOVER_FDS_PER_MSG;
+
+		if (recv_fds(sock, h->fds + i, num))
+			goto err_close;
+		h->num_fds += num;
+	}
+
+	if (read_all(sock, h->buf, hdr.len))
+		goto err_close;
+	h->len = hdr.len;
+
+	return 0;
+
+err_close:
+	/* The old server still has every one of them */
+	for (i = 0; i < h->num_fds; ++i)
+		close(h->fds[i]);
+err_free:
+	handover_free(h);
+	return -1;
+}
+
+/**
+ * handover_ack - tell the old server its state was taken over
+ * @sock: socket returned by handover_connect(), closed here
+ *
+ * Waits for the old server to exit, so once this returns the handover socket
+ * is free to be bound again.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int handover_ack(int sock)
+{
+	char ack = HANDOVER_ACK;
+	int ret;
+
+	ret = write_all(sock, &ack, sizeof(ack));
+	/* The old server exits right after reading the ack */
+	if (!ret)
+		while (recv(sock, &ack, sizeof(ack), 0) < 0 && errno == EINTR)
+			;
+	close(sock);
+
+	return ret;
+}
+
+/* Send everything to the successor, returns 0 once it acknowledged */
+static int handover_send(int sock, struct handover *h)
+{
+	struct handover_hdr hdr = {
+		.magic = HANDOVER_MAGIC,
+		.version = HANDOVER_VERSION,
+		.len = h->len,
+		.num_fds = h->num_fds,
+	};
+	uint32_t i, num;
+	char ack;
+
+	if (write_all(sock, &hdr, sizeof(hdr)))
+		return -1;
+
+	for (i = 0; i < h->num_fds; i += num) {
+		num = h->num_fds - i;
+		if (num > HANDOVER_FDS_PER_MSG)
+			num = HANDOVER_FDS_PER_MSG;
+
+		if (send_fds(sock, h->fds + i, num))
+			return -1;
+	}
+
+	if (write_all(sock, h->buf, h->len))
+		return -1;
+
+	/* The successor closes the socket if it can't take over */
+	if (read_all(sock, &ack, sizeof(ack)) || ack != HANDOVER_ACK)
+		return -1;
+
+	return 0;
+}
+
+static void *handover_thread(void *arg)
+{
+	int listenfd = (intptr_t)arg;
+
+	while (1) {
+		struct handover h = { 0 };
+		int sock = accept(listenfd, NULL, NULL);
+
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		printf("Handing over to a new server\n");
+		if (!handover_ops->save(&h) && !h.err &&
+		    !handover_send(sock, &h)) {
+			/* Every socket lives on in the new server */
+			printf("Handed over %u sockets, exiting\n", h.num_fds);
+			exit(EXIT_SUCCESS);
+		}
+
+		printf("Handover failed, resuming\n");
+		close(sock);
+		handover_free(&h);
+		handover_ops->resume();
+	}
+
+	close(listenfd);
+
+	return NULL;
+}
+
+/**
+ * handover_start - wait for a new server binary to take over
+ * @path: path of the handover socket, an existing file there is replaced
+ * @ops: how to stop and serialize this server and resume it on failure
+ *
+ * Successors are handled by a thread of their own, one at a time.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int handover_start(const char *path, const struct handover_ops *ops)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int listenfd;
+
+	if (handover_addr(path, &addr))
+		return -1;
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenfd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		goto err_closefd;
+	}
+
+	if (listen(listenfd, 1)) {
+		perror("listen");
+		goto err_closefd;
+	}
+
+	handover_ops = ops;
+	if (pthread_create(&thread, NULL, handover_thread,
+			   (void *)(intptr_t)listenfd)) {
+		perror("pthread_create");
+		goto err_closefd;
+	}
+	pthread_detach(thread);
+
+	return 0;
+
+err_closefd:
+	close(listenfd);
+	return -1;
+}
@@ -0,0 +1,80 @@
+/**
+ * handover.h - Hot upgrade of the pdx irc server to a new binary
+ * Author: Brett Creeley
+ *
+ * Note: A server started with -U <path> listens for its successor on that
+ *	 Unix socket. A new binary started with the same -U finds the running
+ *	 server there and takes over from it instead of starting empty:
+ *
+ *	 1. The old server parks every worker once its loop iteration is
+ *	    done and serializes identities, channels, members, backlogs and
+ *	    every connection's partially received and unsent bytes.
+ *	 2. The state goes over the socket together with the listening
+ *	    sockets and every client socket, passed with SCM_RIGHTS.
+ *	 3. The new server rebuilds its tables, adds the sockets to its own
+ *	    workers and acknowledges. The old server exits without closing a
+ *	    single connection and the new one starts its workers.
+ *
+ *	 Clients see a pause, never a disconnect. If the new server refuses
+ *	 the state or dies before acknowledging, the old one resumes serving.
+ *	 History is not part of the state, the new server maps the same
+ *	 segment files again once the old one wrote out every segment still
+ *	 in memory.
+ */
+#ifndef _HANDOVER_H
+#define _HANDOVER_H
+
+#include <stdint.h>
+
+#define HANDOVER_MAGIC		0x70647868
+/* Bumped whenever the layout of the state changes */
+#define HANDOVER_VERSION	3
+/* Descriptors passed with one sendmsg(), below the kernel's SCM_MAX_FD */
+#define HANDOVER_FDS_PER_MSG	250
+
+/**
+ * struct handover - serialized server state and the sockets that go with it
+ * @buf: the state, written by the old server and read by the new one
+ * @len: bytes of buf written or received
+ * @size: bytes allocated for buf
+ * @pos: offset of the next byte to read
+ * @fds: sockets passed along, the state refers to them by index
+ * @num_fds: number of fds
+ * @fds_size: number of entries allocated for fds
+ * @err: a put ran out of memory or a get ran past the end of the state
+ */
+struct handover {
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t size;
+	uint32_t pos;
+	int *fds;
+	uint32_t num_fds;
+	uint32_t fds_size;
+	int err;
+};
+
+/**
+ * struct handover_ops - what the old server does when its successor connects
+ * @save: park every worker and serialize the server into the handover
+ * @resume: the successor failed, unpark the workers and keep serving
+ */
+struct handover_ops {
+	int (*save)(struct handover *h);
+	void (*resume)(void);
+};
+
+void handover_put(struct handover *h, const void *data, uint32_t len);
+void handover_put_u32(struct handover *h, uint32_t val);
+void handover_put_fd(struct handover *h, int fd);
+void handover_get(struct handover *h, void *data, uint32_t len);
+uint32_t handover_get_u32(struct handover *h);
+int handover_get_fd(struct handover *h);
+void handover_free(struct handover *h);
+
+int handover_connect(const char *path);
+int handover_recv(int sock, struct handover *h);
+int handover_ack(int sock);
+int handover_start(const char *path, const struct handover_ops *ops);
+
+#endif /* _HANDOVER_H */
@@ -0,0 +1,1090 @@
+/**
+ * history.c - Durable, append only chat history of the pdx irc server
+ * Author: Brett Creeley
+ */
+
+#include "history.h"
+#include "connection.h"
+#include "frame.h"
+#include "metrics.h"
+#include "../common/debug/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HISTORY_REC_MAGIC	0x70647831	/* "pdx1" */
+#define HISTORY_DEFAULT_COUNT	50
+/* Most segments whose records one sync of a log msync()s, or unmaps */
+#define HISTORY_SYNC_BATCH	8
+
+/**
+ * struct history_rec - header of a record, followed by the CHAT's v2 frame
+ * @magic: HISTORY_REC_MAGIC, written last so a torn record isn't one
+ * @len: length of the frame
+ * @seq: sequence number, one more than the previous record's
+ * @time_ms: wall clock time the record was appended at
+ *
+ * Records are padded to 8 bytes. A segment's records end at the first
+ * header that isn't valid, which is normally the zeroed rest of the file.
+ */
+struct history_rec {
+	uint32_t magic;
+	uint32_t len;
+	uint64_t seq;
+	uint64_t time_ms;
+	uint8_t data[];
+};
+
+#define REC_SIZE(len)	((sizeof(struct history_rec) + (len) + 7) & ~7U)
+
+/* Directory every channel's directory is in, -1 while history is off */
+static int history_dirfd = -1;
+
+/* Every log, newest first. Logs are only ever prepended, and only unlinked
+ * by the sync thread, so the sync thread walks the list without a lock.
+ */
+static struct history_log *logs;
+static pthread_mutex_t logs_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes creating segments and freeing closed logs, by the sync thread,
+ * with history_flush() walking the logs.
+ */
+static pthread_mutex_t prepare_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Wakes the sync thread before its interval is up, protected by logs_lock */
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static bool sync_wanted;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Have the sync thread look at every log now instead of at its interval */
+static void history_wake(void)
+{
+	pthread_mutex_lock(&logs_lock);
+	sync_wanted = true;
+	pthread_cond_signal(&sync_cond);
+	pthread_mutex_unlock(&logs_lock);
+}
+
+static void seg_path(struct history_log *log, uint32_t num, char *path,
+		     size_t size)
+{
+	snprintf(path, size, "%s/%010u.seg", log->dir, num);
+}
+
+/**
+ * map_segment - map a segment file
+ * @log: log the segment belongs to
+ * @seg: the segment, base is set on success
+ * @create: create and allocate the file, replacing any file of the same name
+ *
+ * A segment that isn't created is mapped read only, only the newest segment
+ * is ever written and that one never gets unmapped.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int map_segment(struct history_log *log, struct history_seg *seg,
+		       bool create)
+{
+	char path[sizeof(log->dir) + 32];
+	int prot = PROT_READ;
+	void *base;
+	int fd, ret;
+
+	seg_path(log, seg->num, path, sizeof(path));
+	fd = openat(history_dirfd, path, create ?
+		    O_RDWR | O_CLOEXEC | O_CREAT | O_TRUNC :
+		    O_RDONLY | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_err("cannot open history segment %s: %m\n", LOG_STR(path));
+		return -1;
+	}
+
+	if (create) {
+		/* Allocated up front so a full disk fails here, instead of
+		 * as a SIGBUS when a record is copied into the mapping.
+		 */
+		ret = posix_fallocate(fd, 0, seg->size);
+		if (ret) {
+			errno = ret;
+			log_err("cannot allocate history segment %s: %m\n",
+				LOG_STR(path));
+			goto err_close;
+		}
+		prot |= PROT_WRITE;
+	}
+
+	base = mmap(NULL, seg->size, prot, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		log_err("cannot map history segment %s: %m\n", LOG_STR(path));
+		goto err_close;
+	}
+	/* The mapping keeps the file, msync() doesn't need the fd */
+	close(fd);
+	seg->base = base;
+
+	return 0;
+
+err_close:
+	close(fd);
+	return -1;
+}
+
+/* Unmap and free a segment that isn't in any log */
+static void free_segment(struct history_seg *seg)
+{
+	if (seg->base)
+		munmap(seg->base, seg->size);
+	free(seg);
+}
+
+/**
+ * new_segment - create the segment a log appends to once its newest is full
+ * @log: the log, only ever called by the sync thread
+ * @num: number of the segment
+ * @size: size of the segment file
+ *
+ * Called without log->lock, this is what keeps the file system off the
+ * CHAT path.
+ *
+ * Returns the mapped segment or NULL on failure
+ */
+static struct history_seg *new_segment(struct history_log *log, uint32_t num,
+				       uint32_t size)
+{
+	struct history_seg *seg;
+	int dirfd;
+
+	if (mkdirat(history_dirfd, log->dir, 0755) && errno != EEXIST) {
+		log_err("cannot create history directory %s: %m\n",
+			LOG_STR(log->dir));
+		return NULL;
+	}
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return NULL;
+
+	seg->num = num;
+	seg->size = size;
+	if (map_segment(log, seg, true)) {
+		free(seg);
+		return NULL;
+	}
+
+	/* Make the new file's name durable, records are synced later */
+	dirfd = openat(history_dirfd, log->dir, O_RDONLY | O_DIRECTORY);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	return seg;
+}
+
+/* Make room for one more segment, caller must hold log->lock unless nobody
+ * else can see the log yet.
+ */
+static int grow_segs(struct history_log *log)
+{
+	struct history_seg **grown;
+	uint32_t size;
+
+	if (log->num_segs < log->segs_size)
+		return 0;
+
+	size = log->segs_size ? log->segs_size * 2 : 4;
+	grown = realloc(log->segs, size * sizeof(*grown));
+	if (!grown)
+		return -1;
+
+	log->segs = grown;
+	log->segs_size = size;
+
+	return 0;
+}
+
+/**
+ * rec_at - get the record at an offset of a segment
+ * @log: log the segment belongs to, caller must hold log->lock
+ * @seg: index of the segment, mapped again if it isn't mapped
+ * @off: offset of the record
+ *
+ * Returns the record or NULL if the segment can't be mapped
+ */
+static struct history_rec *rec_at(struct history_log *log, uint32_t seg,
+				  uint32_t off)
+{
+	struct history_seg *s = log->segs[seg];
+
+	if (!s->base) {
+		if (map_segment(log, s, false))
+			return NULL;
+		++log->num_mapped;
+	}
+
+	return (struct history_rec *)(s->base + off);
+}
+
+/* Move from rec at seg/off to the record after it, the next segment's
+ * first when it was the last of its segment.
+ */
+static void rec_next(struct history_log *log, const struct history_rec *rec,
+		     uint32_t *seg, uint32_t *off)
+{
+	*off += REC_SIZE(rec->len);
+	if (*off >= log->segs[*seg]->used && *seg + 1 < log->num_segs) {
+		++*seg;
+		*off = 0;
+	}
+}
+
+/* Caller must hold log->lock. An entry that can't be added only makes the
+ * walk from the previous one longer.
+ */
+static void idx_add(struct history_log *log, const struct history_rec *rec,
+		    uint32_t seg, uint32_t off)
+{
+	struct history_idx *e;
+
+	if ((rec->seq - log->first_seq) % HISTORY_INDEX_INTERVAL)
+		return;
+
+	if (log->num_idx == log->idx_size) {
+		uint32_t size = log->idx_size ? log->idx_size * 2 : 64;
+		struct history_idx *grown;
+
+		grown = realloc(log->idx, size * sizeof(*grown));
+		if (!grown)
+			return;
+
+		log->idx = grown;
+		log->idx_size = size;
+	}
+
+	e = &log->idx[log->num_idx++];
+	e->seq = rec->seq;
+	e->time_ms = rec->time_ms;
+	e->seg = seg;
+	e->off = off;
+}
+
+/* Find the records a segment has and index them */
+static void scan_segment(struct history_log *log, uint32_t seg)
+{
+	struct history_seg *s = log->segs[seg];
+	uint32_t off = 0;
+
+	s->first_seq = log->next_seq;
+	while (off + sizeof(struct history_rec) <= s->size) {
+		struct history_rec *rec = (struct history_rec *)(s->base + off);
+
+		if (rec->magic != HISTORY_REC_MAGIC || !rec->len ||
+		    rec->len > FRAME_MAX_LEN ||
+		    off + REC_SIZE(rec->len) > s->size ||
+		    rec->seq != log->next_seq)
+			break;
+
+		idx_add(log, rec, seg, off);
+		++log->next_seq;
+		off += REC_SIZE(rec->len);
+	}
+
+	s->used = off;
+	s->synced = off;
+}
+
+/**
+ * load_segment - map a segment a log had before a restart and scan it
+ * @log: log of the channel, not visible to anybody else yet
+ * @num: number of the segment
+ *
+ * The log's first segment decides where its sequence numbers start, every
+ * later one has to continue where the previous one ended.
+ *
+ * Returns 0 if the segment was added to the log, otherwise -1
+ */
+static int load_segment(struct history_log *log, uint32_t num)
+{
+	char path[sizeof(log->dir) + 32];
+	const struct history_rec *rec;
+	struct history_seg *seg;
+	struct stat st;
+
+	/* Only a log's newest segment can be empty */
+	if (log->num_segs && !log->segs[log->num_segs - 1]->used)
+		return -1;
+
+	seg_path(log, num, path, sizeof(path));
+	if (fstatat(history_dirfd, path, &st, 0) ||
+	    st.st_size < HISTORY_SEGMENT_MIN_SIZE ||
+	    st.st_size > HISTORY_SEGMENT_MAX_SIZE ||
+	    st.st_size & (st.st_size - 1)) {
+		log_warn("skipping history segment %s of the wrong size\n",
+			 LOG_STR(path));
+		return -1;
+	}
+
+	if (grow_segs(log))
+		return -1;
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return -1;
+
+	seg->num = num;
+	seg->size = st.st_size;
+	if (map_segment(log, seg, false)) {
+		free(seg);
+		return -1;
+	}
+
+	rec = (const struct history_rec *)seg->base;
+	if (rec->magic == HISTORY_REC_MAGIC) {
+		if (!log->num_segs) {
+			log->first_seq = rec->seq;
+			log->next_seq = rec->seq;
+		} else if (rec->seq != log->next_seq) {
+			free_segment(seg);
+			return -1;
+		}
+	}
+
+	log->segs[log->num_segs] = seg;
+	++log->num_mapped;
+	scan_segment(log, log->num_segs++);
+
+	return 0;
+}
+
+/* The newest segment is appended to, which needs it mapped writable */
+static int reopen_newest(struct history_log *log)
+{
+	struct history_seg *seg = log->segs[log->num_segs - 1];
+	char path[sizeof(log->dir) + 32];
+	void *base;
+	int fd;
+
+	seg_path(log, seg->num, path, sizeof(path));
+	fd = openat(history_dirfd, path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	munmap(seg->base, seg->size);
+	seg->base = base;
+
+	return 0;
+}
+
+static int cmp_num(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * history_load - map and index the segments a channel had before a restart
+ * @log: log of the channel, not visible to anybody else yet
+ *
+ * Segments are used oldest first for as long as their sequence numbers
+ * continue where the previous segment's ended.
+ */
+static void history_load(struct history_log *log)
+{
+	uint32_t *nums = NULL;
+	uint32_t num = 0, size = 0, i;
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	fd = openat(history_dirfd, log->dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(dir))) {
+		char *end;
+		unsigned long n = strtoul(de->d_name, &end, 10);
+
+		if (end == de->d_name || strcmp(end, ".seg") || !n ||
+		    n > UINT32_MAX - 1)
+			continue;
+
+		if (num == size) {
+			uint32_t *grown;
+
+			size = size ? size * 2 : 16;
+			grown = realloc(nums, size * sizeof(*grown));
+			if (!grown)
+				break;
+			nums = grown;
+		}
+		nums[num++] = n;
+	}
+	closedir(dir);
+
+	qsort(nums, num, sizeof(*nums), cmp_num);
+	/* Files that aren't used are never overwritten */
+	if (num)
+		log->next_num = nums[num - 1] + 1;
+	for (i = 0; i < num; ++i)
+		if (load_segment(log, nums[i]))
+			break;
+	free(nums);
+
+	if (log->num_segs && reopen_newest(log)) {
+		log_err("cannot map history segment of %s for writing\n",
+			LOG_STR(log->dir));
+		/* Appends go to the next segment the sync thread creates */
+		log->segs[log->num_segs - 1]->size =
+			log->segs[log->num_segs - 1]->used;
+	}
+
+	if (log->num_segs)
+		log_info("history of %s has records %" PRIu64 " to %" PRIu64
+			 " in %u segments\n", LOG_STR(log->dir),
+			 log->first_seq, log->next_seq - 1, log->num_segs);
+}
+
+/**
+ * history_open - get the history log of a channel
+ * @channel_name: name of the channel, at most CHANNEL_NAME_MAX_LEN bytes
+ *
+ * Records the channel had before a restart are picked up again.
+ *
+ * Returns the log, or NULL if history is off or the log can't be opened
+ */
+struct history_log *history_open(const char *channel_name)
+{
+	struct history_log *log;
+	size_t i, len;
+
+	if (history_dirfd < 0)
+		return NULL;
+
+	log = calloc(1, sizeof(*log));
+	if (!log) {
+		perror("calloc");
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&log->lock, NULL)) {
+		free(log);
+		return NULL;
+	}
+
+	/* Channel names can have any bytes, file names can't */
+	len = strnlen(channel_name, CHANNEL_NAME_MAX_LEN);
+	for (i = 0; i < len; ++i)
+		sprintf(&log->dir[i * 2], "%02x", (uint8_t)channel_name[i]);
+
+	log->first_seq = 1;
+	log->next_seq = 1;
+	log->next_num = 1;
+	history_load(log);
+
+	pthread_mutex_lock(&logs_lock);
+	log->next = logs;
+	__atomic_store_n(&logs, log, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&logs_lock);
+
+	return log;
+}
+
+/* Start the first segment of a log in memory, the sync thread gives it its
+ * file. Caller must hold log->lock.
+ */
+static struct history_seg *first_segment(struct history_log *log)
+{
+	struct history_seg *seg;
+
+	if (grow_segs(log))
+		return NULL;
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return NULL;
+
+	seg->base = malloc(HISTORY_SEGMENT_MIN_SIZE);
+	if (!seg->base) {
+		free(seg);
+		return NULL;
+	}
+	seg->size = HISTORY_SEGMENT_MIN_SIZE;
+	seg->anon = true;
+	seg->num = log->next_num++;
+	seg->first_seq = log->next_seq;
+
+	log->segs[log->num_segs++] = seg;
+	++log->num_mapped;
+
+	return seg;
+}
+
+/**
+ * history_append - add a CHAT to a channel's history
+ * @log: history of the channel the CHAT went to
+ * @frame: v2 frame of the CHAT, copied into the log
+ */
+void history_append(struct history_log *log, struct frame_buf *frame)
+{
+	uint32_t size = REC_SIZE(frame->len);
+	struct history_seg *seg = NULL;
+	struct history_rec *rec;
+	bool wake = false;
+	uint32_t s;
+
+	pthread_mutex_lock(&log->lock);
+	if (log->num_segs)
+		seg = log->segs[log->num_segs - 1];
+	else
+		seg = first_segment(log);
+
+	if (!seg || (seg->used + size > seg->size && !log->spare)) {
+		pthread_mutex_unlock(&log->lock);
+		metrics_add(&thread_metrics->history_dropped, 1);
+		return;
+	}
+
+	if (seg->used + size > seg->size) {
+		/* There is room for it, the sync thread made sure of that */
+		seg = log->spare;
+		seg->first_seq = log->next_seq;
+		log->segs[log->num_segs++] = seg;
+		++log->num_mapped;
+		log->spare = NULL;
+	}
+
+	s = log->num_segs - 1;
+	rec = (struct history_rec *)(seg->base + seg->used);
+	memcpy(rec->data, frame->data, frame->len);
+	rec->len = frame->len;
+	rec->seq = log->next_seq++;
+	rec->time_ms = now_ms();
+	__atomic_store_n(&rec->magic, HISTORY_REC_MAGIC, __ATOMIC_RELEASE);
+
+	idx_add(log, rec, s, seg->used);
+	seg->used += size;
+
+	/* Once per segment, the next one should be ready before this fills */
+	if (!log->spare_wanted &&
+	    (seg->anon || (!log->spare && seg->used >= seg->size / 2))) {
+		log->spare_wanted = true;
+		wake = true;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	if (wake)
+		history_wake();
+
+	metrics_add(&thread_metrics->history_appended, 1);
+}
+
+/* Last index entry whose seq, or time, is below val, -1 if none is.
+ * Caller must hold log->lock.
+ */
+static int idx_search(struct history_log *log, uint64_t val, bool by_time)
+{
+	int lo = 0, hi = (int)log->num_idx - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		uint64_t key = by_time ? log->idx[mid].time_ms :
+					 log->idx[mid].seq;
+
+		if (key < val) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+/* Position of the record with sequence number seq, which must exist.
+ * Returns -1 if a segment on the way can't be mapped.
+ */
+static int locate_seq(struct history_log *log, uint64_t seq, uint32_t *seg,
+		      uint32_t *off)
+{
+	int i = idx_search(log, seq + 1, false);
+	struct history_rec *rec;
+
+	*seg = i < 0 ? 0 : log->idx[i].seg;
+	*off = i < 0 ? 0 : log->idx[i].off;
+	while ((rec = rec_at(log, *seg, *off)) && rec->seq < seq)
+		rec_next(log, rec, seg, off);
+
+	return rec ? 0 : -1;
+}
+
+/* Sequence number of the first record appended at or after time_ms */
+static uint64_t seq_at_time(struct history_log *log, uint64_t time_ms)
+{
+	int i = idx_search(log, time_ms, true);
+	struct history_rec *rec;
+	uint32_t seg, off;
+	uint64_t seq;
+
+	if (i < 0)
+		return log->first_seq;
+
+	seg = log->idx[i].seg;
+	off = log->idx[i].off;
+	for (seq = log->idx[i].seq; seq < log->next_seq; ++seq) {
+		rec = rec_at(log, seg, off);
+		if (!rec || rec->time_ms >= time_ms)
+			break;
+		rec_next(log, rec, &seg, &off);
+	}
+
+	return seq;
+}
+
+static void seg_unpin(void *pin)
+{
+	struct history_seg *seg = pin;
+
+	atomic_fetch_sub_explicit(&seg->pins, 1, memory_order_release);
+}
+
+/* Queue a record's frame straight out of the mapping, the frame pins the
+ * segment until it's sent. Caller must hold log->lock.
+ */
+static int send_rec(struct connection *conn, struct history_seg *seg,
+		    const struct history_rec *rec)
+{
+	struct frame_buf *frame;
+	int err;
+
+	frame = frame_wrap(rec->data, rec->len, seg_unpin, seg);
+	if (!frame)
+		return -1;
+	atomic_fetch_add_explicit(&seg->pins, 1, memory_order_relaxed);
+
+	err = conn_queue(conn, frame);
+	frame_put(frame);
+
+	return err;
+}
+
+/* v1 connections need the fixed size layout, so the frame is re-encoded */
+static int send_rec_v1(struct connection *conn, const struct history_rec *rec)
+{
+	struct message msg;
+
+	if (proto_decode(rec->data, rec->len, &msg))
+		return -1;
+
+	return conn_send_msg(conn, &msg);
+}
+
+/**
+ * history_query - send a connection the CHATs a HISTORY asks for
+ * @log: history of the channel asked about, NULL if history is off
+ * @conn: connection that asked, owned by the calling worker
+ * @msg: the HISTORY, count and before_seq are set to the response's
+ *
+ * A v2 connection gets every record's frame queued as is, pointing into the
+ * segment's mapping, the records already are complete CHAT frames.
+ *
+ * Returns the response to the HISTORY
+ */
+uint32_t history_query(struct history_log *log, struct connection *conn,
+		       struct message *msg)
+{
+	uint32_t count = msg->history.count, sent = 0;
+	uint64_t start, end, seq;
+	uint32_t seg, off;
+	int err = 0;
+
+	if (!log)
+		return RESP_NO_HISTORY;
+
+	if (!count)
+		count = HISTORY_DEFAULT_COUNT;
+	else if (count > HISTORY_MAX_COUNT)
+		count = HISTORY_MAX_COUNT;
+
+	pthread_mutex_lock(&log->lock);
+	end = log->next_seq;
+	if (msg->history.before_seq && msg->history.before_seq < end)
+		end = msg->history.before_seq;
+	if (msg->history.before_ms) {
+		seq = seq_at_time(log, msg->history.before_ms);
+		if (seq < end)
+			end = seq;
+	}
+	if (end < log->first_seq)
+		end = log->first_seq;
+	start = end - log->first_seq > count ? end - count : log->first_seq;
+
+	if (start < end && locate_seq(log, start, &seg, &off))
+		err = -1;
+
+	for (seq = start; seq < end && !err; ++seq) {
+		struct history_rec *rec = rec_at(log, seg, off);
+
+		if (!rec)
+			err = -1;
+		else if (conn->proto != PROTO_V2)
+			err = send_rec_v1(conn, rec);
+		else
+			err = send_rec(conn, log->segs[seg], rec);
+
+		if (!err) {
+			++sent;
+			rec_next(log, rec, &seg, &off);
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	if (err)
+		log_warn("Failed to send history to fd %d\n", conn->fd);
+
+	msg->history.count = sent;
+	msg->history.before_seq = start > log->first_seq ? start : 0;
+	msg->history.before_ms = 0;
+
+	return RESP_SUCCESS;
+}
+
+/* Move a log's first segment from memory into its file. Memory frames
+ * still point into is only freed once they're sent.
+ */
+static void attach_first(struct history_log *log, struct history_seg *first,
+			 struct history_seg *seg)
+{
+	uint8_t *mem;
+
+	pthread_mutex_lock(&log->lock);
+	memcpy(seg->base, first->base, first->used);
+	mem = first->base;
+	first->base = seg->base;
+	first->anon = false;
+	first->synced = 0;
+	log->spare_wanted = false;
+	if (atomic_load_explicit(&first->pins, memory_order_acquire)) {
+		first->stale = mem;
+		mem = NULL;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	free(mem);
+	free(seg);
+}
+
+/* Create the spare segment of a log if it'll need one soon, caller must
+ * hold prepare_lock.
+ */
+static void history_prepare(struct history_log *log)
+{
+	struct history_seg *seg, *newest;
+	uint32_t num, size;
+	bool anon;
+
+	pthread_mutex_lock(&log->lock);
+	if (!log->num_segs) {
+		pthread_mutex_unlock(&log->lock);
+		return;
+	}
+	newest = log->segs[log->num_segs - 1];
+	anon = newest->anon;
+	if (!anon && (log->spare || log->closed ||
+		      newest->used < newest->size / 2)) {
+		pthread_mutex_unlock(&log->lock);
+		return;
+	}
+	if (anon) {
+		num = newest->num;
+		size = newest->size;
+	} else {
+		num = log->next_num++;
+		size = newest->size * 2;
+		if (size > HISTORY_SEGMENT_MAX_SIZE)
+			size = HISTORY_SEGMENT_MAX_SIZE;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	/* Retried at the next interval if it fails */
+	seg = new_segment(log, num, size);
+	if (!seg)
+		return;
+
+	/* Nobody else prepares, it is still the log's newest segment */
+	if (anon) {
+		attach_first(log, newest, seg);
+		return;
+	}
+
+	pthread_mutex_lock(&log->lock);
+	if (grow_segs(log)) {
+		pthread_mutex_unlock(&log->lock);
+		free_segment(seg);
+		return;
+	}
+	log->spare = seg;
+	log->spare_wanted = false;
+	pthread_mutex_unlock(&log->lock);
+}
+
+/* msync() whatever a log appended since the last time */
+static void history_sync(struct history_log *log)
+{
+	struct {
+		uint8_t *addr;
+		size_t len;
+	} ranges[HISTORY_SYNC_BATCH];
+	long page = sysconf(_SC_PAGESIZE);
+	uint32_t n = 0, i;
+
+	pthread_mutex_lock(&log->lock);
+	for (i = log->sync_seg; i < log->num_segs && n < HISTORY_SYNC_BATCH;
+	     ++i) {
+		struct history_seg *seg = log->segs[i];
+		uint32_t from = seg->synced & ~(page - 1);
+
+		if (seg->used == seg->synced || seg->anon)
+			continue;
+
+		ranges[n].addr = seg->base + from;
+		ranges[n].len = seg->used - from;
+		++n;
+		seg->synced = seg->used;
+	}
+	/* Only the last segment is appended to from now on */
+	if (i == log->num_segs && i)
+		log->sync_seg = i - 1;
+	else
+		log->sync_seg = i;
+	pthread_mutex_unlock(&log->lock);
+
+	/* Only this thread unmaps, the ranges stay mapped until it's done */
+	for (i = 0; i < n; ++i)
+		if (msync(ranges[i].addr, ranges[i].len, MS_SYNC))
+			log_err("cannot sync history of %s: %m\n",
+				LOG_STR(log->dir));
+}
+
+/* Unmap synced segments older than the newest few that no frame pins */
+static void history_unmap(struct history_log *log)
+{
+	struct history_seg *unmapped[HISTORY_SYNC_BATCH];
+	uint8_t *bases[HISTORY_SYNC_BATCH];
+	uint8_t *stale = NULL;
+	uint32_t n = 0, i;
+
+	pthread_mutex_lock(&log->lock);
+	if (log->num_segs && log->segs[0]->stale &&
+	    !atomic_load_explicit(&log->segs[0]->pins, memory_order_acquire)) {
+		stale = log->segs[0]->stale;
+		log->segs[0]->stale = NULL;
+	}
+	for (i = 0; log->num_mapped > HISTORY_MAPPED_SEGS + 1 &&
+	     i + HISTORY_MAPPED_SEGS + 1 < log->num_segs &&
+	     n < HISTORY_SYNC_BATCH; ++i) {
+		struct history_seg *seg = log->segs[i];
+
+		if (!seg->base || seg->synced != seg->used || seg->stale ||
+		    atomic_load_explicit(&seg->pins, memory_order_acquire))
+			continue;
+
+		/* Queries map it again, at a new address, from here on */
+		unmapped[n] = seg;
+		bases[n++] = seg->base;
+		seg->base = NULL;
+		--log->num_mapped;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	free(stale);
+	for (i = 0; i < n; ++i)
+		munmap(bases[i], unmapped[i]->size);
+}
+
+/**
+ * history_release - free a closed log once nothing needs it any more
+ * @log: the log, unlinked from logs if it is freed
+ *
+ * Caller must hold prepare_lock. A log is kept until every record is synced
+ * and no frame points into any of its segments.
+ */
+static void history_release(struct history_log *log)
+{
+	struct history_log **link;
+	uint32_t i;
+
+	pthread_mutex_lock(&log->lock);
+	for (i = 0; i < log->num_segs; ++i) {
+		struct history_seg *seg = log->segs[i];
+
+		if (seg->anon || seg->synced != seg->used ||
+		    atomic_load_explicit(&seg->pins, memory_order_acquire)) {
+			pthread_mutex_unlock(&log->lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	pthread_mutex_lock(&logs_lock);
+	for (link = &logs; *link != log; link = &(*link)->next)
+		;
+	*link = log->next;
+	pthread_mutex_unlock(&logs_lock);
+
+	for (i = 0; i < log->num_segs; ++i) {
+		free(log->segs[i]->stale);
+		free_segment(log->segs[i]);
+	}
+	if (log->spare)
+		free_segment(log->spare);
+	free(log->segs);
+	free(log->idx);
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+}
+
+static void *history_sync_thread(void *arg)
+{
+	while (1) {
+		struct history_log *log;
+		struct timespec until;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += (HISTORY_SYNC_INTERVAL_MS % 1000) * 1000000;
+		until.tv_sec += HISTORY_SYNC_INTERVAL_MS / 1000 +
+				until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+
+		pthread_mutex_lock(&logs_lock);
+		while (!sync_wanted &&
+		       pthread_cond_timedwait(&sync_cond, &logs_lock, &until) !=
+		       ETIMEDOUT)
+			;
+		sync_wanted = false;
+		pthread_mutex_unlock(&logs_lock);
+
+		log = __atomic_load_n(&logs, __ATOMIC_ACQUIRE);
+		while (log) {
+			/* Only this thread unlinks, next stays valid */
+			struct history_log *next = log->next;
+
+			pthread_mutex_lock(&prepare_lock);
+			history_prepare(log);
+			pthread_mutex_unlock(&prepare_lock);
+			history_sync(log);
+			history_unmap(log);
+
+			if (__atomic_load_n(&log->closed, __ATOMIC_ACQUIRE)) {
+				pthread_mutex_lock(&prepare_lock);
+				history_release(log);
+				pthread_mutex_unlock(&prepare_lock);
+			}
+			log = next;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * history_close - stop using a channel's history
+ * @log: history of a channel that is going away, NULL if history is off
+ *
+ * Nothing may be appended to or queried from the log any more. What was
+ * appended is still written out, then the sync thread frees the log once
+ * no frame points into it.
+ */
+void history_close(struct history_log *log)
+{
+	if (!log)
+		return;
+
+	__atomic_store_n(&log->closed, true, __ATOMIC_RELEASE);
+	history_wake();
+}
+
+/**
+ * history_flush - give every log's first segment its file right away
+ *
+ * For a server handing over to its successor, which only sees what is in
+ * the segment files. Every worker must be parked.
+ */
+void history_flush(void)
+{
+	struct history_log *log;
+
+	pthread_mutex_lock(&prepare_lock);
+	log = __atomic_load_n(&logs, __ATOMIC_ACQUIRE);
+	for (; log; log = log->next)
+		history_prepare(log);
+	pthread_mutex_unlock(&prepare_lock);
+}
+
+/**
+ * history_start - keep every channel's CHATs in a directory
+ * @path: the history directory, created if it doesn't exist
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int history_start(const char *path)
+{
+	sigset_t all, old;
+	pthread_t thread;
+	int ret;
+
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		perror("mkdir");
+		return -1;
+	}
+
+	history_dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (history_dirfd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Signals are for the threads that asked for them, not the syncer */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, history_sync_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		close(history_dirfd);
+		history_dirfd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * history.h - Durable, append only chat history of the pdx irc server
+ * Author: Brett Creeley
+ *
+ * Note: Every CHAT a channel had is appended to that channel's segment files
+ *	 in the history directory, <dir>/<hex channel name>/<number>.seg.
+ *	 Appending is a memcpy() into the mapping of the newest segment. A
+ *	 background thread msync()s what was appended every
+ *	 HISTORY_SYNC_INTERVAL_MS and creates, allocates and maps the next
+ *	 segment before the newest one fills up, so a CHAT never waits for the
+ *	 file system. A CHAT that finds no segment ready anyway, because CHATs
+ *	 outran the sync thread, is dropped from the history and counted.
+ *
+ *	 A channel has no segment until its first CHAT, which starts one of
+ *	 HISTORY_SEGMENT_MIN_SIZE in memory that the sync thread then moves
+ *	 into a file. Every next segment is twice its predecessor, up to
+ *	 HISTORY_SEGMENT_MAX_SIZE.
+ *
+ *	 Besides the newest segment only HISTORY_MAPPED_SEGS segments stay
+ *	 mapped, older ones are mapped again while a HISTORY reads them. A record holds the CHAT's
+ *	 v2 frame exactly as it went on the wire, so a v2 HISTORY reply queues
+ *	 frames that point straight into the mapping and pin the segment
+ *	 until they are sent, nothing is decoded, encoded or copied.
+ *
+ *	 Every HISTORY_INDEX_INTERVAL records are added to a sparse index of
+ *	 sequence numbers and times, a query binary searches it and walks at
+ *	 most that many records from there. A channel's segments are scanned
+ *	 and its index rebuilt when the channel is created again after a
+ *	 restart.
+ */
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../common/protocol.h"
+
+#define HISTORY_SEGMENT_MIN_SIZE	(64 * 1024)
+#define HISTORY_SEGMENT_MAX_SIZE	(1024 * 1024)
+/* Sealed segments kept mapped besides the one appended to */
+#define HISTORY_MAPPED_SEGS		2
+#define HISTORY_INDEX_INTERVAL		64
+#define HISTORY_SYNC_INTERVAL_MS	200
+#define HISTORY_MAX_COUNT		256
+
+struct frame_buf;
+struct connection;
+
+/**
+ * struct history_seg - one segment file
+ * @base: start of the mapping, NULL while the segment isn't mapped
+ * @size: size of the file
+ * @used: bytes of records written
+ * @synced: bytes of records msync()ed
+ * @num: number of the segment, names the file
+ * @pins: frames pointing into the mapping, it stays mapped until they're sent
+ * @anon: base is memory of its own, the file isn't created yet
+ * @stale: memory the segment had before its file, freed once pins drops to 0
+ * @first_seq: sequence number of the segment's first record
+ */
+struct history_seg {
+	uint8_t *base;
+	uint32_t size;
+	uint32_t used;
+	uint32_t synced;
+	uint32_t num;
+	atomic_uint pins;
+	bool anon;
+	uint8_t *stale;
+	uint64_t first_seq;
+};
+
+/**
+ * struct history_idx - entry of the sparse index
+ * @seq: sequence number of the record
+ * @time_ms: wall clock time the record was appended at
+ * @seg: index of the record's segment
+ * @off: offset of the record in its segment
+ */
+struct history_idx {
+	uint64_t seq;
+	uint64_t time_ms;
+	uint32_t seg;
+	uint32_t off;
+};
+
+/**
+ * struct history_log - history of one channel
+ * @lock: serializes appends by different workers, queries and syncing
+ * @dir: name of the channel's directory, hex of the channel name
+ * @segs: every segment, oldest first, the last one is appended to
+ * @num_segs: number of segments
+ * @segs_size: number of entries allocated for segs, always more than
+ *	       num_segs while there is a spare
+ * @num_mapped: number of segs that are mapped
+ * @spare: mapped segment the sync thread prepared for when the last one of
+ *	   segs is full, NULL if there is none yet
+ * @spare_wanted: the sync thread was woken up to prepare a spare, or to
+ *		  move the first segment into a file
+ * @next_num: number the next segment file gets
+ * @idx: sparse index, ordered by seq
+ * @num_idx: number of index entries
+ * @idx_size: number of entries allocated for idx
+ * @sync_seg: oldest segment that may have records not msync()ed yet
+ * @first_seq: sequence number of the oldest record
+ * @next_seq: sequence number the next record gets, the first is 1
+ * @closed: the channel is gone, the sync thread frees the log
+ * @next: next log the sync thread looks at
+ */
+struct history_log {
+	pthread_mutex_t lock;
+	char dir[CHANNEL_NAME_MAX_LEN * 2 + 1];
+	struct history_seg **segs;
+	uint32_t num_segs;
+	uint32_t segs_size;
+	uint32_t num_mapped;
+	struct history_seg *spare;
+	bool spare_wanted;
+	uint32_t next_num;
+	struct history_idx *idx;
+	uint32_t num_idx;
+	uint32_t idx_size;
+	uint32_t sync_seg;
+	uint64_t first_seq;
+	uint64_t next_seq;
+	bool closed;
+	struct history_log *next;
+};
+
+int history_start(const char *path);
+struct history_log *history_open(const char *channel_name);
+void history_append(struct history_log *log, struct frame_buf *frame);
+uint32_t history_query(struct history_log *log, struct connection *conn,
+		       struct message *msg);
+void history_close(struct history_log *log);
+void history_flush(void);
+
+#endif /* _HISTORY_H */
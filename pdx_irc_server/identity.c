@@ -0,0 +1,465 @@
+/**
+ * identity.c - Interned user identities of the pdx irc server
+ * Author: Brett Creeley
+ */
+
+#include "identity.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <crypt.h>
+#include "../common/hash/hash_table.h"
+#include "../common/pool/pool.h"
+#include "../common/debug/log.h"
+#include "handover.h"
+
+#define IDENTITIES_PER_SLAB	256
+
+/* Every identity keyed by name, only LOGIN and logout take the lock for
+ * writing. DIRECT messages take it for reading, channel messages not at all.
+ */
+static struct hash_table identity_table;
+static pthread_rwlock_t identity_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t num_identities;
+static struct pool identity_pool;
+
+/* LOGINs waiting for a hashing thread, see identity_login_start() */
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_cond = PTHREAD_COND_INITIALIZER;
+static struct identity_login_req *hash_head;
+static struct identity_login_req **hash_tail = &hash_head;
+
+static void *hash_thread(void *arg);
+
+/**
+ * identity_table_init - set up the identity table and its hashing threads
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int identity_table_init(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+	int i, ret;
+
+	if (hash_table_init(&identity_table, offsetof(struct identity, name),
+			    USER_NAME_MAX_LEN))
+		return -1;
+
+	if (pool_init(&identity_pool, "identity", sizeof(struct identity),
+		      IDENTITIES_PER_SLAB, false))
+		return -1;
+
+	/* Hashing threads never handle signals */
+	sigfillset(&all);
+	for (i = 0; i < IDENTITY_HASH_THREADS; ++i) {
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		ret = pthread_create(&thread, NULL, hash_thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
+
+void identity_print_pool_stats(void)
+{
+	pool_print_stats(&identity_pool);
+}
+
+/**
+ * hash_password - crypt(3) a password
+ * @pw: zero terminated password
+ * @setting: hash whose method and salt to use, NULL for a new random salt
+ * @hash: IDENTITY_HASH_LEN bytes the zero padded hash is written to
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int hash_password(const char *pw, const char *setting, char *hash)
+{
+	char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+	struct crypt_data data;
+	const char *out;
+
+	if (!setting) {
+		setting = crypt_gensalt_rn(IDENTITY_HASH_PREFIX, 0, NULL, 0,
+					   salt, sizeof(salt));
+		if (!setting) {
+			log_err("cannot generate a password salt: %m\n");
+			return -1;
+		}
+	}
+
+	memset(&data, 0, sizeof(data));
+	out = crypt_rn(pw, setting, &data, sizeof(data));
+	if (out && strlen(out) < IDENTITY_HASH_LEN) {
+		memset(hash, 0, IDENTITY_HASH_LEN);
+		strcpy(hash, out);
+	} else {
+		log_err("cannot hash password: %m\n");
+		out = NULL;
+	}
+	/* The work area holds the password's intermediate state */
+	explicit_bzero(&data, sizeof(data));
+
+	return out ? 0 : -1;
+}
+
+/* Compare two hashes in time that doesn't depend on where they differ */
+static bool hash_equal(const char *a, const char *b)
+{
+	unsigned char diff = 0;
+	int i;
+
+	for (i = 0; i < IDENTITY_HASH_LEN; ++i)
+		diff |= a[i] ^ b[i];
+
+	return diff == 0;
+}
+
+/* Hashing thread, LOGINs are hashed in the order they were queued */
+static void *hash_thread(void *arg)
+{
+	struct identity_login_req *req;
+
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&hash_lock);
+		while (!hash_head)
+			pthread_cond_wait(&hash_cond, &hash_lock);
+		req = hash_head;
+		hash_head = req->next;
+		if (!hash_head)
+			hash_tail = &hash_head;
+		pthread_mutex_unlock(&hash_lock);
+
+		/* A new unclaimed name has nothing to hash */
+		memset(req->hash, 0, IDENTITY_HASH_LEN);
+		req->hashed = !req->setting[0] && !req->pw[0];
+		if (!req->hashed)
+			req->hashed = !hash_password(req->pw,
+						     req->setting[0] ?
+						     req->setting : NULL,
+						     req->hash);
+		req->done(req);
+	}
+
+	return NULL;
+}
+
+/* Look up the name's salt and queue req, returns -1 if the name is online */
+static int login_queue(struct identity_login_req *req)
+{
+	struct identity *ident;
+	bool online;
+
+	memset(req->setting, 0, IDENTITY_HASH_LEN);
+	pthread_rwlock_rdlock(&identity_lock);
+	ident = hash_table_lookup(&identity_table, req->name);
+	online = ident && ident->fd >= 0;
+	if (ident)
+		memcpy(req->setting, ident->hash, IDENTITY_HASH_LEN);
+	pthread_rwlock_unlock(&identity_lock);
+	if (online)
+		return -1;
+
+	req->next = NULL;
+	pthread_mutex_lock(&hash_lock);
+	*hash_tail = req;
+	hash_tail = &req->next;
+	pthread_cond_signal(&hash_cond);
+	pthread_mutex_unlock(&hash_lock);
+
+	return 0;
+}
+
+/**
+ * identity_login_start - start logging a connection in as a user
+ * @req: request to fill in, untouched by the caller until it is done
+ * @name: user name, at most USER_NAME_MAX_LEN bytes
+ * @password: password, at most PW_MAX_LEN bytes
+ * @fd: socket of the connection logging in
+ * @done: called by a hashing thread once the password is hashed
+ *
+ * The first login of a name interns it and, unless password is empty,
+ * claims it with password. Later logins need the same password and fail
+ * while another connection is still logged in as the name. Once done is
+ * called the caller finishes the login with identity_login_finish(), or
+ * drops it with identity_login_drop().
+ *
+ * Returns 0 if the password is being hashed, -1 if the login is refused
+ */
+int identity_login_start(struct identity_login_req *req, const char *name,
+			 const char *password, int fd,
+			 void (*done)(struct identity_login_req *req))
+{
+	/* Zero pad so the whole fixed length fields can be compared */
+	memset(req->name, 0, USER_NAME_MAX_LEN);
+	memset(req->pw, 0, sizeof(req->pw));
+	strncpy(req->name, name, USER_NAME_MAX_LEN);
+	strncpy(req->pw, password, PW_MAX_LEN);
+	req->fd = fd;
+	req->done = done;
+	if (!req->name[0] || login_queue(req)) {
+		identity_login_drop(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * identity_login_finish - log in with a password that was hashed
+ * @req: request whose done callback was called
+ * @ident: set to the user's identity, NULL if the login is refused
+ *
+ * A name claimed, freed or interned by someone else while hashing changed
+ * its salt, the password is queued to be hashed again and done is called
+ * once more.
+ *
+ * Returns 0 once the login is finished, 1 if it was queued again
+ */
+int identity_login_finish(struct identity_login_req *req,
+			  struct identity **ident)
+{
+	struct identity *i = NULL;
+
+	if (!req->hashed)
+		goto out;
+
+	pthread_rwlock_wrlock(&identity_lock);
+	i = hash_table_lookup(&identity_table, req->name);
+	if (i && i->fd >= 0) {
+		i = NULL;
+		goto unlock;
+	}
+
+	if (i ? memcmp(i->hash, req->setting, IDENTITY_HASH_LEN) :
+		req->setting[0] != '\0') {
+		pthread_rwlock_unlock(&identity_lock);
+		if (!login_queue(req))
+			return 1;
+		i = NULL;
+		goto out;
+	}
+
+	if (i) {
+		if (!i->claimed) {
+			/* Unclaimed after a handover, first login takes it */
+			memcpy(i->hash, req->hash, IDENTITY_HASH_LEN);
+			i->claimed = req->hash[0] != '\0';
+		} else if (!hash_equal(i->hash, req->hash)) {
+			i = NULL;
+			goto unlock;
+		}
+		i->fd = req->fd;
+		goto unlock;
+	}
+
+	i = pool_alloc(&identity_pool);
+	if (!i)
+		goto unlock;
+
+	memcpy(i->name, req->name, USER_NAME_MAX_LEN);
+	memcpy(i->hash, req->hash, IDENTITY_HASH_LEN);
+	i->claimed = req->hash[0] != '\0';
+	i->interned = true;
+	i->fd = req->fd;
+	if (hash_table_insert(&identity_table, i)) {
+		pool_free(&identity_pool, i);
+		i = NULL;
+		goto unlock;
+	}
+	i->id = num_identities++;
+
+unlock:
+	pthread_rwlock_unlock(&identity_lock);
+out:
+	identity_login_drop(req);
+	*ident = i;
+
+	return 0;
+}
+
+/**
+ * identity_login_drop - forget a login that was hashed
+ * @req: request whose done callback was called
+ *
+ * For a connection that closed while its password was being hashed.
+ */
+void identity_login_drop(struct identity_login_req *req)
+{
+	explicit_bzero(req->pw, sizeof(req->pw));
+}
+
+/**
+ * identity_guest - log a connection in as a user without a password
+ * @name: user name, at most USER_NAME_MAX_LEN bytes
+ * @fd: socket of the connection, which never sent LOGIN
+ *
+ * Never refused and never hashes anything. A name nobody has is interned
+ * unclaimed, just like a LOGIN with an empty password. Otherwise
+ * the connection gets an identity of its own that isn't in the table.
+ *
+ * Returns the identity or NULL if name is empty or memory ran out
+ */
+struct identity *identity_guest(const char *name, int fd)
+{
+	char key[USER_NAME_MAX_LEN] = { 0 };
+	struct identity *ident, *holder;
+
+	strncpy(key, name, USER_NAME_MAX_LEN);
+	if (!key[0])
+		return NULL;
+
+	pthread_rwlock_wrlock(&identity_lock);
+	ident = pool_alloc(&identity_pool);
+	if (!ident)
+		goto unlock;
+
+	memcpy(ident->name, key, USER_NAME_MAX_LEN);
+	memset(ident->hash, 0, IDENTITY_HASH_LEN);
+	ident->claimed = false;
+	ident->fd = fd;
+
+	holder = hash_table_lookup(&identity_table, key);
+	if (holder) {
+		ident->interned = false;
+		ident->id = holder->id;
+		goto unlock;
+	}
+
+	ident->interned = true;
+	if (hash_table_insert(&identity_table, ident)) {
+		pool_free(&identity_pool, ident);
+		ident = NULL;
+		goto unlock;
+	}
+	ident->id = num_identities++;
+
+unlock:
+	pthread_rwlock_unlock(&identity_lock);
+
+	return ident;
+}
+
+/**
+ * identity_logout - log a connection out
+ * @ident: identity the connection is logged in as, NULL if none
+ *
+ * A claimed identity stays interned, its name can be logged in as again. An
+ * unclaimed one is freed, the caller must have dropped every other pointer
+ * to it, i.e. its connection left all channels and has no LIST in progress.
+ */
+void identity_logout(struct identity *ident)
+{
+	if (!ident)
+		return;
+
+	pthread_rwlock_wrlock(&identity_lock);
+	if (ident->claimed) {
+		ident->fd = -1;
+	} else {
+		if (ident->interned)
+			hash_table_remove(&identity_table, ident->name);
+		pool_free(&identity_pool, ident);
+	}
+	pthread_rwlock_unlock(&identity_lock);
+}
+
+/**
+ * identity_read_lock - keep every identity's fd from changing
+ *
+ * A connection logs out before its socket is closed, so while this is held
+ * the fd of an identity found online is that user's open connection.
+ */
+void identity_read_lock(void)
+{
+	pthread_rwlock_rdlock(&identity_lock);
+}
+
+void identity_read_unlock(void)
+{
+	pthread_rwlock_unlock(&identity_lock);
+}
+
+/**
+ * identity_lookup - find the identity of a user name
+ * @name: user name, at most USER_NAME_MAX_LEN bytes
+ *
+ * Caller must hold identity_read_lock().
+ *
+ * Returns the identity or NULL if the name isn't interned
+ */
+struct identity *identity_lookup(const char *name)
+{
+	char key[USER_NAME_MAX_LEN] = { 0 };
+
+	strncpy(key, name, USER_NAME_MAX_LEN);
+
+	return hash_table_lookup(&identity_table, key);
+}
+
+/**
+ * identity_handover_save - serialize every identity for the server taking over
+ * @h: handover being written, every worker is parked
+ *
+ * Who is online isn't saved, the connections claim their identities again.
+ */
+void identity_handover_save(struct handover *h)
+{
+	struct identity *ident;
+	uint32_t iter;
+
+	handover_put_u32(h, hash_table_count(&identity_table));
+	hash_table_for_each(&identity_table, iter, ident) {
+		handover_put_u32(h, ident->id);
+		handover_put(h, ident->name, USER_NAME_MAX_LEN);
+		handover_put(h, ident->hash, IDENTITY_HASH_LEN);
+	}
+}
+
+/**
+ * identity_handover_restore - intern the identities of the server handing over
+ * @h: handover being read
+ *
+ * Identities keep their ids. Called before any worker is started.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int identity_handover_restore(struct handover *h)
+{
+	uint32_t i, count = handover_get_u32(h);
+
+	for (i = 0; i < count && !h->err; ++i) {
+		struct identity *ident;
+
+		ident = pool_alloc(&identity_pool);
+		if (!ident)
+			return -1;
+
+		ident->id = handover_get_u32(h);
+		handover_get(h, ident->name, USER_NAME_MAX_LEN);
+		handover_get(h, ident->hash, IDENTITY_HASH_LEN);
+		ident->claimed = ident->hash[0] != '\0';
+		ident->interned = true;
+		ident->fd = -1;
+		if (h->err || hash_table_insert(&identity_table, ident)) {
+			pool_free(&identity_pool, ident);
+			return -1;
+		}
+
+		if (ident->id >= num_identities)
+			num_identities = ident->id + 1;
+	}
+
+	return h->err;
+}
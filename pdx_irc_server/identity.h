@@ -0,0 +1,107 @@
+/**
+ * identity.h - Interned user identities of the pdx irc server
+ * Author: Brett Creeley
+ *
+ * Note: Every user name logged in is interned once into a struct identity,
+ *	 so a session, a channel membership or a LIST in progress can all
+ *	 point at the same name instead of copying it. A name is claimed by
+ *	 the password of its first LOGIN and only one connection can be
+ *	 logged in as a name at a time.
+ *
+ *	 Only a salted crypt(3) hash of that password is kept, never the
+ *	 password itself. A LOGIN hashes the password it got with the stored
+ *	 salt and compares the whole hash in constant time. Hashing is slow
+ *	 on purpose, so it is done by IDENTITY_HASH_THREADS threads of its
+ *	 own, never by a worker and never with the table's lock held. The
+ *	 worker is handed the hash back and finishes the LOGIN, see
+ *	 identity_login_start(). LOGIN still sends the password in the
+ *	 clear, so whoever can read the traffic can log in as anyone.
+ *
+ *	 A name used without a password, by a client that never sends LOGIN,
+ *	 isn't claimed. Its identity is freed when its connection logs out,
+ *	 so anyone can use the name afterwards and unclaimed names don't pile
+ *	 up in memory. Such a guest is never refused: if the name is already
+ *	 interned it gets an identity of its own outside the table, so it
+ *	 sends as the name but isn't the one DIRECT messages to it reach.
+ *
+ *	 The identity table doubles as the directory of who is online, a
+ *	 DIRECT message finds its recipient's connection with one lookup.
+ */
+#ifndef _IDENTITY_H
+#define _IDENTITY_H
+
+#include "../common/protocol.h"
+#include <stdbool.h>
+
+struct handover;
+
+/* sha512crypt, "$6$" with its default rounds and a 16 character salt */
+#define IDENTITY_HASH_PREFIX	"$6$"
+/* A sha512crypt hash is 106 characters */
+#define IDENTITY_HASH_LEN	128
+/* Threads hashing LOGIN passwords, each LOGIN takes a few milliseconds */
+#define IDENTITY_HASH_THREADS	2
+
+/**
+ * struct identity - an interned user name
+ * @name: zero padded user name, never changes
+ * @id: number of identities interned before this one, never reused, a guest
+ *      outside the table shares the id of the name's identity
+ * @fd: socket of the connection logged in as this user, -1 if none
+ * @hash: crypt(3) hash of the password the name was claimed with, including
+ *	  its salt, empty if the name isn't claimed
+ * @claimed: the name was logged in with a password and stays interned, an
+ *	     unclaimed identity is freed by identity_logout()
+ * @interned: in the identity table, false for a guest whose name was taken
+ *
+ * fd and hash are protected by the identity table's lock, see
+ * identity_read_lock().
+ */
+struct identity {
+	char name[USER_NAME_MAX_LEN];
+	uint32_t id;
+	int fd;
+	char hash[IDENTITY_HASH_LEN];
+	bool claimed;
+	bool interned;
+};
+
+/**
+ * struct identity_login_req - a LOGIN whose password is being hashed
+ * @name: zero padded user name
+ * @pw: zero terminated password, wiped once the login is finished
+ * @fd: socket of the connection logging in
+ * @setting: hash the name had when it was queued, empty if it had none
+ * @hash: pw hashed with setting's salt, or a new one if setting is empty
+ * @hashed: hash is valid, false if hashing failed
+ * @done: called by the hashing thread once hash is set, must not block
+ * @next: next request waiting for a hashing thread
+ */
+struct identity_login_req {
+	char name[USER_NAME_MAX_LEN];
+	char pw[PW_MAX_LEN + 1];
+	int fd;
+	char setting[IDENTITY_HASH_LEN];
+	char hash[IDENTITY_HASH_LEN];
+	bool hashed;
+	void (*done)(struct identity_login_req *req);
+	struct identity_login_req *next;
+};
+
+int identity_table_init(void);
+void identity_print_pool_stats(void);
+int identity_login_start(struct identity_login_req *req, const char *name,
+			 const char *password, int fd,
+			 void (*done)(struct identity_login_req *req));
+int identity_login_finish(struct identity_login_req *req,
+			  struct identity **ident);
+void identity_login_drop(struct identity_login_req *req);
+struct identity *identity_guest(const char *name, int fd);
+void identity_logout(struct identity *ident);
+void identity_read_lock(void);
+void identity_read_unlock(void);
+struct identity *identity_lookup(const char *name);
+void identity_handover_save(struct handover *h);
+int identity_handover_restore(struct handover *h);
+
+#endif /* _IDENTITY_H */
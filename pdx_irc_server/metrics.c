@@ -0,0 +1,513 @@
+/**
+ * metrics.c - Live counters and histograms of the pdx irc server
+ * Author: Brett Creeley
+ *
+ * Note: The metrics are served in the Prometheus text exposition format over
+ *	 HTTP on a Unix socket, e.g.
+ *	 curl --unix-socket /tmp/pdx_irc.sock http://localhost/metrics
+ *	 Every request gets the metrics whatever its path.
+ */
+
+#include "metrics.h"
+#include "backlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "../common/debug/debug.h"
+
+/* How long a scraper has to send its request before it is answered anyway */
+#define METRICS_REQ_TIMEOUT_MS	1000
+#define METRICS_REQ_MAX_LEN	4096
+
+__thread struct metrics *thread_metrics;
+
+/* Every registered thread's metrics, only locked to register and to scrape */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics **registry;
+static uint32_t num_registered;
+static uint32_t registry_size;
+
+/* Asked for the channel backlogs at every scrape, NULL if nobody is */
+static metrics_backlogs_fn backlogs_fn;
+
+static const char *handler_names[METRICS_NUM_HANDLERS] = {
+	[METRICS_HANDLER_HELLO] = "hello",
+	[METRICS_HANDLER_LOGIN] = "login",
+	[METRICS_HANDLER_JOIN] = "join",
+	[METRICS_HANDLER_LEAVE] = "leave",
+	[METRICS_HANDLER_CHAT] = "chat",
+	[METRICS_HANDLER_DIRECT] = "direct",
+	[METRICS_HANDLER_LIST] = "list",
+	[METRICS_HANDLER_HISTORY] = "history",
+};
+
+/**
+ * metrics_register - give the calling thread its own metrics
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int metrics_register(void)
+{
+	struct metrics *m;
+	int ret = 0;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		perror("calloc");
+		return -1;
+	}
+
+	pthread_mutex_lock(&registry_lock);
+	if (num_registered == registry_size) {
+		uint32_t size = registry_size ? registry_size * 2 : 16;
+		struct metrics **grown;
+
+		grown = realloc(registry, size * sizeof(*grown));
+		if (!grown) {
+			perror("realloc");
+			ret = -1;
+			goto unlock;
+		}
+
+		registry = grown;
+		registry_size = size;
+	}
+
+	registry[num_registered++] = m;
+	thread_metrics = m;
+
+unlock:
+	pthread_mutex_unlock(&registry_lock);
+	if (ret)
+		free(m);
+
+	return ret;
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void hist_sum(struct metrics_hist *total, const struct metrics_hist *h)
+{
+	int i;
+
+	total->count += load(&h->count);
+	total->sum += load(&h->sum);
+	for (i = 0; i < METRICS_HIST_BUCKETS; ++i)
+		total->buckets[i] += load(&h->buckets[i]);
+}
+
+/* Sum what every thread recorded so far */
+static void metrics_snapshot(struct metrics *total)
+{
+	uint32_t i;
+	int j;
+
+	memset(total, 0, sizeof(*total));
+
+	pthread_mutex_lock(&registry_lock);
+	for (i = 0; i < num_registered; ++i) {
+		struct metrics *m = registry[i];
+
+		for (j = 0; j <= MAX_MSG_NUM; ++j)
+			total->msgs[j] += load(&m->msgs[j]);
+		total->bytes_in += load(&m->bytes_in);
+		total->bytes_out += load(&m->bytes_out);
+		total->conns_opened += load(&m->conns_opened);
+		total->conns_closed += load(&m->conns_closed);
+		total->channels_created += load(&m->channels_created);
+		/* One thread's drops can be another's adds, the sum wraps
+		 * back to what is actually held.
+		 */
+		total->backlog_frames += load(&m->backlog_frames);
+		total->backlog_bytes += load(&m->backlog_bytes);
+		total->backlog_replayed += load(&m->backlog_replayed);
+		total->history_appended += load(&m->history_appended);
+		total->history_dropped += load(&m->history_dropped);
+		hist_sum(&total->fanout, &m->fanout);
+		for (j = 0; j < METRICS_NUM_HANDLERS; ++j)
+			hist_sum(&total->latency[j], &m->latency[j]);
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void print_header(FILE *f, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * print_hist - print one histogram
+ * @f: where to print to
+ * @name: metric name
+ * @label: label pair identifying this histogram, "" for none
+ * @h: the histogram
+ * @scale: bucket bounds and the sum are divided by this, e.g. ns to seconds
+ *
+ * Prometheus buckets are cumulative, every bucket counts the values of the
+ * buckets below it as well.
+ */
+static void print_hist(FILE *f, const char *name, const char *label,
+		       const struct metrics_hist *h, double scale)
+{
+	const char *sep = label[0] ? "," : "";
+	uint64_t cumulative = 0;
+	int i;
+
+	for (i = 0; i < METRICS_HIST_BUCKETS - 1; ++i) {
+		cumulative += h->buckets[i];
+		fprintf(f, "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n", name,
+			label, sep, (double)(1ULL << i) / scale, cumulative);
+	}
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, label,
+		sep, h->count);
+
+	if (label[0]) {
+		fprintf(f, "%s_sum{%s} %.9g\n", name, label, h->sum / scale);
+		fprintf(f, "%s_count{%s} %" PRIu64 "\n", name, label, h->count);
+	} else {
+		fprintf(f, "%s_sum %.9g\n", name, h->sum / scale);
+		fprintf(f, "%s_count %" PRIu64 "\n", name, h->count);
+	}
+}
+
+/**
+ * metrics_backlogs_add - account for one channel's backlog
+ * @b: backlogs being filled in by a metrics_backlogs_fn
+ * @name: channel name, at most CHANNEL_NAME_MAX_LEN bytes
+ * @frames: CHAT frames the channel's backlog holds
+ * @bytes: bytes of those frames
+ *
+ * Keeps the channel if its backlog is among the METRICS_TOP_BACKLOGS fullest.
+ */
+void metrics_backlogs_add(struct metrics_backlogs *b, const char *name,
+			  uint32_t frames, uint32_t bytes)
+{
+	uint32_t i;
+
+	if (frames > b->max_frames)
+		b->max_frames = frames;
+	if (!bytes)
+		return;
+
+	/* Insertion sort, the array is short and stays sorted */
+	i = b->num_top < METRICS_TOP_BACKLOGS ? b->num_top++ :
+						METRICS_TOP_BACKLOGS;
+	for (; i && b->top[i - 1].bytes < bytes; --i)
+		if (i < METRICS_TOP_BACKLOGS)
+			b->top[i] = b->top[i - 1];
+	if (i == METRICS_TOP_BACKLOGS)
+		return;
+
+	memset(b->top[i].name, 0, sizeof(b->top[i].name));
+	strncpy(b->top[i].name, name, CHANNEL_NAME_MAX_LEN);
+	b->top[i].frames = frames;
+	b->top[i].bytes = bytes;
+}
+
+/* Print a label value, escaped as the exposition format wants it */
+static void print_label_value(FILE *f, const char *val)
+{
+	for (; *val; ++val) {
+		if (*val == '\\' || *val == '"')
+			fprintf(f, "\\%c", *val);
+		else if (*val == '\n')
+			fputs("\\n", f);
+		else if ((unsigned char)*val < ' ')
+			fputc('?', f);
+		else
+			fputc(*val, f);
+	}
+}
+
+static void metrics_print_backlogs(FILE *f)
+{
+	struct metrics_backlogs b = { 0 };
+	uint32_t i;
+
+	if (!backlogs_fn)
+		return;
+	backlogs_fn(&b);
+
+	print_header(f, "pdx_irc_backlog_channel_largest_bytes", "gauge",
+		     "Bytes held by the fullest channel backlog.");
+	fprintf(f, "pdx_irc_backlog_channel_largest_bytes %u\n",
+		b.num_top ? b.top[0].bytes : 0);
+
+	print_header(f, "pdx_irc_backlog_channel_largest_frames", "gauge",
+		     "Most CHAT frames held by one channel backlog.");
+	fprintf(f, "pdx_irc_backlog_channel_largest_frames %u\n",
+		b.max_frames);
+
+	print_header(f, "pdx_irc_channel_backlog_bytes", "gauge",
+		     "Bytes held by the fullest channels' backlogs.");
+	for (i = 0; i < b.num_top; ++i) {
+		fputs("pdx_irc_channel_backlog_bytes{channel=\"", f);
+		print_label_value(f, b.top[i].name);
+		fprintf(f, "\"} %u\n", b.top[i].bytes);
+	}
+
+	print_header(f, "pdx_irc_channel_backlog_frames", "gauge",
+		     "CHAT frames held by the fullest channels' backlogs.");
+	for (i = 0; i < b.num_top; ++i) {
+		fputs("pdx_irc_channel_backlog_frames{channel=\"", f);
+		print_label_value(f, b.top[i].name);
+		fprintf(f, "\"} %u\n", b.top[i].frames);
+	}
+}
+
+static void metrics_print(FILE *f, const struct metrics *m)
+{
+	uint64_t unknown = 0;
+	char label[64];
+	int i;
+
+	print_header(f, "pdx_irc_messages_received_total", "counter",
+		     "Messages received from clients by type.");
+	for (i = 0; i <= MAX_MSG_NUM; ++i) {
+		const char *type = msg_type_to_str(i);
+
+		/* Type bytes the server doesn't know are only counted together */
+		if (!strcmp(type, "MSG_TYPE_UNKNOWN")) {
+			unknown += m->msgs[i];
+			continue;
+		}
+
+		fprintf(f, "pdx_irc_messages_received_total{type=\"%s\"} %"
+			PRIu64 "\n", type, m->msgs[i]);
+	}
+	fprintf(f, "pdx_irc_messages_received_total{type=\"MSG_TYPE_UNKNOWN\"} %"
+		PRIu64 "\n", unknown);
+
+	print_header(f, "pdx_irc_received_bytes_total", "counter",
+		     "Bytes received from clients.");
+	fprintf(f, "pdx_irc_received_bytes_total %" PRIu64 "\n", m->bytes_in);
+
+	print_header(f, "pdx_irc_sent_bytes_total", "counter",
+		     "Bytes sent to clients.");
+	fprintf(f, "pdx_irc_sent_bytes_total %" PRIu64 "\n", m->bytes_out);
+
+	print_header(f, "pdx_irc_connections_accepted_total", "counter",
+		     "Client connections accepted.");
+	fprintf(f, "pdx_irc_connections_accepted_total %" PRIu64 "\n",
+		m->conns_opened);
+
+	print_header(f, "pdx_irc_connections", "gauge",
+		     "Client connections currently open.");
+	fprintf(f, "pdx_irc_connections %" PRIu64 "\n",
+		m->conns_opened - m->conns_closed);
+
+	/* Channels are never deleted */
+	print_header(f, "pdx_irc_channels", "gauge", "Channels that exist.");
+	fprintf(f, "pdx_irc_channels %" PRIu64 "\n", m->channels_created);
+
+	print_header(f, "pdx_irc_backlog_frames", "gauge",
+		     "CHAT frames held by channel backlogs.");
+	fprintf(f, "pdx_irc_backlog_frames %" PRIu64 "\n", m->backlog_frames);
+
+	print_header(f, "pdx_irc_backlog_bytes", "gauge",
+		     "Bytes of the CHAT frames held by channel backlogs.");
+	fprintf(f, "pdx_irc_backlog_bytes %" PRIu64 "\n", m->backlog_bytes);
+
+	print_header(f, "pdx_irc_backlog_channel_max_bytes", "gauge",
+		     "Most bytes of CHAT frames a channel's backlog holds.");
+	fprintf(f, "pdx_irc_backlog_channel_max_bytes %d\n", BACKLOG_MAX_BYTES);
+
+	print_header(f, "pdx_irc_backlog_channel_max_frames", "gauge",
+		     "Most CHAT frames a channel's backlog holds.");
+	fprintf(f, "pdx_irc_backlog_channel_max_frames %d\n", BACKLOG_MAX_MSGS);
+
+	print_header(f, "pdx_irc_backlog_replayed_total", "counter",
+		     "CHAT frames replayed to members that joined.");
+	fprintf(f, "pdx_irc_backlog_replayed_total %" PRIu64 "\n",
+		m->backlog_replayed);
+
+	metrics_print_backlogs(f);
+
+	print_header(f, "pdx_irc_history_appended_total", "counter",
+		     "CHATs appended to the durable history.");
+	fprintf(f, "pdx_irc_history_appended_total %" PRIu64 "\n",
+		m->history_appended);
+
+	print_header(f, "pdx_irc_history_dropped_total", "counter",
+		     "CHATs missing from the history, no segment was ready.");
+	fprintf(f, "pdx_irc_history_dropped_total %" PRIu64 "\n",
+		m->history_dropped);
+
+	print_header(f, "pdx_irc_chat_fanout", "histogram",
+		     "Members each chat message was queued to.");
+	print_hist(f, "pdx_irc_chat_fanout", "", &m->fanout, 1);
+
+	print_header(f, "pdx_irc_handler_latency_seconds", "histogram",
+		     "Time spent handling a message, channel lock wait included.");
+	for (i = 0; i < METRICS_NUM_HANDLERS; ++i) {
+		snprintf(label, sizeof(label), "handler=\"%s\"",
+			 handler_names[i]);
+		print_hist(f, "pdx_irc_handler_latency_seconds", label,
+			   &m->latency[i], 1e9);
+	}
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += sent;
+		len -= sent;
+	}
+
+	return 0;
+}
+
+/* Wait for the end of the request's headers, then answer with the metrics */
+static void metrics_serve(int fd)
+{
+	struct timeval tv = {
+		.tv_sec = METRICS_REQ_TIMEOUT_MS / 1000,
+		.tv_usec = (METRICS_REQ_TIMEOUT_MS % 1000) * 1000,
+	};
+	char req[METRICS_REQ_MAX_LEN + 1];
+	struct metrics *m;
+	char header[128];
+	size_t len = 0;
+	char *body;
+	FILE *f;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		perror("setsockopt");
+
+	while (len < METRICS_REQ_MAX_LEN) {
+		ssize_t bytes = recv(fd, req + len, METRICS_REQ_MAX_LEN - len, 0);
+
+		if (bytes <= 0)
+			break;
+
+		len += bytes;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	m = malloc(sizeof(*m));
+	if (!m) {
+		perror("malloc");
+		return;
+	}
+
+	f = open_memstream(&body, &len);
+	if (!f) {
+		perror("open_memstream");
+		free(m);
+		return;
+	}
+
+	metrics_snapshot(m);
+	metrics_print(f, m);
+	fclose(f);
+	free(m);
+
+	snprintf(header, sizeof(header),
+		 "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zu\r\n\r\n", len);
+	if (!send_all(fd, header, strlen(header)))
+		send_all(fd, body, len);
+
+	free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+	int listenfd = (intptr_t)arg;
+
+	while (1) {
+		int fd = accept(listenfd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	close(listenfd);
+
+	return NULL;
+}
+
+/**
+ * metrics_start - serve the metrics on a Unix socket
+ * @path: path of the socket, an existing file there is replaced
+ * @backlogs: reports the channel backlogs at every scrape, may be NULL
+ *
+ * Scrapes are answered by a thread of their own, one at a time.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+int metrics_start(const char *path, metrics_backlogs_fn backlogs)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	pthread_t thread;
+	int listenfd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("[%s:%d] metrics socket path %s is too long\n", __func__,
+		       __LINE__, path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	backlogs_fn = backlogs;
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenfd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* A socket file left behind by a previous server would fail bind() */
+	unlink(path);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		goto err_closefd;
+	}
+
+	if (listen(listenfd, 8)) {
+		perror("listen");
+		goto err_closefd;
+	}
+
+	if (pthread_create(&thread, NULL, metrics_thread,
+			   (void *)(intptr_t)listenfd)) {
+		perror("pthread_create");
+		goto err_closefd;
+	}
+	pthread_detach(thread);
+
+	return 0;
+
+err_closefd:
+	close(listenfd);
+	return -1;
+}
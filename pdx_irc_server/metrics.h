@@ -0,0 +1,147 @@
+/**
+ * metrics.h - Live counters and histograms of the pdx irc server
+ * Author: Brett Creeley
+ *
+ * Note: Every thread that records anything registers its own struct metrics
+ *	 and is the only one ever writing to it, so recording is a plain load
+ *	 and store without any lock or atomic read-modify-write. The admin
+ *	 thread sums every thread's metrics when it is scraped, a scrape never
+ *	 stops an event loop.
+ */
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include "../common/protocol.h"
+#include <stdint.h>
+#include <time.h>
+
+/* Bucket i of a histogram counts values <= 2^i, the last one everything */
+#define METRICS_HIST_BUCKETS	28
+
+/**
+ * struct metrics_hist - a histogram with power of 2 buckets
+ * @count: number of values recorded
+ * @sum: sum of every value recorded
+ * @buckets: number of values recorded in each bucket, not cumulative
+ */
+struct metrics_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/* Handlers whose latency is recorded, including any channel table lock wait */
+enum metrics_handler {
+	METRICS_HANDLER_HELLO,
+	METRICS_HANDLER_LOGIN,
+	METRICS_HANDLER_JOIN,
+	METRICS_HANDLER_LEAVE,
+	METRICS_HANDLER_CHAT,
+	METRICS_HANDLER_DIRECT,
+	METRICS_HANDLER_LIST,
+	METRICS_HANDLER_HISTORY,
+	METRICS_NUM_HANDLERS,
+};
+
+/**
+ * struct metrics - what one thread recorded
+ * @msgs: messages received, indexed by enum message_type
+ * @bytes_in: bytes received from clients
+ * @bytes_out: bytes sent to clients
+ * @conns_opened: connections accepted
+ * @conns_closed: connections closed
+ * @channels_created: channels created
+ * @backlog_frames: CHAT frames held by backlogs, added minus dropped
+ * @backlog_bytes: bytes of those frames, added minus dropped
+ * @backlog_replayed: frames replayed to new members
+ * @history_appended: CHATs appended to the history log
+ * @history_dropped: CHATs not appended because no segment was ready
+ * @fanout: members each chat message was queued to
+ * @latency: nanoseconds spent in each handler
+ */
+struct metrics {
+	uint64_t msgs[MAX_MSG_NUM + 1];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t conns_opened;
+	uint64_t conns_closed;
+	uint64_t channels_created;
+	uint64_t backlog_frames;
+	uint64_t backlog_bytes;
+	uint64_t backlog_replayed;
+	uint64_t history_appended;
+	uint64_t history_dropped;
+	struct metrics_hist fanout;
+	struct metrics_hist latency[METRICS_NUM_HANDLERS];
+};
+
+/* Channels whose backlog is reported on its own, the fullest ones */
+#define METRICS_TOP_BACKLOGS	10
+
+/**
+ * struct metrics_backlog - backlog usage of one channel
+ * @name: zero terminated channel name
+ * @frames: CHAT frames its backlog holds
+ * @bytes: bytes of those frames
+ */
+struct metrics_backlog {
+	char name[CHANNEL_NAME_MAX_LEN + 1];
+	uint32_t frames;
+	uint32_t bytes;
+};
+
+/**
+ * struct metrics_backlogs - how full the channel backlogs are at a scrape
+ * @num_top: entries of top used
+ * @top: the channels whose backlogs hold the most bytes, fullest first
+ * @max_frames: most frames any one channel's backlog holds
+ */
+struct metrics_backlogs {
+	uint32_t num_top;
+	struct metrics_backlog top[METRICS_TOP_BACKLOGS];
+	uint32_t max_frames;
+};
+
+/* Fills in the backlog usage of every channel, called by the admin thread */
+typedef void (*metrics_backlogs_fn)(struct metrics_backlogs *b);
+
+/* The calling thread's metrics, NULL until metrics_register() */
+extern __thread struct metrics *thread_metrics;
+
+int metrics_register(void);
+int metrics_start(const char *path, metrics_backlogs_fn backlogs);
+void metrics_backlogs_add(struct metrics_backlogs *b, const char *name,
+			  uint32_t frames, uint32_t bytes);
+
+/* Only the owning thread writes, a relaxed store keeps the scraper's reads
+ * from tearing.
+ */
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_hist_add(struct metrics_hist *h, uint64_t val)
+{
+	uint32_t i = 0;
+
+	if (val > 1)
+		i = 64 - __builtin_clzll(val - 1);
+	if (i >= METRICS_HIST_BUCKETS)
+		i = METRICS_HIST_BUCKETS - 1;
+
+	metrics_add(&h->buckets[i], 1);
+	metrics_add(&h->sum, val);
+	metrics_add(&h->count, 1);
+}
+
+static inline uint64_t metrics_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* _METRICS_H */
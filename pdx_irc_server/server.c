@@ -5,6 +5,7 @@
 
 #include "../common/protocol.h"
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,22 +14,196 @@
 #include <errno.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
 #include "../common/epoll/epoll_helpers.h"
-#include "../common/list/list.h"
+#include "../common/uring/uring_helpers.h"
+#include "../common/hash/hash_table.h"
+#include "../common/pool/pool.h"
 #include "../common/debug/debug.h"
+#include "../common/debug/log.h"
+#include "connection.h"
+#include "channel.h"
+#include "metrics.h"
+#include "identity.h"
+#include "backlog.h"
+#include "history.h"
+#include "handover.h"
+
+#define DEFAULT_NUM_WORKERS	1
+#define MAX_NUM_WORKERS		64
+#define MAX_EPOLL_BATCH		4096
+
+/* Sizing of the io_uring backend, every worker has its own ring and buffers */
+#define URING_ENTRIES		4096
+#define URING_BGID		0
+#define URING_NUM_BUFS		1024
+#define URING_BUF_SIZE		4096
+
+/* Events returned by one epoll_wait() and EPOLLET for edge triggered clients,
+ * both set from the command line before any worker starts.
+ */
+static int epoll_batch = MAX_EPOLL_EVENTS;
+static uint32_t client_epoll_flags;
+
+/* Server wide channel registry shared by all workers, keyed by channel name.
+ * JOIN, LEAVE and client disconnects modify channels so they take
+ * channel_table_lock for writing, everything else only takes it for reading.
+ */
+static struct hash_table channel_table;
+static pthread_rwlock_t channel_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The same channels in creation order, indexed by channel id. Channels are
+ * never deleted so an id stays valid and listing can resume from one.
+ * Protected by channel_table_lock as well.
+ */
+static struct irc_channel **channels;
+static uint32_t num_channels;
+static uint32_t channels_size;
+
+/* Response messages, recycled so handling a message never calls malloc() */
+#define MSGS_PER_SLAB	64
+static struct pool msg_pool;
+
+/**
+ * struct worker - one event loop thread
+ * @thread: pthread running the backend's loop
+ * @id: index of this worker
+ * @listenfd: this worker's SO_REUSEPORT listening socket
+ * @loop: this worker's event loop, shared with the connections it owns
+ * @ring: io_uring of an io_uring worker
+ * @bufs: buffers the io_uring worker's receives land in
+ * @kick_val: where the io_uring worker reads loop.kickfd to
+ * @parkfd: eventfd that makes an epoll worker park, see park_workers()
+ * @login_lock: protects logins_done, the hashing threads add to it
+ * @logins_done: LOGINs of this worker's connections that were hashed
+ */
+struct worker {
+	pthread_t thread;
+	int id;
+	int listenfd;
+	struct conn_loop loop;
+	struct uring ring;
+	struct uring_buf_ring bufs;
+	uint64_t kick_val;
+	int parkfd;
+	pthread_mutex_t login_lock;
+	struct login_wait *logins_done;
+};
+
+/* Every worker, set up before any of them starts */
+static struct worker *workers;
+static int num_workers = DEFAULT_NUM_WORKERS;
+
+/* Hot upgrade, see handover.h. Workers park here between two iterations of
+ * their loop so the server can be serialized without holding any lock.
+ */
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static bool parking;
+static int num_parked;
+
+/**
+ * struct event_backend - how workers wait for and perform client I/O
+ * @name: name selecting the backend with -B
+ * @init: set up a worker's event loop before its thread is started
+ * @loop: thread function running the worker's event loop
+ * @release: give up a client's socket once it left every channel
+ */
+struct event_backend {
+	const char *name;
+	int (*init)(struct worker *w);
+	void *(*loop)(void *arg);
+	void (*release)(struct worker *w, int clientfd,
+			struct connection *conn);
+};
+
+/* Picked with -B before any worker starts */
+static const struct event_backend *backend;
+
+static struct irc_channel *get_channel(char *channel_name)
+{
+	char key[CHANNEL_NAME_MAX_LEN];
+
+	/* Zero pad so the whole fixed length key can be hashed and compared */
+	strncpy(key, channel_name, CHANNEL_NAME_MAX_LEN);
+
+	return hash_table_lookup(&channel_table, key);
+}
+
+/* Clients see a channel's id plus one, so CHANNEL_ID_NONE is never an id */
+static uint32_t channel_wire_id(const struct irc_channel *c)
+{
+	return c->id + 1;
+}
+
+/**
+ * find_channel - channel a message addresses
+ * @channel_name: name of the channel, only used without a channel_id
+ * @channel_id: id the server gave the channel on JOIN, or CHANNEL_ID_NONE
+ *
+ * An id is a plain index into channels, no name is hashed or compared.
+ * Caller must hold channel_table_lock.
+ */
+static struct irc_channel *find_channel(char *channel_name,
+				       uint32_t channel_id)
+{
+	if (channel_id == CHANNEL_ID_NONE)
+		return get_channel(channel_name);
 
-#define MAX_EPOLL_EVENTS 10
+	if (channel_id > num_channels)
+		return NULL;
 
-/* Server wide channel list */
-static struct list_node *channel_list_head = NULL;
+	return channels[channel_id - 1];
+}
 
-static struct channel *get_channel(char *channel_name)
+static struct irc_channel *create_channel(char *channel_name)
 {
-	struct channel c;
+	struct irc_channel *c;
+
+	if (num_channels == channels_size) {
+		uint32_t size = channels_size ? channels_size * 2 : 64;
+		struct irc_channel **grown;
+
+		grown = realloc(channels, size * sizeof(*grown));
+		if (!grown) {
+			perror("realloc");
+			return NULL;
+		}
+
+		channels = grown;
+		channels_size = size;
+	}
+
+	c = channel_alloc(channel_name);
+	if (!c)
+		return NULL;
 
-	strncpy(c.name, channel_name, CHANNEL_NAME_MAX_LEN);
+	if (hash_table_insert(&channel_table, c)) {
+		channel_free(c);
+		return NULL;
+	}
+
+	c->id = num_channels;
+	channels[num_channels++] = c;
+	metrics_add(&thread_metrics->channels_created, 1);
+
+	return c;
+}
 
-	return get_list_node_data(channel_list_head, &c, is_equal_channels);
+/* Called by the admin thread at every scrape, one backlog lock at a time */
+static void report_backlogs(struct metrics_backlogs *b)
+{
+	uint32_t i, frames, bytes;
+
+	pthread_rwlock_rdlock(&channel_table_lock);
+	for (i = 0; i < num_channels; ++i) {
+		backlog_usage(channels[i]->backlog, &frames, &bytes);
+		metrics_backlogs_add(b, channels[i]->chan.name, frames, bytes);
+	}
+	pthread_rwlock_unlock(&channel_table_lock);
 }
 
 int setup_server_socket(int *serverfd)
@@ -51,6 +226,15 @@ int setup_server_socket(int *serverfd)
 		goto err_closefd;
 	}
 
+	/* Every worker binds its own socket to the same port and the kernel
+	 * load balances new connections between them.
+	 */
+	if (setsockopt(*serverfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))
+	    == -1) {
+		perror("setsockopt");
+		goto err_closefd;
+	}
+
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	serv_addr.sin_port = htons(5000);
@@ -73,140 +257,294 @@ err_closefd:
 	return -1;
 }
 
-static bool is_user_in_channel(struct channel *c, struct user *u)
+static struct member *get_channel_user(struct irc_channel *c, int fd)
 {
-	if (!c || !u)
+	return hash_table_lookup(&c->user_table, &fd);
+}
+
+static bool is_user_in_channel(struct irc_channel *c, int fd)
+{
+	if (!c)
 		return false;
 
-	return list_contains(c->user_list_head, u, is_equal_users);
+	return get_channel_user(c, fd) != NULL;
 }
 
-static uint32_t handle_join_msg(int srcfd, struct message *msg)
+static uint32_t add_user_to_channel(struct irc_channel *c, struct member *u,
+				    struct connection *conn)
 {
-	struct list_node *add_node;
-	struct channel *channel;
-	struct user *user;
+	if (c->num_users == c->users_size) {
+		int size = c->users_size ? c->users_size * 2 : 8;
+		struct member **users;
+
+		users = realloc(c->users, size * sizeof(*users));
+		if (!users) {
+			perror("realloc");
+			return RESP_MEMORY_ALLOC;
+		}
+
+		c->users = users;
+		c->users_size = size;
+	}
+
+	if (hash_table_insert(&c->user_table, u))
+		return RESP_CANNOT_ADD_USER_TO_CHANNEL;
+
+	u->idx = c->num_users++;
+	c->users[u->idx] = u;
+	u->channel = c;
+
+	/* Remember the channel on the connection for disconnect cleanup */
+	u->prev_joined = NULL;
+	u->next_joined = conn->joined;
+	if (conn->joined)
+		conn->joined->prev_joined = u;
+	conn->joined = u;
+
+	return RESP_SUCCESS;
+}
 
-	channel = get_channel(msg->join.channel_name);
-	/* Add channel if it doesn't exist already and get the refernce to the
-	 * channel
-	 * TODO: make add_channel return a pointer to the added channel!!! */
+static uint32_t handle_join_msg(struct connection *conn, struct message *msg)
+{
+	struct irc_channel *channel;
+	struct member *member;
+	int srcfd = conn->fd;
+	uint32_t ret;
+
+	/* Members and channels are named in packed LIST replies */
+	if (!proto_list_name_valid(conn->ident->name, USER_NAME_MAX_LEN))
+		return RESP_INVALID_LOGIN;
+
+	channel = find_channel(msg->join.channel_name, msg->join.channel_id);
+	/* Add channel if it doesn't exist already, an unknown id can't be */
+	if (!channel && msg->join.channel_id != CHANNEL_ID_NONE)
+		return RESP_INVALID_CHANNEL_NAME;
 	if (!channel) {
-		if (add_channel(&channel_list_head, msg->join.channel_name)) {
-			printf("[%s:%d] cannot add channel (%s)\n", __func__, __LINE__,
-			       msg->join.channel_name);
-			return RESP_CANNOT_ADD_CHANNEL;
-		}
+		if (!proto_list_name_valid(msg->join.channel_name,
+					   CHANNEL_NAME_MAX_LEN))
+			return RESP_INVALID_CHANNEL_NAME;
 
-		channel = get_channel(msg->join.channel_name);
+		channel = create_channel(msg->join.channel_name);
 		if (!channel) {
-			printf("[%s:%d] cannot find channel (%s)\n", __func__, __LINE__,
-			       msg->join.channel_name);
-			return RESP_CANNOT_FIND_CHANNEL;
+			log_err("cannot add channel (%s)\n",
+				LOG_STR(msg->join.channel_name));
+			return RESP_CANNOT_ADD_CHANNEL;
 		}
 	}
 
-	user = calloc(1, sizeof(*user));
-	if (!user) {
-		perror("calloc");
-		return RESP_MEMORY_ALLOC;
-	}
-
-	strncpy(user->name, msg->join.src_user, USER_NAME_MAX_LEN);
-	user->fd = srcfd;
-	if (is_user_in_channel(channel, user)) {
-		free(user);
+	/* The response tells the client the id, joined already or not */
+	msg->join.channel_id = channel_wire_id(channel);
+	if (is_user_in_channel(channel, srcfd))
 		return RESP_ALREADY_IN_CHANNEL;
-	}
 
-	add_node = calloc(1, sizeof(*add_node));
-	if (!add_node) {
-		perror("calloc");
-		free(user);
+	member = member_alloc();
+	if (!member)
 		return RESP_MEMORY_ALLOC;
-	}
 
-	add_node->data = user;
-	if (add_list_node(&channel->user_list_head, add_node)) {
-		printf("Failed to add user node\n");
-		free(user);
-		free(add_node);
-		return RESP_CANNOT_ADD_USER_TO_CHANNEL;
+	member->ident = conn->ident;
+	member->user.fd = srcfd;
+	ret = add_user_to_channel(channel, member, conn);
+	if (ret != RESP_SUCCESS) {
+		log_err("Failed to add user to channel\n");
+		member_free(member);
+		return ret;
 	}
 
-	return RESP_SUCCESS;
+	/* No CHAT can be handled while the table is locked for writing, so
+	 * the new member gets nothing twice and misses nothing.
+	 */
+	if (msg->join.replay)
+		backlog_replay(channel->backlog, conn, msg->join.replay);
+
+	return ret;
 }
 
-static uint32_t handle_chat_msg(int srcfd, struct message *msg)
+static uint32_t handle_chat_msg(struct connection *src, struct message *msg)
 {
-	struct channel *channel;
-	struct list_node *tmp;
-	struct user user;
-	int bytes;
+	/* One frame per protocol version in use, built on first use */
+	struct frame_buf *frames[PROTO_V2 + 1] = { NULL };
+	struct message *out;
+	struct irc_channel *channel;
+	uint64_t fanout = 0;
+	int srcfd = src->fd;
+	int i;
 
-	/* Setup src_user data to avoid echoing message back to sender */
-	strncpy(user.name, msg->chat.src_user, USER_NAME_MAX_LEN);
-	user.fd = srcfd;
 	/* Make sure this message is directed towards a real channel */
-	channel = get_channel(msg->chat.channel_name);
+	channel = find_channel(msg->chat.channel_name, msg->chat_channel_id);
 	if (!channel) {
-		printf("[%s:%d] cannot find channel (%s)\n", __func__, __LINE__, msg->chat.channel_name);
+		log_debug("cannot find channel (%s)\n",
+			  LOG_STR(msg->chat.channel_name));
 		return RESP_INVALID_CHANNEL_NAME;
 	}
 
-	if (!is_user_in_channel(channel, &user)) {
-		printf("[%s:%d] user %s not in channel %s\n", __func__, __LINE__, user.name, channel->name);
+	if (!is_user_in_channel(channel, srcfd)) {
+		/* Channels are never freed, so their name can be logged as is.
+		 * An unclaimed identity is freed when its connection closes.
+		 */
+		log_debug("user %s not in channel %s\n",
+			  LOG_STR(src->ident->name),
+			  LOG_STATIC_STR(channel->chan.name));
 		return RESP_NOT_IN_CHANNEL;
 	}
 
-	/* Send chat message to all users in the channel */
-	for (tmp = channel->user_list_head; tmp != NULL; tmp = tmp->next) {
+	out = pool_alloc(&msg_pool);
+	if (!out)
+		return RESP_MEMORY_ALLOC;
+
+	memcpy(out, msg, sizeof(*out));
+	out->response = RESP_SUCCESS;
+	/* Members see who the sender is logged in as, not what it claims,
+	 * and the channel by name whether or not the sender used its id.
+	 */
+	memcpy(out->chat.src_user, src->ident->name, USER_NAME_MAX_LEN);
+	memcpy(out->chat.channel_name, channel->chan.name,
+	       CHANNEL_NAME_MAX_LEN);
+	out->chat_channel_id = CHANNEL_ID_NONE;
+
+	/* Send chat message to all users in the channel, each frame is built
+	 * once and every member queues a reference to it.
+	 */
+	for (i = 0; i < channel->num_users; ++i) {
+		struct member *u = channel->users[i];
+		struct connection *conn;
+		uint8_t proto;
+
 		/* Don't echo the chat message back to the sender */
-		if (is_equal_users(&user, tmp->data))
+		if (u->user.fd == srcfd)
 			continue;
 
-		msg->response = RESP_SUCCESS;
-		bytes = send(((struct user *)(tmp->data))->fd, msg, MSG_SIZE, 0);
-		if (bytes != MSG_SIZE) {
-			perror("send");
-			printf("Failed to send chat message to fd %d\n",
-			       ((struct user *)(tmp->data))->fd);
-		}
+		conn = conn_lookup(u->user.fd);
+		proto = conn->proto == PROTO_V2 ? PROTO_V2 : PROTO_V1;
+		if (!frames[proto])
+			frames[proto] = frame_from_msg(out, proto);
+
+		if (conn_queue(conn, frames[proto]))
+			log_warn("Failed to send chat message to fd %d\n",
+				 u->user.fd);
+		else
+			++fanout;
 	}
+	metrics_hist_add(&thread_metrics->fanout, fanout);
+
+	/* Remembered as v2 whoever the members are, it's the smaller frame */
+	if (!frames[PROTO_V2])
+		frames[PROTO_V2] = frame_from_msg(out, PROTO_V2);
+	if (frames[PROTO_V2]) {
+		backlog_add(channel->backlog, frames[PROTO_V2]);
+		if (channel->history)
+			history_append(channel->history, frames[PROTO_V2]);
+	}
+
+	frame_put(frames[PROTO_V1]);
+	frame_put(frames[PROTO_V2]);
+	pool_free(&msg_pool, out);
 
 	return RESP_SUCCESS;
 }
 
-static uint32_t rm_user_from_channel(struct channel *channel, struct user *user)
+/**
+ * handle_direct_msg - deliver a DIRECT message to its recipient
+ * @src: connection that sent it
+ * @msg: the DIRECT message
+ *
+ * The recipient is found through the identity table, no channel is involved.
+ */
+static uint32_t handle_direct_msg(struct connection *src, struct message *msg)
+{
+	struct identity *dst;
+	struct message *out;
+	uint32_t ret = RESP_SUCCESS;
+
+	out = pool_alloc(&msg_pool);
+	if (!out)
+		return RESP_MEMORY_ALLOC;
+
+	memcpy(out, msg, sizeof(*out));
+	out->response = RESP_SUCCESS;
+	memcpy(out->direct.src_user, src->ident->name, USER_NAME_MAX_LEN);
+
+	/* Holding the lock keeps the recipient from logging out and its fd
+	 * from being reused until the message is queued.
+	 */
+	identity_read_lock();
+	dst = identity_lookup(msg->direct.dst_user);
+	if (!dst || dst->fd < 0)
+		ret = RESP_USER_NOT_ONLINE;
+	else if (conn_send_msg(conn_lookup(dst->fd), out))
+		ret = RESP_RECV_MSG_FAILED;
+	identity_read_unlock();
+
+	pool_free(&msg_pool, out);
+
+	return ret;
+}
+
+static uint32_t handle_history_msg(struct connection *conn,
+				   struct message *msg)
+{
+	struct irc_channel *channel;
+
+	channel = find_channel(msg->history.channel_name,
+			       msg->history.channel_id);
+	if (!channel)
+		return RESP_CANNOT_FIND_CHANNEL;
+
+	/* Only members can read what was said, just like they can CHAT */
+	if (!is_user_in_channel(channel, conn->fd))
+		return RESP_NOT_IN_CHANNEL;
+
+	return history_query(channel->history, conn, msg);
+}
+
+/* Unlink a member from its channel and its connection and free it */
+static void rm_member(struct connection *conn, struct member *member)
+{
+	struct irc_channel *channel = member->channel;
+	struct member *last;
+
+	hash_table_remove(&channel->user_table, &member->user.fd);
+
+	/* Fill the hole in the dense array with the last member */
+	last = channel->users[--channel->num_users];
+	channel->users[member->idx] = last;
+	last->idx = member->idx;
+
+	if (member->prev_joined)
+		member->prev_joined->next_joined = member->next_joined;
+	else
+		conn->joined = member->next_joined;
+	if (member->next_joined)
+		member->next_joined->prev_joined = member->prev_joined;
+
+	member_free(member);
+}
+
+static uint32_t rm_user_from_channel(struct irc_channel *channel,
+				     struct connection *conn)
 {
-	struct list_node *the_user;
+	struct member *the_user;
 
-	if (!channel || !user)
+	if (!channel || !conn)
 		return -1;
 
-	the_user = rm_list_node(&channel->user_list_head, user, is_equal_users);
+	the_user = get_channel_user(channel, conn->fd);
 	if (!the_user)
 		return RESP_NOT_IN_CHANNEL;
 
-	/* Have to delete the user that we removed from the list */
-	free(the_user);
+	rm_member(conn, the_user);
 
 	return RESP_SUCCESS;
 }
 
-static uint32_t handle_leave_msg(int srcfd, struct message *msg)
+static uint32_t handle_leave_msg(struct connection *conn, struct message *msg)
 {
-	struct channel *channel;
-	struct user user;
-
-	strncpy(user.name, msg->leave.src_user, USER_NAME_MAX_LEN);
-	user.fd = srcfd;
+	struct irc_channel *channel;
 
-	channel = get_channel(msg->leave.channel_name);
+	channel = find_channel(msg->leave.channel_name, msg->leave.channel_id);
 	if (!channel)
 		return RESP_INVALID_CHANNEL_NAME;
 
-	return rm_user_from_channel(channel, &user);
+	return rm_user_from_channel(channel, conn);
 }
 
 static void build_response_msg(struct message *send_msg, struct message *recv_msg)
@@ -214,17 +552,26 @@ static void build_response_msg(struct message *send_msg, struct message *recv_ms
 	send_msg->type = recv_msg->type;
 
 	switch (recv_msg->type) {
+	case HELLO:
+		send_msg->hello.version = PROTO_V2;
+		break;
+	case LOGIN:
+		strncpy(send_msg->login.username, recv_msg->login.username,
+			USER_NAME_MAX_LEN);
+		break;
 	case JOIN:
 		strncpy(send_msg->join.src_user, recv_msg->join.src_user,
 			USER_NAME_MAX_LEN);
 		strncpy(send_msg->join.channel_name,
 			recv_msg->join.channel_name, CHANNEL_NAME_MAX_LEN);
+		send_msg->join.channel_id = recv_msg->join.channel_id;
 		break;
 	case LEAVE:
 		strncpy(send_msg->leave.src_user, recv_msg->leave.src_user,
 			USER_NAME_MAX_LEN);
 		strncpy(send_msg->leave.channel_name, recv_msg->leave.channel_name,
 			CHANNEL_NAME_MAX_LEN);
+		send_msg->leave.channel_id = recv_msg->leave.channel_id;
 		break;
 	case CHAT:
 		strncpy(send_msg->chat.src_user, recv_msg->chat.src_user,
@@ -233,6 +580,19 @@ static void build_response_msg(struct message *send_msg, struct message *recv_ms
 			CHANNEL_NAME_MAX_LEN);
 		strncpy(send_msg->chat.text, recv_msg->chat.text,
 			CHAT_MSG_MAX_LEN);
+		send_msg->chat_channel_id = recv_msg->chat_channel_id;
+		break;
+	case HISTORY:
+		memcpy(&send_msg->history, &recv_msg->history,
+		       sizeof(send_msg->history));
+		break;
+	case DIRECT:
+		strncpy(send_msg->direct.src_user, recv_msg->direct.src_user,
+			USER_NAME_MAX_LEN);
+		strncpy(send_msg->direct.dst_user, recv_msg->direct.dst_user,
+			USER_NAME_MAX_LEN);
+		strncpy(send_msg->direct.text, recv_msg->direct.text,
+			CHAT_MSG_MAX_LEN);
 		break;
 	case LIST_CHANNELS:
 		strncpy(send_msg->list_channels.src_user, recv_msg->chat.src_user,
@@ -242,195 +602,1151 @@ static void build_response_msg(struct message *send_msg, struct message *recv_ms
 	case LIST_USERS:
 		strncpy(send_msg->list_users.src_user, recv_msg->list_users.src_user,
 			USER_NAME_MAX_LEN);
+		strncpy(send_msg->list_users.channel_name,
+			recv_msg->list_users.channel_name, CHANNEL_NAME_MAX_LEN);
+		send_msg->list_users.channel_id = recv_msg->list_users.channel_id;
 		send_msg->list_users.list_key = recv_msg->list_users.list_key;
 		break;
 	default:
-		printf("Invalid/unimplemented message type %s\n",
-		       msg_type_to_str(recv_msg->type));
+		log_warn("Invalid/unimplemented message type %s\n",
+			 LOG_STATIC_STR(msg_type_to_str(recv_msg->type)));
 		break;
 	}
 }
 
-static uint32_t handle_list_channels_msg(int srcfd, struct message *recv_msg)
+/**
+ * struct name_packer - packs names into as few v2 LIST replies as possible
+ * @conn: connection the replies are queued to
+ * @frame: reply being filled, NULL until the first name is added
+ * @type: LIST_CHANNELS or LIST_USERS
+ * @list_key: list_key of the request
+ * @response: response of every reply frame
+ */
+struct name_packer {
+	struct connection *conn;
+	struct frame_buf *frame;
+	uint8_t type;
+	uint8_t list_key;
+	uint32_t response;
+};
+
+/* Queue the reply being filled, if any */
+static int packer_flush(struct name_packer *p)
 {
-	struct message *send_msg;
-	struct list_node *tmp;
+	struct frame_buf *frame = p->frame;
+	int ret = -1;
 
-	if (!recv_msg)
-		return RESP_CANNOT_LIST_CHANNELS;
+	if (!frame)
+		return 0;
 
-	if (!channel_list_head)
-		return RESP_SERVER_HAS_NO_CHANNELS;
+	proto_list_end(frame->data, frame->len);
+	/* Always leave room for the final response */
+	if (conn_tx_space(p->conn) >= frame->len + MSG_V2_MAX_LEN)
+		ret = conn_queue(p->conn, frame);
 
-	send_msg = (struct message *)calloc(1, sizeof(*send_msg));
-	if (!send_msg)
-		return RESP_MEMORY_ALLOC;
+	frame_put(frame);
+	p->frame = NULL;
 
-	for (tmp = channel_list_head; tmp != NULL; tmp = tmp->next) {
-		struct channel *c = tmp->data;
-		int bytes;
+	return ret;
+}
 
-		strncpy(send_msg->list_channels.src_user,
-			recv_msg->list_channels.src_user, USER_NAME_MAX_LEN);
-		strncpy(send_msg->list_channels.channel_name, c->name,
-			CHANNEL_NAME_MAX_LEN);
-		send_msg->list_channels.list_key = recv_msg->list_channels.list_key;
-		send_msg->type = recv_msg->type;
-		send_msg->response = RESP_LIST_CHANNELS_IN_PROGRESS;
+static int packer_add(struct name_packer *p, const char *name, size_t max_len)
+{
+	if (p->frame && !proto_list_add(p->frame->data, &p->frame->len, name,
+					max_len))
+		return 0;
 
-		bytes = send(srcfd, send_msg, MSG_SIZE, 0);
-		if (bytes != MSG_SIZE) {
-			perror("send");
-			break;
-		}
-	}
+	/* Current reply is full, start the next one */
+	if (packer_flush(p))
+		return -1;
+
+	p->frame = frame_alloc(MSG_V2_LIST_MAX_LEN);
+	if (!p->frame)
+		return -1;
 
-	free(send_msg);
+	p->frame->len = proto_list_begin(p->frame->data, p->type, p->response,
+					 p->list_key);
 
-	return RESP_DONE_SENDING_CHANNELS;
+	return proto_list_add(p->frame->data, &p->frame->len, name, max_len);
 }
 
-static uint32_t handle_list_users_msg(int srcfd, struct message *recv_msg)
+/* Start of the page a LIST request asks for and the end through *end */
+static uint32_t page_range(uint32_t cursor, uint16_t page_size, uint32_t count,
+			   uint32_t *end)
 {
-	struct message *send_msg;
-	struct list_node *tmp;
-	struct channel *c;
+	uint32_t start = cursor < count ? cursor : count;
 
-	if (!recv_msg)
-		return RESP_CANNOT_LIST_USERS;
+	*end = count;
+	if (page_size && count - start > page_size)
+		*end = start + page_size;
 
-	c = get_channel(recv_msg->list_users.channel_name);
-	if (!c)
-		return RESP_CANNOT_FIND_CHANNEL;
+	return start;
+}
 
-	send_msg = (struct message *)calloc(1, sizeof(*send_msg));
-	if (!send_msg)
-		return RESP_MEMORY_ALLOC;
+/**
+ * struct list_stream - a LIST response being generated
+ * @type: LIST_CHANNELS or LIST_USERS
+ * @list_key: list_key of the request
+ * @src_user: name of the user that asked, interned
+ * @channel_name: channel whose members are listed, LIST_USERS only
+ * @channel_id: id of that channel
+ * @pos: index of the next channel or member to send
+ * @end: index the requested page ends at
+ * @next_cursor: cursor of the page after this one, 0 if this is the last
+ *
+ * A LIST response is sent a step at a time so a huge channel can't stall every
+ * other connection of the worker. A step sends at most LIST_STEP_BUDGET names
+ * and stops early once LIST_TX_HIGH_WATER bytes are waiting to be sent. The
+ * next step runs when the connection is writable again.
+ */
+struct list_stream {
+	uint8_t type;
+	uint8_t list_key;
+	const char *src_user;
+	char channel_name[CHANNEL_NAME_MAX_LEN];
+	uint32_t channel_id;
+	uint32_t pos;
+	uint32_t end;
+	uint32_t next_cursor;
+};
+
+#define LIST_STEP_BUDGET	1024
+#define LIST_TX_HIGH_WATER	(64 * 1024)
+#define LIST_STREAMS_PER_SLAB	64
+static struct pool list_stream_pool;
+
+/* Send the final response of a LIST and forget about it */
+static void list_stream_finish(struct connection *conn, uint32_t response)
+{
+	struct list_stream *ls = conn->list;
+	struct message *msg;
+
+	conn->list = NULL;
+	conn_set_more(conn, false);
+
+	msg = pool_zalloc(&msg_pool);
+	if (!msg) {
+		pool_free(&list_stream_pool, ls);
+		return;
+	}
+
+	msg->type = ls->type;
+	msg->response = response;
+	if (ls->type == LIST_CHANNELS) {
+		msg->list_channels.list_key = ls->list_key;
+		strncpy(msg->list_channels.src_user, ls->src_user,
+			USER_NAME_MAX_LEN);
+		msg->list_channels.cursor = ls->next_cursor;
+	} else {
+		msg->list_users.list_key = ls->list_key;
+		strncpy(msg->list_users.src_user, ls->src_user,
+			USER_NAME_MAX_LEN);
+		strncpy(msg->list_users.channel_name, ls->channel_name,
+			CHANNEL_NAME_MAX_LEN);
+		msg->list_users.cursor = ls->next_cursor;
+	}
+
+	if (conn_send_msg(conn, msg))
+		log_warn("Failed to send response to fd %d\n", conn->fd);
 
-	for (tmp = c->user_list_head; tmp != NULL; tmp = tmp->next) {
-		struct user *u = tmp->data;
-		int bytes;
+	pool_free(&msg_pool, msg);
+	pool_free(&list_stream_pool, ls);
+}
 
-		strncpy(send_msg->list_users.src_user,
-			recv_msg->list_users.src_user, USER_NAME_MAX_LEN);
-		strncpy(send_msg->list_users.username, u->name,
+/* v1 clients get one name per reply */
+static int list_stream_send_v1(struct connection *conn, struct list_stream *ls,
+			       struct message *msg, const char *name)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->type = ls->type;
+	if (ls->type == LIST_CHANNELS) {
+		msg->response = RESP_LIST_CHANNELS_IN_PROGRESS;
+		msg->list_channels.list_key = ls->list_key;
+		strncpy(msg->list_channels.src_user, ls->src_user,
 			USER_NAME_MAX_LEN);
-		send_msg->list_users.list_key = recv_msg->list_users.list_key;
-		send_msg->type = recv_msg->type;
-		send_msg->response = RESP_LIST_USERS_IN_PROGRESS;
+		strncpy(msg->list_channels.channel_name, name,
+			CHANNEL_NAME_MAX_LEN);
+	} else {
+		msg->response = RESP_LIST_USERS_IN_PROGRESS;
+		msg->list_users.list_key = ls->list_key;
+		strncpy(msg->list_users.src_user, ls->src_user,
+			USER_NAME_MAX_LEN);
+		strncpy(msg->list_users.username, name, USER_NAME_MAX_LEN);
+	}
+
+	return conn_send_msg(conn, msg);
+}
 
-		bytes = send(srcfd, send_msg, MSG_SIZE, 0);
-		if (bytes != MSG_SIZE) {
-			perror("send");
+/**
+ * list_stream_step - send the next part of a connection's LIST response
+ * @conn: connection with a LIST in progress, owned by the calling worker
+ */
+static void list_stream_step(struct connection *conn)
+{
+	struct list_stream *ls = conn->list;
+	struct name_packer p = {
+		.conn = conn,
+		.type = ls->type,
+		.list_key = ls->list_key,
+	};
+	uint32_t budget = LIST_STEP_BUDGET;
+	struct message *msg = NULL;
+	uint32_t done_resp, fail_resp;
+	uint32_t end = ls->end;
+	struct irc_channel *c = NULL;
+	int err = 0;
+
+	if (ls->type == LIST_CHANNELS) {
+		p.response = RESP_LIST_CHANNELS_IN_PROGRESS;
+		done_resp = RESP_DONE_SENDING_CHANNELS;
+		fail_resp = RESP_CANNOT_LIST_CHANNELS;
+	} else {
+		p.response = RESP_LIST_USERS_IN_PROGRESS;
+		done_resp = RESP_DONE_SENDING_USERS;
+		fail_resp = RESP_CANNOT_LIST_USERS;
+	}
+
+	if (conn->proto != PROTO_V2) {
+		msg = pool_alloc(&msg_pool);
+		if (!msg) {
+			list_stream_finish(conn, RESP_MEMORY_ALLOC);
+			return;
+		}
+	}
+
+	pthread_rwlock_rdlock(&channel_table_lock);
+	if (ls->type == LIST_USERS) {
+		c = channels[ls->channel_id];
+		/* Members may have left since the last step */
+		if (end > c->num_users)
+			end = c->num_users;
+	}
+
+	for (; ls->pos < end && budget; ++ls->pos, --budget) {
+		const char *name;
+		size_t max_len;
+
+		/* Let the peer catch up before producing more */
+		if (conn_tx_space(conn) < CONN_TX_MAX_BYTES - LIST_TX_HIGH_WATER)
+			break;
+
+		if (c) {
+			name = c->users[ls->pos]->ident->name;
+			max_len = USER_NAME_MAX_LEN;
+		} else {
+			name = channels[ls->pos]->chan.name;
+			max_len = CHANNEL_NAME_MAX_LEN;
+		}
+
+		if (msg)
+			err = list_stream_send_v1(conn, ls, msg, name);
+		else
+			err = packer_add(&p, name, max_len);
+		if (err)
 			break;
+	}
+	pthread_rwlock_unlock(&channel_table_lock);
+
+	if (!err)
+		err = packer_flush(&p);
+	else
+		frame_put(p.frame);
+
+	if (msg)
+		pool_free(&msg_pool, msg);
+
+	if (err)
+		list_stream_finish(conn, fail_resp);
+	else if (ls->pos >= end)
+		list_stream_finish(conn, done_resp);
+	else
+		/* Resume once the connection is writable */
+		conn_set_more(conn, true);
+}
+
+/**
+ * list_stream_start - start sending one page of a LIST response
+ * @conn: connection that asked
+ * @recv_msg: the LIST_CHANNELS or LIST_USERS request
+ *
+ * A channel cursor is an index into channels, which only ever grows, so paging
+ * through returns every channel that existed at the start exactly once. A
+ * user cursor is a position in the channel's member array. A member leaving
+ * moves the last member into its place, so membership changes while paging
+ * can skip or repeat a name.
+ *
+ * Returns 0 if the response is being streamed, it ends with its own final
+ * response, otherwise the response to send right away.
+ */
+static uint32_t list_stream_start(struct connection *conn,
+				  struct message *recv_msg)
+{
+	struct list_stream *ls;
+	uint32_t cursor, count, channel_id = 0;
+	const char *channel_name = NULL;
+	uint16_t page_size;
+
+	if (recv_msg->type == LIST_CHANNELS) {
+		if (conn->list)
+			return RESP_CANNOT_LIST_CHANNELS;
+
+		pthread_rwlock_rdlock(&channel_table_lock);
+		count = num_channels;
+		pthread_rwlock_unlock(&channel_table_lock);
+		if (!count)
+			return RESP_SERVER_HAS_NO_CHANNELS;
+
+		cursor = recv_msg->list_channels.cursor;
+		page_size = recv_msg->list_channels.page_size;
+	} else {
+		struct irc_channel *c;
+
+		if (conn->list)
+			return RESP_CANNOT_LIST_USERS;
+
+		pthread_rwlock_rdlock(&channel_table_lock);
+		c = find_channel(recv_msg->list_users.channel_name,
+				 recv_msg->list_users.channel_id);
+		if (c) {
+			channel_id = c->id;
+			count = c->num_users;
+			/* Channels are never freed, the name stays valid */
+			channel_name = c->chan.name;
 		}
+		pthread_rwlock_unlock(&channel_table_lock);
+		if (!c)
+			return RESP_CANNOT_FIND_CHANNEL;
+
+		cursor = recv_msg->list_users.cursor;
+		page_size = recv_msg->list_users.page_size;
 	}
 
-	free(send_msg);
+	ls = pool_zalloc(&list_stream_pool);
+	if (!ls)
+		return RESP_MEMORY_ALLOC;
+
+	ls->type = recv_msg->type;
+	ls->channel_id = channel_id;
+	ls->pos = page_range(cursor, page_size, count, &ls->end);
+	ls->next_cursor = ls->end < count ? ls->end : 0;
+	/* list_key is at the same offset for both types */
+	ls->list_key = recv_msg->list_channels.list_key;
+	ls->src_user = conn->ident->name;
+	if (ls->type == LIST_USERS)
+		strncpy(ls->channel_name, channel_name, CHANNEL_NAME_MAX_LEN);
+
+	conn->list = ls;
+	list_stream_step(conn);
 
-	return RESP_DONE_SENDING_USERS;
+	return 0;
 }
 
-static void handle_recv_msg(int epollfd, int srcfd)
+/* Messages a connection can send behind a LOGIN that is being hashed */
+#define LOGIN_MAX_DEFERRED	32
+
+/**
+ * struct login_wait - a LOGIN waiting for its password to be hashed
+ * @req: the hashing request, first so its done callback finds the rest
+ * @w: worker owning the connection, the LOGIN is finished by it
+ * @conn: connection that sent the LOGIN, NULL once it was closed
+ * @login: the LOGIN without its password, answered once it is finished
+ * @num_deferred: number of messages in deferred
+ * @deferred: messages the connection sent after the LOGIN, handled in order
+ *	      once it is answered
+ * @next: next LOGIN on the worker's logins_done
+ *
+ * Hashing takes milliseconds, far too long to stall every other connection
+ * of the worker. The connection's messages are only decoded meanwhile, one
+ * that sends more than LOGIN_MAX_DEFERRED of them is closed.
+ */
+struct login_wait {
+	struct identity_login_req req;
+	struct worker *w;
+	struct connection *conn;
+	struct message login;
+	uint32_t num_deferred;
+	struct message deferred[LOGIN_MAX_DEFERRED];
+	struct login_wait *next;
+};
+
+#define LOGIN_WAITS_PER_SLAB	8
+static struct pool login_wait_pool;
+
+/* LOGINs started and not yet finished or dropped, see server_handover_save() */
+static uint32_t num_logins_pending;
+
+static void login_wait_free(struct login_wait *lw)
 {
-	struct message *recv_msg, *send_msg;
-	int bytes;
+	pool_free(&login_wait_pool, lw);
+	__atomic_sub_fetch(&num_logins_pending, 1, __ATOMIC_RELAXED);
+}
 
-	recv_msg = (struct message *)calloc(1, sizeof(*recv_msg));
-	if (!recv_msg) {
-		perror("calloc");
-		return;
+/* Called by a hashing thread, hands the LOGIN back to its worker */
+static void login_hashed(struct identity_login_req *req)
+{
+	struct login_wait *lw = (struct login_wait *)req;
+	struct worker *w = lw->w;
+	uint64_t one = 1;
+	bool wake;
+
+	pthread_mutex_lock(&w->login_lock);
+	wake = !w->logins_done;
+	lw->next = w->logins_done;
+	w->logins_done = lw;
+	pthread_mutex_unlock(&w->login_lock);
+
+	if (wake && write(w->loop.kickfd, &one, sizeof(one)) != sizeof(one))
+		log_err("worker %d kick: %m\n", w->id);
+}
+
+/* Answered by handle_logins_done() once the password is hashed */
+static uint32_t handle_login_msg(struct worker *w, struct connection *conn,
+				 struct message *msg)
+{
+	struct login_wait *lw;
+
+	/* A connection stays the same user until it disconnects */
+	if (conn->ident)
+		return RESP_INVALID_LOGIN;
+
+	lw = pool_alloc(&login_wait_pool);
+	if (!lw)
+		return RESP_INVALID_LOGIN;
+
+	__atomic_add_fetch(&num_logins_pending, 1, __ATOMIC_RELAXED);
+	lw->w = w;
+	lw->conn = conn;
+	lw->login = *msg;
+	memset(lw->login.login.password, 0, sizeof(lw->login.login.password));
+	lw->num_deferred = 0;
+	if (identity_login_start(&lw->req, msg->login.username,
+				 msg->login.password, conn->fd, login_hashed)) {
+		login_wait_free(lw);
+		return RESP_INVALID_LOGIN;
 	}
 
-	send_msg = (struct message *)calloc(1, sizeof(*send_msg));
-	if (!send_msg) {
-		perror("calloc");
-		free(recv_msg);
-		return;
+	conn->login = lw;
+
+	return 0;
+}
+
+/* The src_user a message claims to be from, NULL if it has none */
+static const char *msg_src_user(struct message *msg)
+{
+	switch (msg->type) {
+	case JOIN:
+		return msg->join.src_user;
+	case LEAVE:
+		return msg->leave.src_user;
+	case CHAT:
+		return msg->chat.src_user;
+	case DIRECT:
+		return msg->direct.src_user;
+	case HISTORY:
+		return msg->history.src_user;
+	case LIST_CHANNELS:
+		return msg->list_channels.src_user;
+	case LIST_USERS:
+		return msg->list_users.src_user;
+	default:
+		return NULL;
 	}
+}
+
+static void handle_msg(struct worker *w, struct connection *conn,
+		       struct message *recv_msg)
+{
+	enum metrics_handler handler = METRICS_NUM_HANDLERS;
+	struct message *send_msg;
+	int srcfd = conn->fd;
+	uint64_t start_ns;
+
+	metrics_add(&thread_metrics->msgs[recv_msg->type], 1);
 
-	bytes = recv(srcfd, recv_msg, MSG_SIZE, MSG_WAITALL);
-	if (bytes != MSG_SIZE) {
-		send_msg->type = ERROR;
-		send_msg->response = RESP_RECV_MSG_FAILED;
-		goto send_response;
+	send_msg = pool_zalloc(&msg_pool);
+	if (!send_msg)
+		return;
+
+	/* Messages are handled as the user the connection is logged in as,
+	 * their src_user is never looked at again. A client that never sent
+	 * LOGIN is a guest named by its first message, which is never refused
+	 * and doesn't claim the name past the connection.
+	 */
+	if (!conn->ident && msg_src_user(recv_msg)) {
+		conn->ident = identity_guest(msg_src_user(recv_msg), srcfd);
+		if (!conn->ident) {
+			send_msg->response = RESP_INVALID_LOGIN;
+			goto respond;
+		}
 	}
 
+	start_ns = metrics_now_ns();
 	switch (recv_msg->type) {
+		case HELLO:
+			/* The version was already picked by the first frame */
+			send_msg->response = RESP_SUCCESS;
+			handler = METRICS_HANDLER_HELLO;
+			break;
+		case LOGIN:
+			send_msg->response = handle_login_msg(w, conn,
+							      recv_msg);
+			handler = METRICS_HANDLER_LOGIN;
+			break;
 		case JOIN:
-			send_msg->response = handle_join_msg(srcfd, recv_msg);
+			pthread_rwlock_wrlock(&channel_table_lock);
+			send_msg->response = handle_join_msg(conn, recv_msg);
+			pthread_rwlock_unlock(&channel_table_lock);
+			handler = METRICS_HANDLER_JOIN;
 			break;
 		case LEAVE:
-			send_msg->response = handle_leave_msg(srcfd, recv_msg);
+			pthread_rwlock_wrlock(&channel_table_lock);
+			send_msg->response = handle_leave_msg(conn, recv_msg);
+			pthread_rwlock_unlock(&channel_table_lock);
+			handler = METRICS_HANDLER_LEAVE;
 			break;
 		case CHAT:
-			send_msg->response = handle_chat_msg(srcfd, recv_msg);
+			pthread_rwlock_rdlock(&channel_table_lock);
+			send_msg->response = handle_chat_msg(conn, recv_msg);
+			pthread_rwlock_unlock(&channel_table_lock);
+			handler = METRICS_HANDLER_CHAT;
 			break;
-		case LIST_CHANNELS:
-			send_msg->response = handle_list_channels_msg(srcfd,
-								      recv_msg);
+		case DIRECT:
+			send_msg->response = handle_direct_msg(conn, recv_msg);
+			handler = METRICS_HANDLER_DIRECT;
+			break;
+		case HISTORY:
+			pthread_rwlock_rdlock(&channel_table_lock);
+			send_msg->response = handle_history_msg(conn, recv_msg);
+			pthread_rwlock_unlock(&channel_table_lock);
+			handler = METRICS_HANDLER_HISTORY;
 			break;
+		case LIST_CHANNELS:
 		case LIST_USERS:
-			send_msg->response = handle_list_users_msg(srcfd,
-								   recv_msg);
+			/* Streamed responses send their own final response */
+			send_msg->response = list_stream_start(conn, recv_msg);
+			handler = METRICS_HANDLER_LIST;
 			break;
 		default:
-			printf("Invalid/unimplemented message type %s\n",
-			       msg_type_to_str(recv_msg->type));
+			log_warn("Invalid/unimplemented message type %s\n",
+				 LOG_STATIC_STR(msg_type_to_str(recv_msg->type)));
 			break;
 	}
 
+	if (handler != METRICS_NUM_HANDLERS)
+		metrics_hist_add(&thread_metrics->latency[handler],
+				 metrics_now_ns() - start_ns);
+
+	/* A streamed LIST response was already started, a LOGIN being hashed
+	 * is answered once it is finished.
+	 */
+	if ((handler == METRICS_HANDLER_LIST ||
+	     handler == METRICS_HANDLER_LOGIN) && !send_msg->response)
+		goto out;
+
+respond:
 	build_response_msg(send_msg, recv_msg);
 
-send_response:
-	bytes = send(srcfd, send_msg, MSG_SIZE, 0);
-	if (bytes != MSG_SIZE)
-		perror("send");
+	if (conn_send_msg(conn, send_msg))
+		log_warn("Failed to send response to fd %d\n", srcfd);
 
-	free(recv_msg);
-	free(send_msg);
+out:
+	pool_free(&msg_pool, send_msg);
 }
 
-static void rm_user_from_all_channels(int userfd)
+/* Only visits the channels this connection actually joined */
+static void rm_user_from_all_channels(struct connection *conn)
 {
-	struct list_node *tmp;
-	struct user user;
+	if (!conn)
+		return;
 
-	user.fd = userfd;
-	for (tmp = channel_list_head; tmp != NULL; tmp = tmp->next) {
-		struct channel *c = tmp->data;
-		int ret;
+	pthread_rwlock_wrlock(&channel_table_lock);
+	while (conn->joined)
+		rm_member(conn, conn->joined);
+	pthread_rwlock_unlock(&channel_table_lock);
+}
 
-		ret = rm_user_from_channel(c, &user);
-		if (ret != RESP_SUCCESS && ret != RESP_NOT_IN_CHANNEL)
-			printf("[%s:%d] Error %d removing user from channel\n",
-			       __func__, __LINE__, ret);
-	}
+static void close_client(struct worker *w, int clientfd)
+{
+	struct connection *conn = conn_lookup(clientfd);
 
+	rm_user_from_all_channels(conn);
+	if (conn && conn->list) {
+		pool_free(&list_stream_pool, conn->list);
+		conn->list = NULL;
+	}
+	if (conn && conn->login) {
+		/* Freed once its hashing thread is done with it */
+		conn->login->conn = NULL;
+		conn->login = NULL;
+	}
+	if (conn && conn->ident) {
+		identity_logout(conn->ident);
+		conn->ident = NULL;
+	}
+	backend->release(w, clientfd, conn);
 }
 
-int main(int argc, char *argv[])
+/**
+ * handle_kicked - flush or close the connections this worker was kicked for
+ * @w: the calling worker
+ *
+ * Other workers kick the connections they queued frames to on an io_uring
+ * worker. Any worker, this one included, kicks a connection whose queue
+ * limit was hit, it is closed here whether or not its socket ever becomes
+ * writable again.
+ */
+static void handle_kicked(struct worker *w)
 {
-#define EPOLL_CLIENT_DISCONNECT (EPOLLRDHUP | EPOLLIN)
-	struct epoll_event events[MAX_EPOLL_EVENTS];
-	int serverfd, epollfd;
-
-	if (setup_server_socket(&serverfd) < 0)
-		exit(EXIT_FAILURE);
+	uint32_t num, i;
+	int *fds;
 
-	if (create_epoll_manager(&epollfd))
-		exit(EXIT_FAILURE);
+	num = conn_loop_take_kicked(&w->loop, &fds);
+	for (i = 0; i < num; ++i) {
+		struct connection *conn = conn_lookup(fds[i]);
 
-	if (add_epoll_member(epollfd, serverfd, EPOLLIN))
-		exit(EXIT_FAILURE);
+		if (!conn || conn->loop != &w->loop || conn->closing)
+			continue;
 
-	while (1) {
-		int nfds, i;
+		if (conn_flush(conn))
+			close_client(w, fds[i]);
+	}
+}
 
-		nfds = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, -1);
-		if (nfds == -1) {
-			perror("epoll_wait");
-			exit(EXIT_SUCCESS);
+/**
+ * handle_logins_done - finish the LOGINs whose passwords were hashed
+ * @w: the calling worker, woken up through its kickfd
+ *
+ * Answers each LOGIN and then handles the messages its connection sent
+ * meanwhile. One of those can be another LOGIN, the rest wait for it instead.
+ */
+static void handle_logins_done(struct worker *w)
+{
+	struct login_wait *lw, *next;
+	struct message *send_msg;
+	struct connection *conn;
+	struct identity *ident;
+	uint32_t i;
+
+	pthread_mutex_lock(&w->login_lock);
+	lw = w->logins_done;
+	w->logins_done = NULL;
+	pthread_mutex_unlock(&w->login_lock);
+
+	for (; lw; lw = next) {
+		next = lw->next;
+		conn = lw->conn;
+		if (!conn) {
+			identity_login_drop(&lw->req);
+			login_wait_free(lw);
+			continue;
+		}
+
+		/* Hashed again with the salt the name has now */
+		if (identity_login_finish(&lw->req, &ident))
+			continue;
+
+		conn->ident = ident;
+		conn->login = NULL;
+		send_msg = pool_zalloc(&msg_pool);
+		if (send_msg) {
+			send_msg->response = ident ? RESP_SUCCESS :
+						     RESP_INVALID_LOGIN;
+			build_response_msg(send_msg, &lw->login);
+			if (conn_send_msg(conn, send_msg))
+				log_warn("Failed to send response to fd %d\n",
+					 conn->fd);
+			pool_free(&msg_pool, send_msg);
+		}
+
+		for (i = 0; i < lw->num_deferred; ++i) {
+			if (conn_tx_failed(conn))
+				break;
+			if (!conn->login) {
+				handle_msg(w, conn, &lw->deferred[i]);
+				continue;
+			}
+			/* Fits, they were deferred along with the new LOGIN */
+			conn->login->deferred[conn->login->num_deferred++] =
+				lw->deferred[i];
+		}
+		login_wait_free(lw);
+	}
+}
+
+/* Handle every complete message buffered, returns -1 if the client was closed */
+static int handle_rx_msgs(struct worker *w, struct connection *conn)
+{
+	struct message *recv_msg;
+
+	/* Nothing can be answered once the queue failed, stop right away */
+	while (!conn_tx_failed(conn) &&
+	       (recv_msg = conn_next_msg(conn)) != NULL) {
+		if (!conn->login) {
+			handle_msg(w, conn, recv_msg);
+			continue;
+		}
+
+		/* Waits for the LOGIN in front of it */
+		if (conn->login->num_deferred == LOGIN_MAX_DEFERRED) {
+			log_warn("fd %d sent too much behind its LOGIN\n",
+				 conn->fd);
+			close_client(w, conn->fd);
+			return -1;
+		}
+		conn->login->deferred[conn->login->num_deferred++] = *recv_msg;
+	}
+
+	if (conn->rx_state == RX_STATE_INVALID || conn_tx_failed(conn)) {
+		close_client(w, conn->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Set up a freshly accepted client, returns NULL on failure */
+static struct connection *setup_client(struct worker *w, int clientfd)
+{
+	struct connection *conn;
+	int yes = 1;
+
+	/* Writes are already batched per loop iteration, Nagle would only hold
+	 * back the tail of each batch until the peer's delayed ACK.
+	 */
+	if (setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)))
+		perror("setsockopt");
+
+	conn = conn_create(clientfd, &w->loop, client_epoll_flags);
+	if (!conn)
+		log_err("Failed to create connection for fd %d\n", clientfd);
+	else
+		metrics_add(&thread_metrics->conns_opened, 1);
+
+	return conn;
+}
+
+/**
+ * handle_recv_msg - read from a client and handle every complete message
+ * @w: worker that owns the client
+ * @conn: client connection with pending data
+ *
+ * A message split across multiple wakeups stays buffered in the connection
+ * until the rest of it arrives, and multiple pipelined messages received at
+ * once are all handled from the same receive buffer.
+ */
+static void handle_recv_msg(struct worker *w, struct connection *conn)
+{
+	int bytes;
+
+	if (!conn)
+		return;
+
+	if (conn_tx_failed(conn)) {
+		close_client(w, conn->fd);
+		return;
+	}
+
+	/* An edge triggered fd only reports EPOLLIN again once more data
+	 * arrives, so it has to be read until the socket is empty.
+	 */
+	do {
+		bytes = conn_recv(conn);
+		if (bytes == -EAGAIN)
+			return;
+
+		if (bytes == CONNECTION_CLOSED) {
+			close_client(w, conn->fd);
+			return;
+		}
+
+		if (bytes < 0) {
+			struct message err_msg = {
+				.type = ERROR,
+				.response = RESP_RECV_MSG_FAILED,
+			};
+
+			if (conn_send_msg(conn, &err_msg))
+				log_warn("Failed to send response to fd %d\n",
+					 conn->fd);
+			return;
+		}
+
+		metrics_add(&thread_metrics->bytes_in, bytes);
+		if (handle_rx_msgs(w, conn))
+			return;
+	} while (conn->epoll_flags & EPOLLET);
+}
+
+static int accept_new_client(struct worker *w)
+{
+	int clientfd;
+
+	clientfd = accept_new_epoll_member(w->loop.epollfd, w->listenfd,
+					   client_epoll_flags);
+	if (clientfd < 0)
+		return -1;
+
+	if (!setup_client(w, clientfd))
+		rm_epoll_member(w->loop.epollfd, clientfd);
+
+	return 0;
+}
+
+/* Called by a worker once it finished an iteration of its loop */
+static void worker_park(void)
+{
+	pthread_mutex_lock(&park_lock);
+	++num_parked;
+	pthread_cond_broadcast(&park_cond);
+	while (parking)
+		pthread_cond_wait(&park_cond, &park_lock);
+	--num_parked;
+	pthread_mutex_unlock(&park_lock);
+}
+
+/**
+ * park_workers - stop every worker between two iterations of its loop
+ *
+ * Each worker still handles the rest of the events it got and flushes what it
+ * queued, so once this returns no message is half handled, no lock is held and
+ * nothing but the sockets can change the server's state.
+ */
+static void park_workers(void)
+{
+	uint64_t one = 1;
+	int i;
+
+	pthread_mutex_lock(&park_lock);
+	parking = true;
+	pthread_mutex_unlock(&park_lock);
+
+	for (i = 0; i < num_workers; ++i)
+		if (write(workers[i].parkfd, &one, sizeof(one)) != sizeof(one))
+			perror("write");
+
+	pthread_mutex_lock(&park_lock);
+	while (num_parked < num_workers)
+		pthread_cond_wait(&park_cond, &park_lock);
+	pthread_mutex_unlock(&park_lock);
+}
+
+static void unpark_workers(void)
+{
+	pthread_mutex_lock(&park_lock);
+	parking = false;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+}
+
+static void list_stream_handover_save(struct handover *h,
+				      struct list_stream *ls)
+{
+	handover_put_u32(h, !!ls);
+	if (!ls)
+		return;
+
+	handover_put_u32(h, ls->type);
+	handover_put_u32(h, ls->list_key);
+	handover_put(h, ls->channel_name, CHANNEL_NAME_MAX_LEN);
+	handover_put_u32(h, ls->channel_id);
+	handover_put_u32(h, ls->pos);
+	handover_put_u32(h, ls->end);
+	handover_put_u32(h, ls->next_cursor);
+}
+
+/* Continues on the first EPOLLOUT, just like a LIST that yielded */
+static int list_stream_handover_restore(struct handover *h,
+					struct connection *conn)
+{
+	struct list_stream *ls;
+
+	if (!handover_get_u32(h))
+		return h->err;
+
+	if (!conn->ident)
+		return -1;
+
+	ls = pool_zalloc(&list_stream_pool);
+	if (!ls)
+		return -1;
+
+	ls->type = handover_get_u32(h);
+	ls->list_key = handover_get_u32(h);
+	handover_get(h, ls->channel_name, CHANNEL_NAME_MAX_LEN);
+	ls->channel_id = handover_get_u32(h);
+	ls->pos = handover_get_u32(h);
+	ls->end = handover_get_u32(h);
+	ls->next_cursor = handover_get_u32(h);
+	ls->src_user = conn->ident->name;
+
+	conn->list = ls;
+	conn_set_more(conn, true);
+
+	return h->err;
+}
+
+/* Milliseconds a handover waits for the LOGINs being hashed */
+#define HANDOVER_LOGIN_TRIES	1000
+
+/**
+ * server_handover_save - serialize the server for the binary taking over
+ * @h: handover to write
+ *
+ * Parks every worker, they are only resumed if the handover fails. A LOGIN
+ * being hashed can't be handed over, the workers are let go until none is
+ * left, for at most HANDOVER_LOGIN_TRIES milliseconds. The listening sockets
+ * come first, the new server needs them to set up its
+ * workers. A connection already failed to send to is left behind and closed
+ * when this server exits, just like its owner would have closed it.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int server_handover_save(struct handover *h)
+{
+	static const char no_user[USER_NAME_MAX_LEN];
+	struct connection *conn;
+	uint32_t i, j, num = 0;
+	int iter, max_fd = 0, tries = 0;
+
+	park_workers();
+	while (__atomic_load_n(&num_logins_pending, __ATOMIC_RELAXED)) {
+		if (++tries > HANDOVER_LOGIN_TRIES) {
+			printf("LOGINs still being hashed, not handing over\n");
+			return -1;
+		}
+		unpark_workers();
+		usleep(1000);
+		park_workers();
+	}
+	history_flush();
+
+	handover_put_u32(h, num_workers);
+	for (i = 0; i < num_workers; ++i)
+		handover_put_fd(h, workers[i].listenfd);
+
+	identity_handover_save(h);
+
+	iter = 0;
+	while ((conn = conn_next(&iter)) != NULL) {
+		if (conn->tx_failed)
+			continue;
+		if (conn->fd > max_fd)
+			max_fd = conn->fd;
+		++num;
+	}
+
+	/* Members refer to their connection by its fd in this server */
+	handover_put_u32(h, max_fd);
+	handover_put_u32(h, num);
+	iter = 0;
+	while ((conn = conn_next(&iter)) != NULL) {
+		if (conn->tx_failed)
+			continue;
+
+		handover_put_u32(h, conn->fd);
+		handover_put_fd(h, conn->fd);
+		handover_put(h, conn->ident ? conn->ident->name : no_user,
+			     USER_NAME_MAX_LEN);
+		handover_put_u32(h, conn->ident && conn->ident->interned);
+		conn_handover_save(h, conn);
+		list_stream_handover_save(h, conn->list);
+	}
+
+	/* In id order, so every channel gets its id back */
+	handover_put_u32(h, num_channels);
+	for (i = 0; i < num_channels; ++i) {
+		struct irc_channel *c = channels[i];
+
+		handover_put(h, c->chan.name, CHANNEL_NAME_MAX_LEN);
+		backlog_handover_save(h, c->backlog);
+		handover_put_u32(h, c->num_users);
+		for (j = 0; j < c->num_users; ++j)
+			handover_put_u32(h, c->users[j]->user.fd);
+	}
+
+	return h->err;
+}
+
+/**
+ * server_handover_restore - rebuild the server that is handing over
+ * @h: handover read up to the listening sockets, already given to the workers
+ *
+ * Connections are spread over the workers round robin and resume right where
+ * they were, members keep their position in their channel so LIST cursors
+ * stay valid. Called before any worker is started.
+ *
+ * Returns 0 on success, otherwise -1
+ */
+static int server_handover_restore(struct handover *h)
+{
+	struct connection **by_fd;
+	uint32_t i, j, num, max_fd;
+	int ret = -1;
+
+	if (identity_handover_restore(h))
+		return -1;
+
+	max_fd = handover_get_u32(h);
+	num = handover_get_u32(h);
+	by_fd = calloc(max_fd + 1, sizeof(*by_fd));
+	if (h->err || !by_fd) {
+		free(by_fd);
+		return -1;
+	}
+
+	for (i = 0; i < num && !h->err; ++i) {
+		struct worker *w = &workers[i % num_workers];
+		char name[USER_NAME_MAX_LEN];
+		struct connection *conn;
+		uint32_t old_fd, interned;
+		int fd;
+
+		old_fd = handover_get_u32(h);
+		fd = handover_get_fd(h);
+		handover_get(h, name, USER_NAME_MAX_LEN);
+		interned = handover_get_u32(h);
+		if (h->err || old_fd > max_fd)
+			goto out;
+
+		if (add_epoll_member(w->loop.epollfd, fd,
+				     SOCKET_EPOLL_NEW_MEMBER | client_epoll_flags))
+			goto out;
+
+		conn = setup_client(w, fd);
+		if (!conn)
+			goto out;
+		by_fd[old_fd] = conn;
+
+		/* No worker runs yet, nothing else looks at the identities. A
+		 * guest whose name was taken gets its own identity again.
+		 */
+		if (name[0] && interned) {
+			conn->ident = identity_lookup(name);
+			if (!conn->ident)
+				goto out;
+			conn->ident->fd = fd;
+		} else if (name[0]) {
+			conn->ident = identity_guest(name, fd);
+			if (!conn->ident)
+				goto out;
+		}
+
+		if (conn_handover_restore(h, conn) ||
+		    list_stream_handover_restore(h, conn))
+			goto out;
+	}
+
+	num = handover_get_u32(h);
+	for (i = 0; i < num && !h->err; ++i) {
+		char name[CHANNEL_NAME_MAX_LEN + 1] = { 0 };
+		uint32_t num_users;
+		struct irc_channel *c;
+
+		handover_get(h, name, CHANNEL_NAME_MAX_LEN);
+		c = create_channel(name);
+		if (!c || backlog_handover_restore(h, c->backlog))
+			goto out;
+
+		num_users = handover_get_u32(h);
+		for (j = 0; j < num_users && !h->err; ++j) {
+			uint32_t old_fd = handover_get_u32(h);
+			struct connection *conn;
+			struct member *member;
+
+			/* Its connection was left behind */
+			conn = old_fd <= max_fd ? by_fd[old_fd] : NULL;
+			if (!conn)
+				continue;
+
+			member = member_alloc();
+			if (!member)
+				goto out;
+
+			member->ident = conn->ident;
+			member->user.fd = conn->fd;
+			if (add_user_to_channel(c, member, conn) !=
+			    RESP_SUCCESS) {
+				member_free(member);
+				goto out;
+			}
+		}
+	}
+
+	ret = h->err;
+out:
+	free(by_fd);
+	return ret;
+}
+
+static const struct handover_ops server_handover_ops = {
+	.save = server_handover_save,
+	.resume = unpark_workers,
+};
+
+static int epoll_worker_init(struct worker *w)
+{
+	int epollfd;
+
+	if (create_epoll_manager(&epollfd))
+		return -1;
+
+	if (add_epoll_member(epollfd, w->listenfd, EPOLLIN))
+		return -1;
+
+	w->parkfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (w->parkfd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+
+	if (add_epoll_member(epollfd, w->parkfd, EPOLLIN))
+		return -1;
+
+	if (conn_loop_init(&w->loop, epollfd, NULL))
+		return -1;
+
+	return add_epoll_member(epollfd, w->loop.kickfd, EPOLLIN);
+}
+
+static void epoll_release_client(struct worker *w, int clientfd,
+				 struct connection *conn)
+{
+	/* Free the connection before the fd can be reused by another accept */
+	if (conn)
+		metrics_add(&thread_metrics->conns_closed, 1);
+	conn_destroy(conn);
+	if (rm_epoll_member(w->loop.epollfd, clientfd))
+		exit(EXIT_FAILURE);
+}
+
+static void *epoll_worker_loop(void *arg)
+{
+#define EPOLL_CLIENT_DISCONNECT (EPOLLRDHUP | EPOLLIN)
+	struct epoll_event *events;
+	struct worker *w = arg;
+	int serverfd = w->listenfd;
+	int epollfd = w->loop.epollfd;
+	bool park = false;
+
+	events = calloc(epoll_batch, sizeof(*events));
+	if (!events) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	conn_worker_init(&w->loop);
+	if (metrics_register())
+		exit(EXIT_FAILURE);
+
+	while (1) {
+		int nfds, i;
+
+		nfds = epoll_wait(epollfd, events, epoll_batch, -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_SUCCESS);
 		}
 
 		for_each_epoll_event(i, nfds) {
@@ -439,43 +1755,581 @@ int main(int argc, char *argv[])
 
 			//debug_print_epoll_event(eventfd, event_mask);
 
+			/* Finish this batch first, then park */
+			if (eventfd == w->parkfd) {
+				uint64_t val;
+
+				if (read(eventfd, &val, sizeof(val)) < 0)
+					perror("read");
+				park = true;
+				continue;
+			}
+
+			/* Kicked connections are handled after this batch, a
+			 * later event of the batch may be for one of them.
+			 */
+			if (eventfd == w->loop.kickfd) {
+				uint64_t val;
+
+				if (read(eventfd, &val, sizeof(val)) < 0)
+					perror("read");
+				continue;
+			}
+
+			/* Room in the send buffer, finish parked writes */
+			if (eventfd != serverfd && (event_mask & EPOLLOUT)) {
+				struct connection *conn = conn_lookup(eventfd);
+
+				event_mask &= ~EPOLLOUT;
+				if (conn_flush(conn)) {
+					close_client(w, eventfd);
+					continue;
+				}
+
+				/* Continue a LIST response that yielded */
+				if (conn->list)
+					list_stream_step(conn);
+
+				if (!event_mask)
+					continue;
+			}
+
 			switch (event_mask) {
 			case EPOLLIN:
 				/* Only a new client if this is the serverfd */
 				if (eventfd == serverfd) {
-					if (accept_new_epoll_member(epollfd, eventfd)) {
+					if (accept_new_client(w)) {
 						printf("accept_new_client() failed!\n");
 						exit(EXIT_FAILURE);
 					}
 				} else {
-					handle_recv_msg(epollfd, eventfd);
+					handle_recv_msg(w, conn_lookup(eventfd));
 				}
 
 				break;
 
 			case EPOLL_CLIENT_DISCONNECT:
-				rm_user_from_all_channels(eventfd);
-				if (rm_epoll_member(epollfd, eventfd))
-					exit(EXIT_FAILURE);
+				close_client(w, eventfd);
 				break;
 
 			case EPOLLERR:
-				printf("EPOLLERR on fd %d\n", eventfd);
-				close(eventfd);
+				log_info("EPOLLERR on fd %d\n", eventfd);
+				close_client(w, eventfd);
 				break;
 
 			case EPOLLHUP:
-				printf("EPOLLHUP on fd %d\n", eventfd);
-				close(eventfd);
+				log_info("EPOLLHUP on fd %d\n", eventfd);
+				close_client(w, eventfd);
 				break;
 
 			default:
-				printf("epoll event %d from fd %d not supported !\n",
-				       event_mask, eventfd);
+				/* A reset peer reports several of these at once,
+				 * it must still be logged out and freed.
+				 */
+				if (eventfd != serverfd &&
+				    (event_mask & (EPOLLERR | EPOLLHUP))) {
+					close_client(w, eventfd);
+					break;
+				}
+
+				log_warn("epoll event %u from fd %d not supported !\n",
+					 event_mask, eventfd);
 				break;
 			}
 		}
+
+		/* One send per connection for everything queued above */
+		handle_logins_done(w);
+		conn_flush_dirty();
+		handle_kicked(w);
+
+		if (park) {
+			worker_park();
+			park = false;
+		}
 	}
 
+	free(events);
+
+	return NULL;
+}
+
+static int uring_worker_init(struct worker *w)
+{
+	/* Can't be handed over, see main() */
+	w->parkfd = -1;
+	if (uring_init(&w->ring, URING_ENTRIES))
+		return -1;
+
+	if (uring_buf_ring_init(&w->ring, &w->bufs, URING_BGID, URING_NUM_BUFS,
+				URING_BUF_SIZE))
+		return -1;
+
+	return conn_loop_init(&w->loop, -1, &w->ring);
+}
+
+/**
+ * uring_release_client - close a client of an io_uring worker
+ * @w: worker that owns the client
+ * @clientfd: the client's socket
+ * @conn: the client's connection
+ *
+ * Requests still in flight reference the connection and its queued frames, so
+ * it is only freed once the last of them completed. Shutting the socket down
+ * ends its multishot receive and fails any send. The fd stays open until then
+ * so none of their completions can be mistaken for a new client's.
+ */
+static void uring_release_client(struct worker *w, int clientfd,
+				 struct connection *conn)
+{
+	if (!conn) {
+		close(clientfd);
+		return;
+	}
+
+	if (!conn->closing) {
+		conn->closing = true;
+		shutdown(clientfd, SHUT_RDWR);
+	}
+
+	if (conn->io_pending)
+		return;
+
+	metrics_add(&thread_metrics->conns_closed, 1);
+	conn_destroy(conn);
+	close(clientfd);
+}
+
+/* Prepare one of the worker's long lived requests */
+static int uring_arm(struct worker *w, enum conn_uring_op op, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&w->ring);
+	if (!sqe)
+		return -1;
+
+	switch (op) {
+	case CONN_OP_ACCEPT:
+		uring_prep_multishot_accept(sqe, fd, 0, URING_DATA(op, fd));
+		break;
+	case CONN_OP_RECV:
+		uring_prep_recv_multishot(sqe, fd, URING_BGID,
+					  URING_DATA(op, fd));
+		break;
+	case CONN_OP_KICK:
+		uring_prep_read(sqe, fd, &w->kick_val, sizeof(w->kick_val),
+				URING_DATA(op, fd));
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static void uring_handle_accept(struct worker *w, int res, uint32_t flags)
+{
+	struct connection *conn;
+
+	if (!(flags & IORING_CQE_F_MORE) &&
+	    uring_arm(w, CONN_OP_ACCEPT, w->listenfd)) {
+		printf("Failed to rearm accept\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (res < 0) {
+		errno = -res;
+		log_err("accept failed: %m\n");
+		return;
+	}
+
+	conn = setup_client(w, res);
+	if (!conn) {
+		close(res);
+		return;
+	}
+
+	if (uring_arm(w, CONN_OP_RECV, res)) {
+		close_client(w, res);
+		return;
+	}
+	++conn->io_pending;
+}
+
+/* Feed bytes received by a multishot receive through the decoder */
+static void handle_rx_bytes(struct worker *w, struct connection *conn,
+			    const uint8_t *data, uint32_t len)
+{
+	while (len) {
+		uint32_t taken = conn_rx_push(conn, data, len);
+
+		if (!taken) {
+			close_client(w, conn->fd);
+			return;
+		}
+
+		data += taken;
+		len -= taken;
+		if (handle_rx_msgs(w, conn))
+			return;
+	}
+}
+
+static void uring_handle_recv(struct worker *w, int fd, int res,
+			      uint32_t flags)
+{
+	struct connection *conn = conn_lookup(fd);
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (res > 0 && conn && !conn->closing) {
+			metrics_add(&thread_metrics->bytes_in, res);
+			handle_rx_bytes(w, conn, uring_buf(&w->bufs, bid), res);
+		}
+		uring_buf_recycle(&w->bufs, bid);
+	}
+
+	if ((flags & IORING_CQE_F_MORE) || !conn)
+		return;
+
+	--conn->io_pending;
+	if (!conn->closing) {
+		/* Ran out of buffers or the kernel ended the request, the rest
+		 * is received once it is rearmed.
+		 */
+		if (res > 0 || res == -ENOBUFS) {
+			if (!uring_arm(w, CONN_OP_RECV, fd)) {
+				++conn->io_pending;
+				return;
+			}
+		} else if (res < 0) {
+			errno = -res;
+			log_err("fd %d receive failed: %m\n", fd);
+		}
+	}
+
+	close_client(w, fd);
+}
+
+static void uring_handle_send(struct worker *w, int fd, int res)
+{
+	struct connection *conn = conn_lookup(fd);
+
+	if (!conn)
+		return;
+
+	if (conn_send_done(conn, res) || conn->closing) {
+		close_client(w, fd);
+		return;
+	}
+
+	/* Continue a LIST response that yielded */
+	if (conn->list)
+		list_stream_step(conn);
+}
+
+static void uring_handle_kick(struct worker *w)
+{
+	if (uring_arm(w, CONN_OP_KICK, w->loop.kickfd)) {
+		printf("Failed to rearm kick\n");
+		exit(EXIT_FAILURE);
+	}
+
+	handle_kicked(w);
+}
+
+static void *uring_worker_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct io_uring_cqe *cqe;
+
+	conn_worker_init(&w->loop);
+	if (metrics_register())
+		exit(EXIT_FAILURE);
+
+	if (uring_arm(w, CONN_OP_ACCEPT, w->listenfd) ||
+	    uring_arm(w, CONN_OP_KICK, w->loop.kickfd))
+		exit(EXIT_FAILURE);
+
+	while (1) {
+		/* Everything the last iteration prepared, the sends of
+		 * conn_flush_dirty() included, goes in with this one call.
+		 */
+		if (uring_submit_and_wait(&w->ring, 1))
+			exit(EXIT_FAILURE);
+
+		while ((cqe = uring_peek_cqe(&w->ring)) != NULL) {
+			uint64_t data = cqe->user_data;
+			uint32_t flags = cqe->flags;
+			int res = cqe->res;
+			int fd = URING_DATA_FD(data);
+
+			uring_cqe_seen(&w->ring);
+
+			switch (URING_DATA_OP(data)) {
+			case CONN_OP_ACCEPT:
+				uring_handle_accept(w, res, flags);
+				break;
+			case CONN_OP_RECV:
+				uring_handle_recv(w, fd, res, flags);
+				break;
+			case CONN_OP_SEND:
+				uring_handle_send(w, fd, res);
+				break;
+			case CONN_OP_KICK:
+				uring_handle_kick(w);
+				break;
+			default:
+				log_warn("io_uring completion %#llx not supported !\n",
+					 data);
+				break;
+			}
+		}
+
+		/* One send per connection for everything queued above */
+		handle_logins_done(w);
+		conn_flush_dirty();
+		handle_kicked(w);
+	}
+
+	return NULL;
+}
+
+static const struct event_backend backends[] = {
+	{
+		.name = "epoll",
+		.init = epoll_worker_init,
+		.loop = epoll_worker_loop,
+		.release = epoll_release_client,
+	},
+	{
+		.name = "io_uring",
+		.init = uring_worker_init,
+		.loop = uring_worker_loop,
+		.release = uring_release_client,
+	},
+};
+
+static const struct event_backend *find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+		if (!strcmp(backends[i].name, name))
+			return &backends[i];
+
+	return NULL;
+}
+
+static void print_pool_stats(void)
+{
+	pool_print_stats(&msg_pool);
+	pool_print_stats(&list_stream_pool);
+	pool_print_stats(&login_wait_pool);
+	identity_print_pool_stats();
+	backlog_print_pool_stats();
+	channel_print_pool_stats();
+	conn_print_pool_stats();
+}
+
+static void print_usage(char *prog)
+{
+	printf("Usage: %s [-w num_workers] [-B backend] [-e epoll_batch] [-E]\n"
+	       "\t[-m metrics_socket] [-H history_dir] [-U handover_socket]\n"
+	       "\t-w: number of event loop threads (default %d, max %d)\n"
+	       "\t-B: event loop backend, epoll (default) or io_uring\n"
+	       "\t-e: events handled per epoll_wait() (default %d, max %d)\n"
+	       "\t-E: edge triggered clients, each wakeup reads until EAGAIN\n"
+	       "\t-m: serve Prometheus metrics over HTTP on this Unix socket\n"
+	       "\t-H: keep every channel's CHATs in this directory for HISTORY\n"
+	       "\t-U: take over from the server on this Unix socket if one is\n"
+	       "\t    running, then wait there for the next binary to take over\n"
+	       "Set PDX_IRC_LOG_LEVEL to err, warn, info (default) or debug\n"
+	       "Send SIGUSR1 to print memory pool statistics\n",
+	       prog, DEFAULT_NUM_WORKERS, MAX_NUM_WORKERS, MAX_EPOLL_EVENTS,
+	       MAX_EPOLL_BATCH);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *metrics_path = NULL;
+	const char *history_path = NULL;
+	const char *handover_path = NULL;
+	struct handover h = { 0 };
+	uint32_t num_listenfds = 0;
+	int handover_sock = -1;
+	sigset_t sigset;
+	int opt, i, sig;
+
+	backend = &backends[0];
+	while ((opt = getopt(argc, argv, "w:B:e:Em:H:U:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			num_workers = atoi(optarg);
+			if (num_workers < 1 || num_workers > MAX_NUM_WORKERS) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'B':
+			backend = find_backend(optarg);
+			if (!backend) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'e':
+			epoll_batch = atoi(optarg);
+			if (epoll_batch < 1 || epoll_batch > MAX_EPOLL_BATCH) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'E':
+			client_epoll_flags = EPOLLET;
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'H':
+			history_path = optarg;
+			break;
+		case 'U':
+			handover_path = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	/* An io_uring worker has requests in flight on every socket, they
+	 * would keep consuming data after the sockets were handed over.
+	 */
+	if (handover_path && backend != &backends[0]) {
+		printf("-U is only supported by the epoll backend\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (log_init())
+		exit(EXIT_FAILURE);
+
+	if (conn_table_init())
+		exit(EXIT_FAILURE);
+
+	if (identity_table_init() || backlog_pool_init() ||
+	    channel_pools_init())
+		exit(EXIT_FAILURE);
+
+	if (hash_table_init(&channel_table,
+			    offsetof(struct irc_channel, chan.name),
+			    CHANNEL_NAME_MAX_LEN))
+		exit(EXIT_FAILURE);
+
+	if (pool_init(&msg_pool, "message", sizeof(struct message),
+		      MSGS_PER_SLAB, true))
+		exit(EXIT_FAILURE);
+
+	if (pool_init(&list_stream_pool, "list_stream",
+		      sizeof(struct list_stream), LIST_STREAMS_PER_SLAB, true))
+		exit(EXIT_FAILURE);
+
+	if (pool_init(&login_wait_pool, "login_wait",
+		      sizeof(struct login_wait), LOGIN_WAITS_PER_SLAB, true))
+		exit(EXIT_FAILURE);
+
+	/* Block SIGUSR1 in every worker, the main thread waits for it below */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	if (handover_path) {
+		handover_sock = handover_connect(handover_path);
+		if (handover_sock >= 0) {
+			if (handover_recv(handover_sock, &h))
+				exit(EXIT_FAILURE);
+
+			/* Closing a listening socket would reset the
+			 * connections waiting on it, every one gets a worker.
+			 */
+			num_listenfds = handover_get_u32(&h);
+			if (h.err || num_listenfds > MAX_NUM_WORKERS)
+				exit(EXIT_FAILURE);
+			if (num_workers < num_listenfds)
+				num_workers = num_listenfds;
+		}
+	}
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Each worker owns a listening socket and an event loop */
+	for (i = 0; i < num_workers; ++i) {
+		struct worker *w = &workers[i];
+
+		w->id = i;
+		pthread_mutex_init(&w->login_lock, NULL);
+		if (i < num_listenfds) {
+			w->listenfd = handover_get_fd(&h);
+			if (w->listenfd < 0)
+				exit(EXIT_FAILURE);
+		} else if (setup_server_socket(&w->listenfd) < 0) {
+			exit(EXIT_FAILURE);
+		}
+
+		if (backend->init(w))
+			exit(EXIT_FAILURE);
+	}
+
+	/* Channels taken over open their history again */
+	if (history_path && history_start(history_path))
+		exit(EXIT_FAILURE);
+
+	if (handover_sock >= 0) {
+		/* Restoring counts into metrics like any worker does */
+		if (metrics_register() || server_handover_restore(&h)) {
+			printf("Cannot take over, the old server keeps running\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("Took over %u sockets from the old server\n",
+		       h.num_fds);
+		handover_free(&h);
+
+		if (handover_ack(handover_sock))
+			exit(EXIT_FAILURE);
+	}
+
+	if (metrics_path && metrics_start(metrics_path, report_backlogs))
+		exit(EXIT_FAILURE);
+
+	if (handover_path && handover_start(handover_path, &server_handover_ops))
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < num_workers; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, backend->loop,
+				   &workers[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Workers exit the process on fatal errors, just report stats here */
+	while (1) {
+		if (sigwait(&sigset, &sig))
+			continue;
+
+		if (sig == SIGUSR1) {
+			print_pool_stats();
+			fflush(stdout);
+		}
+	}
+
+	free(workers);
+
 	return 0;
 }